@@ -0,0 +1,738 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "abundance.h"
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#ifdef ABUNDANCE_TEST
+#include "rng.h"
+#endif
+
+#define SAMPLE_DICT_INIT 64
+#define NAME_BATCH 4096
+
+/* samples and counts found by one thread */
+struct name_scan{
+        struct sample_dict* dict;
+        struct sample_count* pair;      /* local sample numbers */
+        int* map;                       /* local to global sample number */
+        long int num_pair;
+        long int alloc_pair;
+};
+
+static int scan_name(const char* name, struct name_scan* ns, int* count, int* num_fields);
+static int add_pair(struct name_scan* ns, int sample, int count);
+static int parse_count(const char* p, const char* end);
+static uint64_t hash_name(const char* name, int len);
+static int grow_sample_dict(struct sample_dict* d);
+static int compare_sample(const void *a, const void *b);
+
+#ifdef ABUNDANCE_TEST
+static int ref_count(const char* name);
+static int random_name(char* buf, struct rng_state* rng);
+static int pooled_count_test(void);
+
+int main(int argc, char *argv[])
+{
+        struct msa* msa = NULL;
+        struct rng_state* rng = NULL;
+        char** names = NULL;
+        char** order = NULL;
+        char* p = NULL;
+        int num_order = 0;
+        int num = 500;
+        int threads[3] = {1, 3, 8};
+        int n_abund;
+        int i,j,t;
+
+        RUN(pooled_count_test());
+        RUNP(rng = init_rng(42));
+        MMALLOC(names, sizeof(char*) * num);
+        for(i = 0; i < num;i++){
+                names[i] = NULL;
+                MMALLOC(names[i], sizeof(char) * 256);
+                RUN(random_name(names[i], rng));
+        }
+        for(t = 0; t < 3;t++){
+#ifdef HAVE_OPENMP
+                omp_set_num_threads(threads[t]);
+#endif
+                RUNP(msa = alloc_msa());
+                for(i = 0; i < num;i++){
+                        msa->seq_store[i].name = names[i];
+                        msa->seq_store[i].abund = NULL;
+                        msa->seq_store[i].num_abund = 0;
+                        msa->sequences[i] = msa->seq_store + i;
+                }
+                msa->numseq = num;
+                RUN(set_counts_from_names(msa));
+                n_abund = 0;
+                for(i = 0; i < num;i++){
+                        ASSERT(msa->sequences[i]->count == ref_count(names[i]), "Wrong count for %s: %d", names[i], msa->sequences[i]->count);
+                        for(j = 0; j < msa->sequences[i]->num_abund;j++){
+                                /* every pair is sample:count in the name */
+                                p = msa->sample_names[msa->sequences[i]->abund[j].sample];
+                                ASSERT(strstr(names[i], p) != NULL, "Sample %s not in %s", p, names[i]);
+                                n_abund++;
+                        }
+                }
+                /* sample numbers must not depend on the threads */
+                if(!order){
+                        num_order = msa->num_samples;
+                        MMALLOC(order, sizeof(char*) * num_order);
+                        for(i = 0; i < num_order;i++){
+                                order[i] = NULL;
+                                MMALLOC(order[i], sizeof(char) * (strlen(msa->sample_names[i]) + 1));
+                                strcpy(order[i], msa->sample_names[i]);
+                        }
+                }
+                ASSERT(msa->num_samples == num_order, "Found %d samples, expected %d", msa->num_samples, num_order);
+                for(i = 0; i < num_order;i++){
+                        ASSERT(!strcmp(order[i], msa->sample_names[i]), "Sample %d differs: %s %s", i, order[i], msa->sample_names[i]);
+                }
+                LOG_MSG("%d threads: %d samples, %d pairs.", threads[t], msa->num_samples, n_abund);
+                msa->numseq = 0;
+                free_msa(msa);
+                msa = NULL;
+        }
+        for(i = 0; i < num;i++){
+                MFREE(names[i]);
+        }
+        MFREE(names);
+        for(i = 0; i < num_order;i++){
+                MFREE(order[i]);
+        }
+        MFREE(order);
+        MFREE(rng);
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+
+/* Pools a file without counts in the names and one with samples and
+   counts; the sample table has to keep one column per file. */
+int pooled_count_test(void)
+{
+        struct msa* msa = NULL;
+        struct msa_seq** s = NULL;
+        char* infile[2] = {"abtest_a.fa", "abtest_b.fa"};
+        FILE* f_ptr = NULL;
+        /* sample, count pairs of the three unique sequences */
+        int expect[3][4] = {{0, 2, 1, 4}, {0, 1, -1, 0}, {1, 2, -1, 0}};
+        int count[5] = {1, 1, 1, 4, 2};
+        int i,j;
+
+        RUNP(f_ptr = fopen(infile[0], "w"));
+        fprintf(f_ptr,">a1\nACGT\n>a2\nACGA\n>a3\nACGT\n");
+        fclose(f_ptr);
+        RUNP(f_ptr = fopen(infile[1], "w"));
+        fprintf(f_ptr,">b1;s7:4\nACGT\n>b2;s8:1;s9:1\nTTTT\n");
+        fclose(f_ptr);
+
+        RUNP(msa = alloc_msa());
+        RUNP(msa = read_inputs(infile, 2, msa));
+        ASSERT(msa->numseq == 5, "Pooled %d records, expected 5.", msa->numseq);
+        RUN(set_counts_from_names(msa));
+        ASSERT(msa->num_samples == 2, "Found %d samples, expected the 2 files.", msa->num_samples);
+        s = msa->sequences;
+        for(i = 0; i < 5;i++){
+                ASSERT(s[i]->count == count[i], "Record %d counts %d, expected %d.", i, s[i]->count, count[i]);
+        }
+        /* merge the duplicates of ACGT as collapse_duplicates does */
+        s[0]->dup = s[2];
+        s[2]->dup = s[3];
+        s[0]->count += s[2]->count + s[3]->count;
+        s[2] = s[4];
+        msa->numseq = 3;
+        RUN(set_sample_counts(msa));
+        for(i = 0; i < 3;i++){
+                for(j = 0; j < 2 && expect[i][2*j] != -1;j++){
+                        ASSERT(j < s[i]->num_abund, "Sequence %d: %d samples.", i, s[i]->num_abund);
+                        ASSERT(s[i]->abund[j].sample == expect[i][2*j] && s[i]->abund[j].count == expect[i][2*j+1], "Sequence %d: sample %d count %d, expected %d %d.", i, s[i]->abund[j].sample, s[i]->abund[j].count, expect[i][2*j], expect[i][2*j+1]);
+                }
+                ASSERT(s[i]->num_abund == j, "Sequence %d: %d samples, expected %d.", i, s[i]->num_abund, j);
+        }
+        free_msa(msa);
+        msa = NULL;
+        remove(infile[0]);
+        remove(infile[1]);
+        LOG_MSG("Pooled count tests OK.");
+        return OK;
+ERROR:
+        if(msa){
+                free_msa(msa);
+        }
+        return FAIL;
+}
+
+/* the parser this module replaces */
+int ref_count(const char* name)
+{
+        char buffer[256];
+        char* tmp = NULL;
+        char* t1;
+        char* t2;
+        int count;
+        int j;
+
+        strncpy(buffer, name, 255);
+        buffer[255] = 0;
+        tmp = buffer;
+        count = 0;
+        t1 = strchr(tmp, ';');
+        while (t1 != NULL){
+                *t1++ = '\0';
+                t2 = strtok(tmp, ":");
+                j = 0;
+                while (t2 != NULL){
+                        if(j & 1){
+                                count += atoi(t2);
+                        }
+                        t2 = strtok(NULL, ":");
+                        j++;
+                }
+                tmp = t1;
+                t1 = strchr(tmp, ';');
+        }
+        t2 = strtok(tmp, ":");
+        j = 0;
+        while (t2 != NULL){
+                if(j & 1){
+                        count += atoi(t2);
+                }
+                t2 = strtok(NULL, ":");
+                j++;
+        }
+        return count;
+}
+
+/* names built from samples, counts, junk and stray separators */
+int random_name(char* buf, struct rng_state* rng)
+{
+        const char* part[10] = {"s0", "s1", "s2", "7", "12", "x3", "", ":", ";", "-4"};
+        int n;
+        int i;
+
+        buf[0] = 0;
+        n = 1 + tl_random_int(rng, 12);
+        for(i = 0; i < n;i++){
+                strcat(buf, part[tl_random_int(rng, 10)]);
+                strcat(buf, tl_random_int(rng, 4) ? ":" : ";");
+        }
+        return OK;
+}
+#endif
+
+int set_counts_from_names(struct msa* msa)
+{
+        struct name_scan* ns = NULL;
+        struct sample_dict* dict = NULL;
+        struct sample_count* store = NULL;
+        struct msa_seq* seq = NULL;
+        long int* first = NULL;
+        long int* base = NULL;
+        int num_threads;
+        int team;
+        int status;
+        int i,j,t;
+
+        num_threads = 1;
+#ifdef HAVE_OPENMP
+        num_threads = omp_get_max_threads();
+#endif
+        MMALLOC(ns, sizeof(struct name_scan) * num_threads);
+        for(t = 0; t < num_threads;t++){
+                ns[t].dict = NULL;
+                ns[t].pair = NULL;
+                ns[t].map = NULL;
+                ns[t].num_pair = 0;
+                ns[t].alloc_pair = 0;
+        }
+        for(t = 0; t < num_threads;t++){
+                RUNP(ns[t].dict = alloc_sample_dict());
+        }
+        MMALLOC(first, sizeof(long int) * (msa->numseq + 1));
+        MMALLOC(base, sizeof(long int) * (num_threads + 1));
+
+        /* each thread takes a contiguous range of records */
+        status = OK;
+        team = 1;
+#ifdef HAVE_OPENMP
+#pragma omp parallel num_threads(num_threads) shared(msa, ns, first, status, team) private(i, t, seq)
+#endif
+        {
+                struct name_reader* nr = NULL;
+                int from;
+                int to;
+                int b;
+                int c;
+                int n;
+                int ok;
+                t = 0;
+#ifdef HAVE_OPENMP
+                t = omp_get_thread_num();
+#pragma omp single
+                team = omp_get_num_threads();
+#endif
+                from = (long int) msa->numseq * t / team;
+                to = (long int) msa->numseq * (t+1) / team;
+                ok = OK;
+                if(msa->name_src && (nr = open_name_reader(msa)) == NULL){
+                        ok = FAIL;
+                }
+                /* lazy names are read back a batch at a time */
+                for(b = from; b < to && ok == OK;b += NAME_BATCH){
+                        n = MACRO_MIN(NAME_BATCH, to - b);
+                        if(nr && load_msa_names(nr, msa, msa->sequences + b, n) != OK){
+                                ok = FAIL;
+                                break;
+                        }
+                        for(i = b; i < b + n;i++){
+                                seq = msa->sequences[i];
+                                first[i] = ns[t].num_pair;
+                                if(scan_name(seq->name, ns + t, &seq->count, &c) != OK){
+                                        ok = FAIL;
+                                        break;
+                                }
+                                /* a pooled record without a count is
+                                   one read of its file */
+                                if(!c && msa->sample_names){
+                                        seq->count = 1;
+                                }
+                                seq->num_abund = ns[t].num_pair - first[i];
+                        }
+                        if(nr){
+                                unload_msa_names(msa, msa->sequences + b, n);
+                        }
+                }
+                close_name_reader(nr);
+                if(ok != OK){
+#ifdef HAVE_OPENMP
+#pragma omp atomic write
+#endif
+                        status = FAIL;
+                }
+        }
+        if(status != OK){
+                ERROR_MSG("Reading counts from the sequence names failed.");
+        }
+
+        base[0] = 0;
+        for(t = 0; t < team;t++){
+                base[t+1] = base[t] + ns[t].num_pair;
+        }
+        if(base[team]){
+                /* merge the dictionaries in record order */
+                RUNP(dict = alloc_sample_dict());
+                for(t = 0; t < team;t++){
+                        if(ns[t].dict->num){
+                                MMALLOC(ns[t].map, sizeof(int) * ns[t].dict->num);
+                        }
+                        for(i = 0; i < ns[t].dict->num;i++){
+                                RUN(sample_dict_intern(dict, ns[t].dict->name[i], strlen(ns[t].dict->name[i]), &ns[t].map[i]));
+                        }
+                }
+                MMALLOC(store, sizeof(struct sample_count) * base[team]);
+#ifdef HAVE_OPENMP
+#pragma omp parallel for num_threads(num_threads) private(j)
+#endif
+                for(t = 0; t < team;t++){
+                        for(j = 0; j < ns[t].num_pair;j++){
+                                store[base[t] + j].sample = ns[t].map[ns[t].pair[j].sample];
+                                store[base[t] + j].count = ns[t].pair[j].count;
+                        }
+                }
+                for(t = 0; t < team;t++){
+                        for(i = (long int) msa->numseq * t / team; i < (long int) msa->numseq * (t+1) / team;i++){
+                                seq = msa->sequences[i];
+                                seq->abund = seq->num_abund ? store + base[t] + first[i] : NULL;
+                        }
+                }
+
+                if(msa->sample_names){
+                        /* pooled input: the samples are the input files */
+                        LOG_MSG("Found %d samples in the sequence names; counting per input file instead.", dict->num);
+                        for(i = 0; i < msa->numseq;i++){
+                                msa->sequences[i]->abund = NULL;
+                                msa->sequences[i]->num_abund = 0;
+                        }
+                        MFREE(store);
+                        store = NULL;
+                }else{
+                        if(msa->abund_store){
+                                MFREE(msa->abund_store);
+                        }
+                        msa->sample_names = dict->name;
+                        msa->num_samples = dict->num;
+                        msa->abund_store = store;
+                        dict->name = NULL;
+                        dict->num = 0;
+                        LOG_MSG("Found %d samples in the sequence names.", msa->num_samples);
+                }
+                free_sample_dict(dict);
+                dict = NULL;
+        }
+
+        for(t = 0; t < num_threads;t++){
+                free_sample_dict(ns[t].dict);
+                if(ns[t].pair){
+                        MFREE(ns[t].pair);
+                }
+                if(ns[t].map){
+                        MFREE(ns[t].map);
+                }
+        }
+        MFREE(ns);
+        MFREE(first);
+        MFREE(base);
+        return OK;
+ERROR:
+        if(ns){
+                for(t = 0; t < num_threads;t++){
+                        free_sample_dict(ns[t].dict);
+                        if(ns[t].pair){
+                                MFREE(ns[t].pair);
+                        }
+                        if(ns[t].map){
+                                MFREE(ns[t].map);
+                        }
+                }
+                MFREE(ns);
+        }
+        free_sample_dict(dict);
+        if(first){
+                MFREE(first);
+        }
+        if(base){
+                MFREE(base);
+        }
+        return FAIL;
+}
+
+/* One pass over a name: fields end at ':', ';' or the end; a ';' starts
+   a new group. Empty fields are skipped and counts are read like atoi,
+   as the strtok based parser did. num_fields is the number of count
+   fields, zero ones included. */
+int scan_name(const char* name, struct name_scan* ns, int* count, int* num_fields)
+{
+        const char* p = name;
+        const char* tok = name;
+        const char* sample = NULL;
+        int sample_len = 0;
+        int field = 0;
+        int id;
+        int n;
+
+        *count = 0;
+        *num_fields = 0;
+        while(1){
+                if(*p == ':' || *p == ';' || *p == 0){
+                        if(p > tok){
+                                if(field & 1){
+                                        n = parse_count(tok, p);
+                                        *count += n;
+                                        *num_fields += 1;
+                                        if(n){
+                                                RUN(sample_dict_intern(ns->dict, sample, sample_len, &id));
+                                                RUN(add_pair(ns, id, n));
+                                        }
+                                }else{
+                                        sample = tok;
+                                        sample_len = p - tok;
+                                }
+                                field++;
+                        }
+                        if(*p == ';'){
+                                field = 0;
+                        }
+                        if(*p == 0){
+                                break;
+                        }
+                        tok = p + 1;
+                }
+                p++;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int parse_count(const char* p, const char* end)
+{
+        long int n = 0;
+        int sign = 1;
+
+        while(p < end && isspace((int) *p)){
+                p++;
+        }
+        if(p < end && (*p == '-' || *p == '+')){
+                sign = *p == '-' ? -1 : 1;
+                p++;
+        }
+        while(p < end && *p >= '0' && *p <= '9'){
+                n = n * 10 + (*p - '0');
+                p++;
+        }
+        return (int) (sign * n);
+}
+
+int add_pair(struct name_scan* ns, int sample, int count)
+{
+        if(ns->num_pair == ns->alloc_pair){
+                ns->alloc_pair = ns->alloc_pair ? ns->alloc_pair << 1 : 1024;
+                MREALLOC(ns->pair, sizeof(struct sample_count) * ns->alloc_pair);
+        }
+        ns->pair[ns->num_pair].sample = sample;
+        ns->pair[ns->num_pair].count = count;
+        ns->num_pair++;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Sums the counts of each unique sequence per sample over its duplicate
+   chain. The counts come out sparse: one entry, in sample order, per
+   sample the sequence was seen in. Without samples in the names the
+   samples are the input files. */
+int set_sample_counts(struct msa* msa)
+{
+        struct sample_count* store = NULL;
+        struct sample_count* tmp = NULL;
+        struct msa_seq* rep = NULL;
+        struct msa_seq* dup = NULL;
+        long int* off = NULL;
+        long int alloc;
+        long int n;
+        int alloc_tmp;
+        int num_tmp;
+        int own;
+        int i,j;
+
+        alloc = msa->numseq + 1;
+        alloc_tmp = 64;
+        MMALLOC(store, sizeof(struct sample_count) * alloc);
+        MMALLOC(tmp, sizeof(struct sample_count) * alloc_tmp);
+        MMALLOC(off, sizeof(long int) * (msa->numseq + 1));
+        n = 0;
+        for(i = 0; i < msa->numseq;i++){
+                rep = msa->sequences[i];
+                /* rep->count already holds the whole chain */
+                own = rep->count;
+                for(dup = rep->dup; dup; dup = dup->dup){
+                        own -= dup->count;
+                }
+                num_tmp = 0;
+                for(dup = rep; dup; dup = dup->dup){
+                        if(num_tmp + dup->num_abund + 1 > alloc_tmp){
+                                while(num_tmp + dup->num_abund + 1 > alloc_tmp){
+                                        alloc_tmp <<= 1;
+                                }
+                                MREALLOC(tmp, sizeof(struct sample_count) * alloc_tmp);
+                        }
+                        if(dup->num_abund){
+                                memcpy(tmp + num_tmp, dup->abund, sizeof(struct sample_count) * dup->num_abund);
+                                num_tmp += dup->num_abund;
+                        }else if(!msa->abund_store){
+                                tmp[num_tmp].sample = dup->sample;
+                                tmp[num_tmp].count = dup == rep ? own : dup->count;
+                                num_tmp += tmp[num_tmp].count != 0;
+                        }
+                }
+                qsort(tmp, num_tmp, sizeof(struct sample_count), compare_sample);
+                if(n + num_tmp > alloc){
+                        while(n + num_tmp > alloc){
+                                alloc <<= 1;
+                        }
+                        MREALLOC(store, sizeof(struct sample_count) * alloc);
+                }
+                off[i] = n;
+                for(j = 0; j < num_tmp;j++){
+                        if(n > off[i] && store[n-1].sample == tmp[j].sample){
+                                store[n-1].count += tmp[j].count;
+                        }else{
+                                store[n] = tmp[j];
+                                n++;
+                        }
+                }
+        }
+        off[msa->numseq] = n;
+        for(i = 0; i < msa->numseq;i++){
+                rep = msa->sequences[i];
+                for(dup = rep->dup; dup; dup = dup->dup){
+                        dup->abund = NULL;
+                        dup->num_abund = 0;
+                }
+                rep->abund = store + off[i];
+                rep->num_abund = off[i+1] - off[i];
+        }
+        if(msa->abund_store){
+                MFREE(msa->abund_store);
+        }
+        msa->abund_store = store;
+        MFREE(tmp);
+        MFREE(off);
+        return OK;
+ERROR:
+        if(store){
+                MFREE(store);
+        }
+        if(tmp){
+                MFREE(tmp);
+        }
+        if(off){
+                MFREE(off);
+        }
+        return FAIL;
+}
+
+int compare_sample(const void *a, const void *b)
+{
+        const struct sample_count* sa = (const struct sample_count*) a;
+        const struct sample_count* sb = (const struct sample_count*) b;
+
+        return sa->sample - sb->sample;
+}
+
+struct sample_dict* alloc_sample_dict(void)
+{
+        struct sample_dict* d = NULL;
+        int i;
+
+        MMALLOC(d, sizeof(struct sample_dict));
+        d->name = NULL;
+        d->hash = NULL;
+        d->table = NULL;
+        d->num = 0;
+        d->alloc = SAMPLE_DICT_INIT;
+        d->table_size = SAMPLE_DICT_INIT * 2;
+        MMALLOC(d->name, sizeof(char*) * d->alloc);
+        MMALLOC(d->hash, sizeof(uint64_t) * d->alloc);
+        MMALLOC(d->table, sizeof(int) * d->table_size);
+        for(i = 0; i < d->table_size;i++){
+                d->table[i] = -1;
+        }
+        return d;
+ERROR:
+        free_sample_dict(d);
+        return NULL;
+}
+
+/* id of name[0..len), added if new */
+int sample_dict_intern(struct sample_dict* d, const char* name, int len, int* id)
+{
+        uint64_t h;
+        int slot;
+        int i;
+
+        h = hash_name(name, len);
+        slot = h & (d->table_size - 1);
+        while((i = d->table[slot]) != -1){
+                if(d->hash[i] == h && !strncmp(d->name[i], name, len) && d->name[i][len] == 0){
+                        *id = i;
+                        return OK;
+                }
+                slot = (slot + 1) & (d->table_size - 1);
+        }
+        if(d->num == d->alloc){
+                RUN(grow_sample_dict(d));
+                slot = h & (d->table_size - 1);
+                while(d->table[slot] != -1){
+                        slot = (slot + 1) & (d->table_size - 1);
+                }
+        }
+        i = d->num;
+        d->name[i] = NULL;
+        MMALLOC(d->name[i], sizeof(char) * (len + 1));
+        memcpy(d->name[i], name, len);
+        d->name[i][len] = 0;
+        d->hash[i] = h;
+        d->table[slot] = i;
+        d->num++;
+        *id = i;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* doubles the capacity; the table stays at most half full */
+int grow_sample_dict(struct sample_dict* d)
+{
+        int slot;
+        int i;
+
+        d->alloc <<= 1;
+        d->table_size <<= 1;
+        MREALLOC(d->name, sizeof(char*) * d->alloc);
+        MREALLOC(d->hash, sizeof(uint64_t) * d->alloc);
+        MFREE(d->table);
+        MMALLOC(d->table, sizeof(int) * d->table_size);
+        for(i = 0; i < d->table_size;i++){
+                d->table[i] = -1;
+        }
+        for(i = 0; i < d->num;i++){
+                slot = d->hash[i] & (d->table_size - 1);
+                while(d->table[slot] != -1){
+                        slot = (slot + 1) & (d->table_size - 1);
+                }
+                d->table[slot] = i;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* FNV-1a */
+uint64_t hash_name(const char* name, int len)
+{
+        uint64_t h = 0xcbf29ce484222325ul;
+        int i;
+
+        for(i = 0; i < len;i++){
+                h ^= (uint8_t) name[i];
+                h *= 0x100000001b3ul;
+        }
+        return h;
+}
+
+void free_sample_dict(struct sample_dict* d)
+{
+        int i;
+
+        if(d){
+                if(d->name){
+                        for(i = 0; i < d->num;i++){
+                                MFREE(d->name[i]);
+                        }
+                        MFREE(d->name);
+                }
+                if(d->hash){
+                        MFREE(d->hash);
+                }
+                if(d->table){
+                        MFREE(d->table);
+                }
+                MFREE(d);
+        }
+}
@@ -0,0 +1,61 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ABUNDANCE_H
+#define ABUNDANCE_H
+
+#include "global.h"
+#include "msa.h"
+
+/* Counts and per-sample abundances taken from the record names.
+
+   A name lists sample:count pairs, groups separated by ';':
+
+   640_RS:1;mTCR_215-RS-1:1;mTCR_412-RS-5:1
+
+   Within a group the ':' separated fields alternate between sample and
+   count (empty fields are skipped); the count of a record is the sum of
+   all counts. Names are tokenized in one pass, in parallel over the
+   records. Each thread interns the samples it sees into its own
+   dictionary; the dictionaries are merged in record order afterwards,
+   so sample numbers follow their first appearance in the input.
+
+   Pooled input keeps the input files as samples: the counts in the
+   names still give the record counts, a record without any count field
+   counts once, and the samples in the names are not used. */
+struct sample_dict{
+        char** name;
+        uint64_t* hash;
+        int* table;             /* open addressing, -1 marks a free slot */
+        int table_size;
+        int num;
+        int alloc;
+};
+
+extern int set_counts_from_names(struct msa* msa);
+extern int set_sample_counts(struct msa* msa);
+
+extern struct sample_dict* alloc_sample_dict(void);
+extern int sample_dict_intern(struct sample_dict* d, const char* name, int len, int* id);
+extern void free_sample_dict(struct sample_dict* d);
+
+#endif
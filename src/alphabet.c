@@ -21,6 +21,22 @@
 */
 
 #include "alphabet.h"
+#include "simd.h"
+
+#if defined(HAVE_SSE41) || defined(HAVE_AVX2)
+#include <immintrin.h>
+#endif
+
+static int encode_serial(const int8_t* t, const char* seq, uint8_t* s, int i, int len);
+#ifdef HAVE_SSE41
+static int encode_sse41(const int8_t* t, const char* seq, uint8_t* s, int len);
+#endif
+#ifdef HAVE_AVX2
+static int encode_avx2(const int8_t* t, const char* seq, uint8_t* s, int len);
+#endif
+
+/* selected by alphabet_set_simd() */
+static int (*encode_kernel)(const int8_t* t, const char* seq, uint8_t* s, int len) = NULL;
 
 int create_default_protein(struct alphabet* a);
 int create_default_DNA(struct alphabet* a);
@@ -112,6 +128,110 @@ ERROR:
         return NULL;
 }
 
+int encode_residues(const struct alphabet* a, const char* seq, uint8_t* s, int len)
+{
+        if(encode_kernel){
+                return encode_kernel(a->to_internal, seq, s, len);
+        }
+        return encode_serial(a->to_internal, seq, s, 0, len);
+}
+
+int alphabet_set_simd(int level)
+{
+        encode_kernel = NULL;
+#ifdef HAVE_SSE41
+        if(level >= SIMD_SSE41){
+                encode_kernel = encode_sse41;
+        }
+#endif
+#ifdef HAVE_AVX2
+        if(level >= SIMD_AVX2){
+                encode_kernel = encode_avx2;
+        }
+#endif
+        return OK;
+}
+
+/* encodes residues i .. len-1 */
+static int encode_serial(const int8_t* t, const char* seq, uint8_t* s, int i, int len)
+{
+        int bad = 0;
+        int c;
+        for(; i < len;i++){
+                c = (uint8_t) seq[i];
+                if(c >= 128 || t[c] == -1){
+                        bad++;
+                }else{
+                        s[i] = t[c];
+                }
+        }
+        return bad;
+}
+
+/* The SIMD versions look up 16 or 32 characters at a time: the low
+   nibble indexes a shuffle of each 16 entry row of to_internal and the
+   high nibble selects the row. Characters >= 128 match no row and stay
+   -1. */
+#ifdef HAVE_SSE41
+static SIMD_TARGET_SSE41 int encode_sse41(const int8_t* t, const char* seq, uint8_t* s, int len)
+{
+        __m128i row[8];
+        __m128i nib = _mm_set1_epi8(0x0f);
+        __m128i none = _mm_set1_epi8(-1);
+        __m128i v,lo,hi,r;
+        int bad = 0;
+        int i = 0;
+        int h;
+        if(len >= 16){
+                for(h = 0; h < 8;h++){
+                        row[h] = _mm_loadu_si128((const __m128i*) (t + 16 * h));
+                }
+                for(i = 0; i + 16 <= len;i += 16){
+                        v = _mm_loadu_si128((const __m128i*) (seq + i));
+                        lo = _mm_and_si128(v, nib);
+                        hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+                        r = none;
+                        for(h = 0; h < 8;h++){
+                                r = _mm_blendv_epi8(r, _mm_shuffle_epi8(row[h], lo), _mm_cmpeq_epi8(hi, _mm_set1_epi8(h)));
+                        }
+                        _mm_storeu_si128((__m128i*) (s + i), r);
+                        bad += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(r, none)));
+                }
+        }
+        return bad + encode_serial(t, seq, s, i, len);
+}
+#endif
+
+#ifdef HAVE_AVX2
+static SIMD_TARGET_AVX2 int encode_avx2(const int8_t* t, const char* seq, uint8_t* s, int len)
+{
+        __m256i row[8];
+        __m256i nib = _mm256_set1_epi8(0x0f);
+        __m256i none = _mm256_set1_epi8(-1);
+        __m256i v,lo,hi,r;
+        int bad = 0;
+        int i = 0;
+        int h;
+        if(len >= 32){
+                for(h = 0; h < 8;h++){
+                        row[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) (t + 16 * h)));
+                }
+                for(i = 0; i + 32 <= len;i += 32){
+                        v = _mm256_loadu_si256((const __m256i*) (seq + i));
+                        lo = _mm256_and_si256(v, nib);
+                        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+                        r = none;
+                        for(h = 0; h < 8;h++){
+                                r = _mm256_blendv_epi8(r, _mm256_shuffle_epi8(row[h], lo), _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(h)));
+                        }
+                        _mm256_storeu_si256((__m256i*) (s + i), r);
+                        bad += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(r, none)));
+                }
+        }
+        return bad + encode_serial(t, seq, s, i, len);
+}
+#endif
+
 int switch_alphabet(struct alphabet* a, int type)
 {
         int i;
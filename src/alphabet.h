@@ -40,6 +40,10 @@ struct alphabet{
 extern struct alphabet* create_alphabet(int type);
 extern int switch_alphabet(struct alphabet* a, int type);
 
+/* Writes the internal code of each of the len characters of seq to s and
+   returns the number of characters not in the alphabet. */
+extern int encode_residues(const struct alphabet* a, const char* seq, uint8_t* s, int len);
+
 
 
 #endif
@@ -20,8 +20,6 @@
 
 */
 
-#include <xmmintrin.h>
-
 #include <float.h>
 #include "msa.h"
 #include "bpm.h"
@@ -140,7 +138,7 @@ int build_tree_kmeans(struct msa* msa)
         exit(0);
         MFREE(root);
         for(i =0 ; i < msa->numseq;i++){
-                _mm_free(dm[i]);
+                MFREE(dm[i]);
         }
         MFREE(dm);
 
@@ -176,7 +174,7 @@ int test_for_merge(struct node* n, struct msa* msa, int threshold)
         int len_a,len_b;
 
         int num_a,num_b;
-        uint8_t d;
+        int d;
         int i,j;
 
 
@@ -193,10 +191,10 @@ int test_for_merge(struct node* n, struct msa* msa, int threshold)
                                 for(j = 0;j < num_b;j++){
                                         b = msa->sequences[samples_b[j]]->s;
                                         len_b = msa->sequences[samples_b[j]]->len;
-                                        d = MACRO_MAX(
-                                                bpm_256(a,b,len_a,len_b),
-                                                bpm_256(b,a,len_b,len_a)
-                                                );
+                                        d = bpm_global_banded(a,b,len_a,len_b,threshold);
+                                        if(d < 0){
+                                                ERROR_MSG("Global distance failed.");
+                                        }
                                         if(d <= threshold){
                                                 LOG_MSG("We are merging because of:");
                                                 LOG_MSG("%s",msa->sequences[samples_a[i]]->seq);
@@ -279,10 +277,13 @@ struct node* bisecting_kmeans(struct msa* msa, struct node* n, float** dm,int* s
         num_var = num_var << 3;
 
 
-        wr = _mm_malloc(sizeof(float) * num_var,32);
-        wl = _mm_malloc(sizeof(float) * num_var,32);
-        cr = _mm_malloc(sizeof(float) * num_var,32);
-        cl = _mm_malloc(sizeof(float) * num_var,32);
+        /* 32 byte aligned for the edist kernels */
+        if(posix_memalign((void**) &wr, 32, sizeof(float) * num_var) ||
+           posix_memalign((void**) &wl, 32, sizeof(float) * num_var) ||
+           posix_memalign((void**) &cr, 32, sizeof(float) * num_var) ||
+           posix_memalign((void**) &cl, 32, sizeof(float) * num_var)){
+                ERROR_MSG("posix_memalign failed.");
+        }
 
 
         RUNP(best = alloc_kmeans_result(num_samples));
@@ -295,7 +296,9 @@ struct node* bisecting_kmeans(struct msa* msa, struct node* n, float** dm,int* s
                 sl = res_tmp->sl;
                 sr = res_tmp->sr;
 
-                w = _mm_malloc(sizeof(float) * num_var,32);
+                if(posix_memalign((void**) &w, 32, sizeof(float) * num_var)){
+                        ERROR_MSG("posix_memalign failed.");
+                }
                 for(i = 0; i < num_var;i++){
                         w[i] = 0.0f;
                         wr[i] = 0.0f;
@@ -327,7 +330,7 @@ struct node* bisecting_kmeans(struct msa* msa, struct node* n, float** dm,int* s
                         //      fprintf(stdout,"%f %f  %f\n", cl[j],cr[j],w[j]);
                 }
 
-                _mm_free(w);
+                MFREE(w);
 
                 /* check if cr == cl - we have identical sequences  */
                 s = 0;
@@ -363,13 +366,8 @@ struct node* bisecting_kmeans(struct msa* msa, struct node* n, float** dm,int* s
                                 score = 0.0f;
                                 for(i = 0; i < num_samples;i++){
                                         s = samples[i];
-#ifdef HAVE_AVX2
-                                        edist_256(dm[s], cl, num_anchors, &dl);
-                                        edist_256(dm[s], cr, num_anchors, &dr);
-#else
-                                        edist_serial(dm[s], cl, num_anchors, &dl);
-                                        edist_serial(dm[s], cr, num_anchors, &dr);
-#endif
+                                        edist(dm[s], cl, num_anchors, &dl);
+                                        edist(dm[s], cr, num_anchors, &dr);
                                         score += MACRO_MIN(dl,dr);
 
                                         if(dr < dl){
@@ -441,10 +439,10 @@ struct node* bisecting_kmeans(struct msa* msa, struct node* n, float** dm,int* s
 
         MFREE(best);
 
-        _mm_free(wr);
-        _mm_free(wl);
-        _mm_free(cr);
-        _mm_free(cl);
+        MFREE(wr);
+        MFREE(wl);
+        MFREE(cr);
+        MFREE(cl);
 
         n = alloc_node();
         n->samples = samples;
@@ -21,20 +21,113 @@
 */
 
 #include "bpm.h"
+#include "simd.h"
 #include  <stdalign.h>
+#include <string.h>
 
 #include "rng.h"
 
-#ifdef HAVE_AVX2
+/* words of the padded pattern bitmasks that fit on the stack  */
+#define BPM_BAND_WORDS 8
+
+/* text columns whose pattern bitmasks the batched kernels look up
+   ahead of the column loop */
+#define BPM_BATCH_COLS 32
+/* independent register sets of the batched kernels and the most
+   candidates one kernel call takes */
+#define BPM_BATCH_SETS 2
+#define BPM_MAX_LANES 32
+/* queues of candidate texts in steps of 8 residues in bpm_batch_lanes */
+#define BPM_TEXT_CLASSES 9
+
+/* largest threshold of the banded global distance: k+1 has to fit in
+   the byte results */
+#define BPM_GLOBAL_MAX_K 254
+
+/* generic vector extensions for the baseline batched kernels */
+#if defined(__GNUC__) || defined(__clang__)
+#define BPM_VECTOR_EXT
+#endif
+
+static uint8_t global_dp_banded(const uint8_t* t,const uint8_t* p,int n,int m,int k);
+static int band_words(int m, int k);
+static void set_band_peq(uint64_t* P, int nw, const uint8_t* p, int m, int k);
+static inline uint8_t global_banded_kernel(const uint64_t* P, int nw, const uint8_t* t,int n,int m,int k);
+static uint8_t bpm_64(const uint8_t* t,const uint8_t* p,int n,int m);
+static uint8_t bpm_128(const uint8_t* t,const uint8_t* p,int n,int m);
+static uint8_t bpm_256_words(const uint8_t* t,const uint8_t* p,int n,int m);
+static int bpm_batch_generic(const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs);
+static int bpm_global_batch_generic(const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out);
+
+/* The batched kernels of one instruction set: sc[w] and cs[w] compare
+   the seed with up to lanes[w] candidates in 16, 32 and 64 bit lanes
+   (w = 0, 1, 2); out[j] belongs to idx[j]. gl[w] is the banded global
+   distance, with the band of the seed (bpm_peq) as s; its lanes hold
+   bands up to 16, 32 and 64 bits. */
+typedef void (*bpm_lane_fn)(const uint8_t* s,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* out);
+
+struct bpm_lane_kernels{
+        bpm_lane_fn sc[3];
+        bpm_lane_fn cs[3];
+        bpm_lane_fn gl[3];
+        int lanes[3];
+};
+
+static int bpm_batch_lanes(const struct bpm_lane_kernels* lk, const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs);
+static int bpm_global_lanes(const struct bpm_lane_kernels* lk, const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out);
+static inline int bpm_lane_width(int len);
+static void bpm_lane_flush(bpm_lane_fn f, const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, const int* pos, int num, int k, uint8_t* out);
+
+/* Kernels picked by bpm_set_simd(): patterns longer than 128 residues
+   and the batched comparisons. */
+static struct bpm_kernels{
+        uint8_t (*wide)(const uint8_t* t,const uint8_t* p,int n,int m);
+        int (*batch)(const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs);
+        int (*global_batch)(const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out);
+} bpm_kernels = {
+        bpm_256_words,
+        bpm_batch_generic,
+        bpm_global_batch_generic
+};
+
+#if defined(HAVE_AVX2) || defined(HAVE_AVX512)
 #include <immintrin.h>
 
-__m256i BROADCAST_MASK[16];
+/* Carry of each 64 bit lane of add256 for the 16 carry patterns; bit 63
+   undoes the bias add256 applies to its first argument. */
+#define BPM_CARRY(c) {                          \
+                0x8000000000000000ul | ((c) & 1),        \
+                0x8000000000000000ul | (((c) >> 1) & 1), \
+                0x8000000000000000ul | (((c) >> 2) & 1), \
+                0x8000000000000000ul | (((c) >> 3) & 1)  \
+        }
+
+alignas(32) static const uint64_t broadcast_mask[16][4] = {
+        BPM_CARRY(0), BPM_CARRY(1), BPM_CARRY(2), BPM_CARRY(3),
+        BPM_CARRY(4), BPM_CARRY(5), BPM_CARRY(6), BPM_CARRY(7),
+        BPM_CARRY(8), BPM_CARRY(9), BPM_CARRY(10), BPM_CARRY(11),
+        BPM_CARRY(12), BPM_CARRY(13), BPM_CARRY(14), BPM_CARRY(15)
+};
+
+#define BPM_BATCH_LARGE 0x3FFF
+#endif
 
- void bitShiftLeft256ymm (__m256i *data, int count);
-__m256i bitShiftRight256ymm (__m256i *data, int count);
+#ifdef HAVE_AVX2
+#define SIMD_SUFFIX avx2
+#define SIMD_TARGET SIMD_TARGET_AVX2
+#include "bpm_simd.h"
+#undef SIMD_SUFFIX
+#undef SIMD_TARGET
+#endif
 
-/* taken from Alexander Yee: http://www.numberworld.org/y-cruncher/internals/addition.html#ks_add */
- __m256i add256(uint32_t carry, __m256i A, __m256i B);
+#ifdef HAVE_AVX512
+#define SIMD_SUFFIX avx512
+#define SIMD_TARGET SIMD_TARGET_AVX512
+#define BPM_SIMD_VL
+#include "bpm_simd.h"
+#undef SIMD_SUFFIX
+#undef SIMD_TARGET
+#undef BPM_SIMD_VL
 #endif
 
 /* Below are test functions  */
@@ -45,25 +138,41 @@ __m256i bitShiftRight256ymm (__m256i *data, int count);
 /* Functions needed for the unit test*/
 uint8_t dyn_256(const uint8_t* t,const uint8_t* p,int n,int m);
 uint8_t dyn_256_print(const uint8_t* t,const uint8_t* p,int n,int m);
+int dyn_global(const uint8_t* t,const uint8_t* p,int n,int m);
+int dyn_semi(const uint8_t* t,const uint8_t* p,int n,int m);
 int  mutate_seq(uint8_t* s, int len,int k,int L, struct rng_state* rng);
 
 #ifdef HAVE_AVX2
 /* For debugging */
-void print_256(__m256i X);
-void print_256_all(__m256i X);
+SIMD_TARGET_AVX2 void print_256(__m256i X);
+SIMD_TARGET_AVX2 void print_256_all(__m256i X);
 #endif
 
 /* The actual test.  */
 int bpm_test(void);
+int bpm_batch_test(void);
+int bpm_global_test(void);
+int bpm_kernel_test(void);
+int bpm_blocks_test(void);
 
 int main(int argc, char *argv[])
 {
+        int level;
 
-        /* Important set_broadcast_mask has to be called before using bpm_256!!! */
-#ifdef HAVE_AVX2
-        set_broadcast_mask();
-#endif
-        RUN(bpm_test());
+        /* every kernel set the build and the CPU support; SSE4.1 has
+           no kernels of its own here */
+        for(level = SIMD_SCALAR; level <= simd_cpu_level();level++){
+                if(level == SIMD_SSE41){
+                        continue;
+                }
+                LOG_MSG("Testing %s kernels", simd_level_name(level));
+                RUN(bpm_set_simd(level));
+                RUN(bpm_test());
+                RUN(bpm_batch_test());
+                RUN(bpm_kernel_test());
+        }
+        RUN(bpm_global_test());
+        RUN(bpm_blocks_test());
         return EXIT_SUCCESS;
 ERROR:
         return EXIT_FAILURE;
@@ -113,7 +222,7 @@ int bpm_test(void)
 //        len = 63;
         calc_errors = 0;
         total_calc = 0;
-        len =63; //could fix;
+        len = strlen(seq);
         for(i = 0; i < 10;i++){
                 for (j =0 ; j < test_iter; j++){
                         RUN(mutate_seq(b,len,i,alphabet->L,rng));
@@ -148,11 +257,7 @@ int bpm_test(void)
                 for (j =0 ; j < test_iter; j++){
                         RUN(mutate_seq(b,len,i,alphabet->L,rng));
                         dyn_score = dyn_256(a,b,len,len);
-#ifdef HAVE_AVX2
                         bpm_score = bpm_256(a,b,len,len);
-#else
-                        bpm_score = dyn_score;
-#endif
                         if( abs( dyn_score - bpm_score) != 0){
                                 fprintf(stdout,"Scores differ: %d (dyn) %d (bpm) (%d out of %d)\n", dyn_score,bpm_score, calc_errors , total_calc);
                                 calc_errors++;
@@ -193,13 +298,9 @@ int bpm_test(void)
 
 
                 START_TIMER(t);
-#ifdef HAVE_AVX2
                 for(j = 0; j < timing_iter;j++){
                         bpm_score = bpm_256(a,b,len,len);
                 }
-#else
-                bpm_score = dyn_score;
-#endif
                 STOP_TIMER(t);
 
                 bpm_timing = GET_TIMING(t);
@@ -221,6 +322,595 @@ ERROR:
         return FAIL;
 }
 
+int bpm_batch_test(void)
+{
+        struct bpm_soa* soa = NULL;
+        struct bpm_soa* near = NULL;
+        struct bpm_peq* peq = NULL;
+        struct rng_state* rng = NULL;
+        uint8_t** seq = NULL;
+        uint8_t* buf = NULL;
+        uint8_t* d_sc = NULL;
+        uint8_t* d_cs = NULL;
+        int* len = NULL;
+        int* idx = NULL;
+        int numseq = 4096;
+        int i,j,c;
+        int k,d,n,e;
+        int errors = 0;
+        int pairs = 0;
+        double serial_timing;
+        double batch_timing;
+
+        RUNP(rng = init_rng(0));
+
+        MMALLOC(seq, sizeof(uint8_t*) * numseq);
+        MMALLOC(len, sizeof(int) * numseq);
+        MMALLOC(idx, sizeof(int) * numseq);
+        MMALLOC(d_sc, sizeof(uint8_t) * numseq);
+        MMALLOC(d_cs, sizeof(uint8_t) * numseq);
+
+        /* mostly CDR3 like lengths plus a few that need the wider lanes */
+        for(i = 0; i < numseq;i++){
+                seq[i] = NULL;
+                if(tl_random_int(rng,10)){
+                        len[i] = 8 + tl_random_int(rng,20);
+                }else{
+                        len[i] = 1 + tl_random_int(rng,100);
+                }
+                MMALLOC(seq[i], sizeof(uint8_t) * len[i]);
+                for(j = 0; j < len[i];j++){
+                        seq[i][j] = tl_random_int(rng,redPROTEIN);
+                }
+                /* make some neighbours of the previous sequence */
+                if(i && len[i] == len[i-1] && tl_random_int(rng,2)){
+                        for(j = 0; j < len[i];j++){
+                                seq[i][j] = seq[i-1][j];
+                        }
+                        RUN(mutate_seq(seq[i],len[i],tl_random_int(rng,4),redPROTEIN,rng));
+                }
+                idx[i] = i;
+        }
+        RUNP(soa = alloc_bpm_soa(numseq, 100));
+        for(i = 0; i < numseq;i++){
+                RUN(set_bpm_soa_seq(soa, i, seq[i], len[i]));
+        }
+
+        for(i = 0; i < 64;i++){
+                c = tl_random_int(rng, numseq - 512);
+                RUN(bpm_batch(seq[i], len[i], soa, idx + c, 512, -1, d_sc, d_cs));
+                for(j = 0; j < 512;j++){
+                        if(d_sc[j] != bpm_256(seq[i], seq[c+j], len[i], len[c+j])){
+                                errors++;
+                        }
+                        if(d_cs[j] != bpm_256(seq[c+j], seq[i], len[c+j], len[i])){
+                                errors++;
+                        }
+                        pairs++;
+                }
+        }
+        ASSERT(errors == 0, "Batched bpm differs from bpm_256 in %d of %d comparisons.", errors, pairs);
+
+        /* with a threshold distances above k come back as k+1 */
+        for(i = 0; i < 64;i++){
+                k = i % 4;
+                c = tl_random_int(rng, numseq - 512);
+                RUN(bpm_batch(seq[i], len[i], soa, idx + c, 512, k, d_sc, d_cs));
+                for(j = 0; j < 512;j++){
+                        d = bpm_256(seq[i], seq[c+j], len[i], len[c+j]);
+                        if(d_sc[j] != MACRO_MIN(d, k+1)){
+                                errors++;
+                        }
+                        d = bpm_256(seq[c+j], seq[i], len[c+j], len[i]);
+                        if(d_cs[j] != MACRO_MIN(d, k+1)){
+                                errors++;
+                        }
+                }
+        }
+        ASSERT(errors == 0, "Bounded batched bpm wrong in %d comparisons.", errors);
+
+        /* banded global distances against edited copies of the seed, for
+           every lane width and k > 31; k = 1 is timed against one
+           bpm_global_banded_peq call per candidate */
+        RUNP(near = alloc_bpm_soa(512, 160));
+        RUNP(peq = alloc_bpm_peq());
+        MMALLOC(buf, sizeof(uint8_t) * 160);
+        serial_timing = 0.0;
+        batch_timing = 0.0;
+        DECLARE_TIMER(t);
+        for(i = 0; i < 160;i++){
+                k = i % 8;
+                if(i >= 64){
+                        k = i < 96 ? 8 + tl_random_int(rng, 40) : 1;
+                }
+                for(c = 0; c < 512;c++){
+                        n = len[i];
+                        memcpy(buf, seq[i], n);
+                        e = tl_random_int(rng, k + 3);
+                        for(j = 0; j < e;j++){
+                                d = tl_random_int(rng, n + 1);
+                                switch(tl_random_int(rng, 3)){
+                                case 0:
+                                        if(d < n){
+                                                buf[d] = tl_random_int(rng,redPROTEIN);
+                                        }
+                                        break;
+                                case 1:
+                                        if(n < 160){
+                                                memmove(buf + d + 1, buf + d, n - d);
+                                                buf[d] = tl_random_int(rng,redPROTEIN);
+                                                n++;
+                                        }
+                                        break;
+                                default:
+                                        if(d < n){
+                                                memmove(buf + d, buf + d + 1, n - d - 1);
+                                                n--;
+                                        }
+                                        break;
+                                }
+                        }
+                        RUN(set_bpm_soa_seq(near, c, buf, n));
+                }
+                RUN(set_bpm_peq(peq, seq[i], len[i], k));
+                START_TIMER(t);
+                RUN(bpm_global_banded_batch(peq, near, idx, 512, d_sc));
+                STOP_TIMER(t);
+                if(i >= 96){
+                        batch_timing += GET_TIMING(t);
+                }
+                START_TIMER(t);
+                for(c = 0; c < 512;c++){
+                        d_cs[c] = bpm_global_banded_peq(peq, near->s + (size_t) c * near->stride, near->len[c]);
+                }
+                STOP_TIMER(t);
+                if(i >= 96){
+                        serial_timing += GET_TIMING(t);
+                }
+                for(c = 0; c < 512;c++){
+                        d = bpm_global_banded(near->s + (size_t) c * near->stride, seq[i], near->len[c], len[i], k);
+                        if(d_sc[c] != d || d_cs[c] != d){
+                                errors++;
+                        }
+                }
+        }
+        ASSERT(errors == 0, "Batched banded global distance wrong in %d comparisons.", errors);
+        fprintf(stdout,"bpm_global_banded_peq\tbpm_global_banded_batch\tSpeedup\n");
+        fprintf(stdout,"%f\t%f\t%f (threshold 1)\n",serial_timing,batch_timing,  serial_timing / batch_timing);
+
+        /* throughput on CDR3 like sequences */
+        for(i = 0; i < numseq;i++){
+                idx[i] = -1;
+        }
+        c = 0;
+        for(i = 0; i < numseq;i++){
+                if(len[i] <= 32){
+                        idx[c] = i;
+                        c++;
+                }
+        }
+
+        START_TIMER(t);
+        for(i = 0; i < 64;i++){
+                for(j = 0; j < c;j++){
+                        d_sc[j] = bpm_256(seq[i], seq[idx[j]], len[i], len[idx[j]]);
+                        d_cs[j] = bpm_256(seq[idx[j]], seq[i], len[idx[j]], len[i]);
+                }
+        }
+        STOP_TIMER(t);
+        serial_timing = GET_TIMING(t);
+
+        START_TIMER(t);
+        for(i = 0; i < 64;i++){
+                RUN(bpm_batch(seq[i], len[i], soa, idx, c, -1, d_sc, d_cs));
+        }
+        STOP_TIMER(t);
+        batch_timing = GET_TIMING(t);
+
+        /* the reference is one bpm_256 call per pair and direction,
+           i.e. the 64 bit word kernel for these lengths */
+        fprintf(stdout,"bpm_256\tbpm_batch\tSpeedup\n");
+        fprintf(stdout,"%f\t%f\t%f (%d pairs)\n",serial_timing,batch_timing,  serial_timing / batch_timing, 64 * c);
+
+        START_TIMER(t);
+        for(i = 0; i < 64;i++){
+                RUN(bpm_batch(seq[i], len[i], soa, idx, c, 2, d_sc, d_cs));
+        }
+        STOP_TIMER(t);
+        batch_timing = GET_TIMING(t);
+        fprintf(stdout,"%f\t%f\t%f (threshold 2)\n",serial_timing,batch_timing,  serial_timing / batch_timing);
+
+        free_bpm_soa(soa);
+        free_bpm_soa(near);
+        free_bpm_peq(peq);
+        for(i = 0; i < numseq;i++){
+                MFREE(seq[i]);
+        }
+        MFREE(seq);
+        MFREE(len);
+        MFREE(idx);
+        MFREE(d_sc);
+        MFREE(d_cs);
+        MFREE(buf);
+        MFREE(rng);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* every kernel width against the dynamic programming, on patterns of
+   all lengths up to 255 */
+int bpm_kernel_test(void)
+{
+        struct rng_state* rng = NULL;
+        uint8_t* a = NULL;
+        uint8_t* b = NULL;
+        int len_a,len_b;
+        int ref,d;
+        int errors = 0;
+        int total = 0;
+        int i,j;
+        double wide_timing;
+        double narrow_timing;
+
+        RUNP(rng = init_rng(1));
+        MMALLOC(a, sizeof(uint8_t) * 512);
+        MMALLOC(b, sizeof(uint8_t) * 32 * 32);
+        for(i = 0; i < 20000;i++){
+                len_a = 1 + tl_random_int(rng, 400);
+                len_b = 1 + tl_random_int(rng, 255);
+                for(j = 0; j < len_a;j++){
+                        a[j] = tl_random_int(rng, 4);
+                }
+                /* half of the patterns are taken from the text */
+                if(i & 1 && len_b <= len_a){
+                        j = tl_random_int(rng, len_a - len_b + 1);
+                        memcpy(b, a + j, len_b);
+                        RUN(mutate_seq(b, len_b, tl_random_int(rng, 8), 4, rng));
+                }else{
+                        for(j = 0; j < len_b;j++){
+                                b[j] = tl_random_int(rng, 4);
+                        }
+                }
+                ref = dyn_256(a, b, len_a, len_b);
+                if(len_b <= 64){
+                        errors += bpm_64(a, b, len_a, len_b) != ref;
+                        total++;
+                }
+                if(len_b <= 128){
+                        errors += bpm_128(a, b, len_a, len_b) != ref;
+                        total++;
+                }
+                d = bpm_kernels.wide(a, b, len_a, len_b);
+                errors += d != ref;
+                d = bpm(a, b, len_a, len_b);
+                if(d != ref && errors < 10){
+                        fprintf(stdout,"Scores differ: %d (dyn) %d (bpm) len %d %d\n", ref, d, len_a, len_b);
+                }
+                errors += d != ref;
+                total += 2;
+        }
+        ASSERT(errors == 0, "%d kernel errors out of %d", errors, total);
+        LOG_MSG("Kernel widths: %d comparisons OK.", total);
+
+        /* short patterns: the 256 bit kernel against the one word kernel */
+        len_a = 18;
+        for(j = 0; j < len_a;j++){
+                a[j] = tl_random_int(rng, 20);
+        }
+        for(i = 0; i < 32;i++){
+                for(j = 0; j < len_a;j++){
+                        b[i * len_a + j] = a[j];
+                }
+                RUN(mutate_seq(b + i * len_a,len_a,i & 3,20,rng));
+        }
+        d = 0;
+        DECLARE_TIMER(t);
+        START_TIMER(t);
+        for(i = 0; i < 1000000;i++){
+                j = (i & 31) * len_a;
+                d += bpm_kernels.wide(a,b+j,len_a,len_a);
+        }
+        STOP_TIMER(t);
+        wide_timing = GET_TIMING(t);
+        START_TIMER(t);
+        for(i = 0; i < 1000000;i++){
+                j = (i & 31) * len_a;
+                d += bpm(a,b+j,len_a,len_a);
+        }
+        STOP_TIMER(t);
+        narrow_timing = GET_TIMING(t);
+        fprintf(stdout,"256 bit\t64 bit\tratio\t(%d)\n%f\t%f\t%f\n", d & 1, wide_timing, narrow_timing, wide_timing / narrow_timing);
+
+        MFREE(a);
+        MFREE(b);
+        MFREE(rng);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* block kernel against the dynamic programming on long patterns with
+   substitutions and deletions, exact and with thresholds */
+int bpm_blocks_test(void)
+{
+        struct rng_state* rng = NULL;
+        uint8_t* a = NULL;
+        uint8_t* b = NULL;
+        int len_a,len_b;
+        int ref,d,k;
+        int errors = 0;
+        int total = 0;
+        int i,j,c;
+        double exact_timing;
+        double bounded_timing;
+
+        RUNP(rng = init_rng(2));
+        MMALLOC(a, sizeof(uint8_t) * 2048);
+        MMALLOC(b, sizeof(uint8_t) * 2048);
+        for(i = 0; i < 2000;i++){
+                len_a = 1 + tl_random_int(rng, 1500);
+                for(j = 0; j < len_a;j++){
+                        a[j] = tl_random_int(rng, 4);
+                }
+                if(i & 1){
+                        j = tl_random_int(rng, len_a);
+                        len_b = 1 + tl_random_int(rng, len_a - j);
+                        memcpy(b, a + j, len_b);
+                        RUN(mutate_seq(b, len_b, tl_random_int(rng, 16), 4, rng));
+                        for(c = tl_random_int(rng, 4); c > 0 && len_b > 1;c--){
+                                j = tl_random_int(rng, len_b);
+                                memmove(b + j, b + j + 1, len_b - j - 1);
+                                len_b--;
+                        }
+                }else{
+                        len_b = 1 + tl_random_int(rng, 1500);
+                        for(j = 0; j < len_b;j++){
+                                b[j] = tl_random_int(rng, 4);
+                        }
+                }
+                ref = dyn_semi(a, b, len_a, len_b);
+                d = bpm_blocks(a, b, len_a, len_b, -1);
+                if(d != ref && errors < 10){
+                        fprintf(stdout,"Scores differ: %d (dyn) %d (blocks) len %d %d\n", ref, d, len_a, len_b);
+                }
+                errors += d != ref;
+                total++;
+                for(k = 0; k < 64;k = k * 2 + 1){
+                        d = bpm_blocks(a, b, len_a, len_b, k);
+                        errors += d != (ref <= k ? ref : k + 1);
+                        total++;
+                }
+                if(len_b > 255){
+                        errors += bpm(a, b, len_a, len_b) != MACRO_MIN(ref, 255);
+                        total++;
+                }
+        }
+        ASSERT(errors == 0, "%d block kernel errors out of %d", errors, total);
+        LOG_MSG("Block kernel: %d comparisons OK.", total);
+
+        /* timing: unrelated 1500 residue reads, the common case when
+           a seed is compared against the other sequences */
+        len_a = 1500;
+        for(j = 0; j < len_a;j++){
+                a[j] = tl_random_int(rng, 4);
+                b[j] = tl_random_int(rng, 4);
+        }
+        d = 0;
+        DECLARE_TIMER(t);
+        START_TIMER(t);
+        for(i = 0; i < 200;i++){
+                d += bpm_blocks(a, b, len_a, len_a, -1);
+        }
+        STOP_TIMER(t);
+        exact_timing = GET_TIMING(t);
+        START_TIMER(t);
+        for(i = 0; i < 200;i++){
+                d += bpm_blocks(a, b, len_a, len_a, 10);
+        }
+        STOP_TIMER(t);
+        bounded_timing = GET_TIMING(t);
+        fprintf(stdout,"Exact\tk=10\tratio\t(%d)\n%f\t%f\t%f\n", d & 1, exact_timing, bounded_timing, exact_timing / bounded_timing);
+
+        MFREE(a);
+        MFREE(b);
+        MFREE(rng);
+        return OK;
+ERROR:
+        MFREE(a);
+        MFREE(b);
+        MFREE(rng);
+        return FAIL;
+}
+
+int bpm_global_test(void)
+{
+        struct rng_state* rng = NULL;
+        struct bpm_peq* peq = NULL;
+        uint8_t* a = NULL;
+        uint8_t* b = NULL;
+        uint8_t** all = NULL;
+        int* all_len = NULL;
+        int num_all = 0;
+        int max_len = 6;
+        int L = 3;
+        int i,j,c,k;
+        int len_a,len_b;
+        int ref,semi,d;
+        int errors = 0;
+        int total = 0;
+        double exact_timing;
+        double banded_timing;
+        double peq_timing;
+
+        RUNP(rng = init_rng(0));
+        RUNP(peq = alloc_bpm_peq());
+
+        /* exhaustive: all sequences up to length 6 over a 3 letter
+           alphabet against each other  */
+        c = 1;
+        for(i = 0; i <= max_len;i++){
+                num_all += c;
+                c *= L;
+        }
+        MMALLOC(all, sizeof(uint8_t*) * num_all);
+        MMALLOC(all_len, sizeof(int) * num_all);
+        c = 0;
+        for(len_a = 0; len_a <= max_len;len_a++){
+                k = 1;
+                for(i = 0; i < len_a;i++){
+                        k *= L;
+                }
+                for(i = 0; i < k;i++){
+                        all[c] = NULL;
+                        MMALLOC(all[c], sizeof(uint8_t) * (max_len + 1));
+                        all_len[c] = len_a;
+                        d = i;
+                        for(j = 0; j < len_a;j++){
+                                all[c][j] = d % L;
+                                d /= L;
+                        }
+                        c++;
+                }
+        }
+        for(i = 0; i < num_all;i++){
+                for(j = 0; j < num_all;j++){
+                        ref = dyn_global(all[i], all[j], all_len[i], all_len[j]);
+                        if(all_len[i] && all_len[j]){
+                                semi = MACRO_MAX(dyn_256(all[i], all[j], all_len[i], all_len[j]),
+                                                 dyn_256(all[j], all[i], all_len[j], all_len[i]));
+                                if(semi > ref){
+                                        errors++;
+                                }
+                        }
+                        for(k = 0; k <= 4;k++){
+                                d = bpm_global_banded(all[i], all[j], all_len[i], all_len[j], k);
+                                if(d != MACRO_MIN(ref, k+1)){
+                                        if(errors < 10){
+                                                fprintf(stdout,"Global scores differ: %d (dyn) %d (banded) k=%d\n", ref, d, k);
+                                        }
+                                        errors++;
+                                }
+                                total++;
+                        }
+                }
+        }
+        ASSERT(errors == 0, "%d global errors (exhaustive) out of %d", errors, total);
+        LOG_MSG("Exhaustive global test: %d comparisons OK.", total);
+
+        /* long sequences: exercises multi word bands, the heap path and
+           the dynamic programming fall back for k > 31 */
+        MMALLOC(a, sizeof(uint8_t) * 1024);
+        MMALLOC(b, sizeof(uint8_t) * 1024);
+        for(i = 0; i < 4000;i++){
+                len_a = 1 + tl_random_int(rng, i < 3000 ? 200 : 1000);
+                for(j = 0; j < len_a;j++){
+                        a[j] = tl_random_int(rng, 20);
+                }
+                len_b = 0;
+                c = tl_random_int(rng, 40);
+                for(j = 0; j < len_a && len_b < 1024;j++){
+                        if(tl_random_int(rng, len_a) < c){
+                                switch(tl_random_int(rng,3)){
+                                case 0:
+                                        b[len_b++] = tl_random_int(rng, 20);
+                                        break;
+                                case 1:
+                                        break;
+                                default:
+                                        b[len_b++] = a[j];
+                                        if(len_b < 1024){
+                                                b[len_b++] = tl_random_int(rng, 20);
+                                        }
+                                        break;
+                                }
+                        }else{
+                                b[len_b++] = a[j];
+                        }
+                }
+                if(!len_b){
+                        b[len_b++] = 0;
+                }
+                ref = dyn_global(a, b, len_a, len_b);
+                /* thresholds above 40 (up to 254) on every 20th pair */
+                for(k = 0; k <= BPM_GLOBAL_MAX_K && (k <= 40 || !(i % 20));k+= (k < 8) ? 1 : (k < 41 ? 11 : 71)){
+                        d = bpm_global_banded(a, b, len_a, len_b, k);
+                        if(d != MACRO_MIN(ref, k+1)){
+                                if(errors < 10){
+                                        fprintf(stdout,"Global scores differ: %d (dyn) %d (banded) k=%d len %d %d\n", ref, d, k, len_a, len_b);
+                                }
+                                errors++;
+                        }
+                        d = bpm_global_banded(b, a, len_b, len_a, k);
+                        if(d != MACRO_MIN(ref, k+1)){
+                                errors++;
+                        }
+                        RUN(set_bpm_peq(peq, a, len_a, k));
+                        d = bpm_global_banded_peq(peq, b, len_b);
+                        if(d != MACRO_MIN(ref, k+1)){
+                                errors++;
+                        }
+                        total+= 3;
+                }
+        }
+        ASSERT(errors == 0, "%d global errors out of %d", errors, total);
+        /* thresholds the byte results can not hold are refused */
+        ASSERT(bpm_global_banded(a, b, len_a, len_b, -1) == -1, "k = -1 accepted.");
+        ASSERT(bpm_global_banded(a, b, len_a, len_b, BPM_GLOBAL_MAX_K + 1) == -1, "k = %d accepted.", BPM_GLOBAL_MAX_K + 1);
+        ASSERT(set_bpm_peq(peq, a, len_a, BPM_GLOBAL_MAX_K + 1) == FAIL, "k = %d accepted.", BPM_GLOBAL_MAX_K + 1);
+
+        /* timing against the two semi-global calls it replaces */
+        DECLARE_TIMER(t);
+        len_a = 18;
+        for(j = 0; j < len_a;j++){
+                a[j] = tl_random_int(rng, 20);
+        }
+        for(c = 0; c < 32;c++){
+                for(j = 0; j < len_a;j++){
+                        b[c * len_a + j] = a[j];
+                }
+                RUN(mutate_seq(b + c * len_a,len_a,c & 3,20,rng));
+        }
+        d = 0;
+        START_TIMER(t);
+        for(i = 0; i < 1000000;i++){
+                c = (i & 31) * len_a;
+                d += MACRO_MAX(bpm_256(a,b+c,len_a,len_a), bpm_256(b+c,a,len_a,len_a));
+        }
+        STOP_TIMER(t);
+        exact_timing = GET_TIMING(t);
+        START_TIMER(t);
+        for(i = 0; i < 1000000;i++){
+                c = (i & 31) * len_a;
+                d += bpm_global_banded(a,b+c,len_a,len_a,2);
+        }
+        STOP_TIMER(t);
+        banded_timing = GET_TIMING(t);
+        /* one seed against many candidates: the seed bitmasks are built once */
+        RUN(set_bpm_peq(peq, a, len_a, 2));
+        START_TIMER(t);
+        for(i = 0; i < 1000000;i++){
+                c = (i & 31) * len_a;
+                d += bpm_global_banded_peq(peq, b+c, len_a);
+        }
+        STOP_TIMER(t);
+        peq_timing = GET_TIMING(t);
+        fprintf(stdout,"2x semi-global\tbanded global\tcached peq\tratio\t(%d)\n%f\t%f\t%f\t%f\n", d & 1, exact_timing, banded_timing, peq_timing, banded_timing / peq_timing);
+
+        for(i = 0; i < num_all;i++){
+                MFREE(all[i]);
+        }
+        MFREE(all);
+        MFREE(all_len);
+        MFREE(a);
+        MFREE(b);
+        MFREE(rng);
+        free_bpm_peq(peq);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 int mutate_seq(uint8_t* s, int len,int k,int L, struct rng_state* rng)
 {
         int i,j;
@@ -299,6 +989,74 @@ ERROR:
 
 }
 
+/* semi-global reference for any pattern length */
+int dyn_semi(const uint8_t* t,const uint8_t* p,int n,int m)
+{
+        int* prev = NULL;
+        int* cur = NULL;
+        int* tmp = NULL;
+        int i,j,c;
+        int best;
+
+        MMALLOC(prev, sizeof(int) * (m + 1));
+        MMALLOC(cur, sizeof(int) * (m + 1));
+        for(j = 0; j <= m;j++){
+                prev[j] = j;
+        }
+        best = m;
+        for(i = 1; i <= n;i++){
+                cur[0] = 0;
+                for(j = 1; j <= m;j++){
+                        c = (t[i-1] == p[j-1]) ? 0 : 1;
+                        cur[j] = prev[j-1] + c;
+                        cur[j] = MACRO_MIN(cur[j], prev[j] + 1);
+                        cur[j] = MACRO_MIN(cur[j], cur[j-1] + 1);
+                }
+                best = MACRO_MIN(best, cur[m]);
+                tmp = cur;
+                cur = prev;
+                prev = tmp;
+        }
+        MFREE(prev);
+        MFREE(cur);
+        return best;
+ERROR:
+        return -1;
+}
+
+/* Plain global (end to end) edit distance.  */
+int dyn_global(const uint8_t* t,const uint8_t* p,int n,int m)
+{
+        int* prev = NULL;
+        int* cur = NULL;
+        int* tmp = NULL;
+        int i,j,c;
+
+        MMALLOC(prev, sizeof(int) * (m + 1));
+        MMALLOC(cur, sizeof(int) * (m + 1));
+        for(j = 0; j <= m;j++){
+                prev[j] = j;
+        }
+        for(i = 1; i <= n;i++){
+                cur[0] = i;
+                for(j = 1; j <= m;j++){
+                        c = (t[i-1] == p[j-1]) ? 0 : 1;
+                        cur[j] = prev[j-1] + c;
+                        cur[j] = MACRO_MIN(cur[j], prev[j] + 1);
+                        cur[j] = MACRO_MIN(cur[j], cur[j-1] + 1);
+                }
+                tmp = cur;
+                cur = prev;
+                prev = tmp;
+        }
+        c = prev[m];
+        MFREE(prev);
+        MFREE(cur);
+        return c;
+ERROR:
+        return -1;
+}
+
 uint8_t dyn_256_print(const uint8_t* t,const uint8_t* p,int n,int m)
 {
         uint8_t* prev = NULL;
@@ -366,7 +1124,7 @@ ERROR:
 }
 
 #ifdef HAVE_AVX2
-void print_256(__m256i X)
+SIMD_TARGET_AVX2 void print_256(__m256i X)
 {
         alignas(32) uint64_t debug[4];
         _mm256_store_si256( (__m256i*)& debug,X);
@@ -374,7 +1132,7 @@ void print_256(__m256i X)
 }
 
 
-void print_256_all(__m256i X)
+SIMD_TARGET_AVX2 void print_256_all(__m256i X)
 {
         alignas(32) uint64_t debug[4];
         _mm256_store_si256( (__m256i*)& debug,X);
@@ -389,249 +1147,1026 @@ void print_256_all(__m256i X)
 #endif
 
 
+/* Myers' semi-global kernel on W 64 bit words: the pattern occupies
+   the low m bits, the add and the shifts carry from word to word. All
+   widths are generated from this one source; with a constant W the
+   word loop is unrolled. Bits above m never reach the lower ones, so
+   the result matches the 256 bit kernel. */
+#define BPM_WORDS_KERNEL(NAME, W)                                       \
+static uint8_t NAME(const uint8_t* t,const uint8_t* p,int n,int m)      \
+{                                                                       \
+        uint64_t B[BPM_SOA_ALPHA][W];                                   \
+        uint64_t VP[W];                                                 \
+        uint64_t VN[W];                                                 \
+        uint64_t X,D0,HN,HP,XS,HS,sum;                                  \
+        uint64_t carry,c_hp,c_hn;                                       \
+        const uint64_t MASK = 1ul << ((m - 1) & 63);                    \
+        const int mw = (m - 1) >> 6;                                    \
+        int diff;                                                       \
+        int best;                                                       \
+        int i,w;                                                        \
+                                                                        \
+        memset(B, 0, sizeof(B));                                        \
+        for(i = 0; i < m;i++){                                          \
+                B[p[i]][i >> 6] |= 1ul << (i & 63);                     \
+        }                                                               \
+        for(w = 0; w < W;w++){                                          \
+                VP[w] = 0xFFFFFFFFFFFFFFFFul;                           \
+                VN[w] = 0ul;                                            \
+        }                                                               \
+        diff = m;                                                       \
+        best = m;                                                       \
+        for(i = 0; i < n;i++){                                          \
+                carry = 0ul;                                            \
+                c_hp = 0ul;                                             \
+                c_hn = 0ul;                                             \
+                for(w = 0; w < W;w++){                                  \
+                        X = B[t[i]][w] | VN[w];                         \
+                        /* D0 = ((VP+(X&VP)) ^ VP) | X */               \
+                        sum = (X & VP[w]) + VP[w];                      \
+                        XS = sum < VP[w];                               \
+                        sum += carry;                                   \
+                        carry = XS | (sum < carry);                     \
+                        D0 = (sum ^ VP[w]) | X;                         \
+                        HN = VP[w] & D0;                                \
+                        HP = VN[w] | ~(VP[w] | D0);                     \
+                        if(w == mw){                                    \
+                                diff += (HP & MASK) ? 1 : 0;            \
+                                diff -= (HN & MASK) ? 1 : 0;            \
+                        }                                               \
+                        XS = (HP << 1ul) | c_hp;                        \
+                        c_hp = HP >> 63;                                \
+                        HS = (HN << 1ul) | c_hn;                        \
+                        c_hn = HN >> 63;                                \
+                        VN[w] = XS & D0;                                \
+                        VP[w] = HS | ~(XS | D0);                        \
+                }                                                       \
+                best = MACRO_MIN(best, diff);                           \
+        }                                                               \
+        return best;                                                    \
+}
+
+BPM_WORDS_KERNEL(bpm_64, 1)
+BPM_WORDS_KERNEL(bpm_128, 2)
+BPM_WORDS_KERNEL(bpm_256_words, 4)
+
+/* Picks the narrowest kernel for the pattern: one word up to 64
+   residues, two up to 128, 256 bits (see bpm_set_simd) up to 255 and
+   the block kernel above that. */
 uint8_t bpm(const uint8_t* t,const uint8_t* p,int n,int m)
 {
-        register uint64_t VP,VN,D0,HN,HP,X;
-        register uint64_t i;//,c;
-        uint64_t MASK = 0;
-        int64_t diff;
-        uint64_t B[13];
-        int8_t k;
-
-        if(m > 63){
-                m = 63;
+        if(m > 255){
+                return MACRO_MIN(bpm_blocks(t, p, n, m, -1), 255);
         }
-        diff = m;
-        k = m;
-        for(i = 0; i < 13;i++){
-                B[i] = 0;
+        if(m == 0){
+                return 0;
         }
-
-        for(i = 0; i < m;i++){
-                B[p[i]] |= (1ul << i);
+        if(m <= 64){
+                return bpm_64(t, p, n, m);
         }
+        if(m <= 128){
+                return bpm_128(t, p, n, m);
+        }
+        return bpm_kernels.wide(t, p, n, m);
+}
 
-        VP = (1ul << (m))-1 ;
-
-        VN = 0ul;
+uint8_t bpm_256(const uint8_t* t,const uint8_t* p,int n,int m)
+{
+        return bpm(t, p, n, m);
+}
 
-        m--;
-        MASK = 1ul << (m);
+/* One column of a 64 row block in Myers' notation: hin is the
+   horizontal delta entering the top row (-1, 0 or +1), the delta
+   leaving at row bit out is returned. */
+static inline int bpm_block(uint64_t* VP, uint64_t* VN, uint64_t eq, int hin, uint64_t out)
+{
+        uint64_t X,D0,HP,HN;
+        const uint64_t neg = hin < 0 ? 1ul : 0ul;
+        int hout;
+
+        X = eq | *VN;
+        eq |= neg;
+        D0 = (((eq & *VP) + *VP) ^ *VP) | eq;
+        HP = *VN | ~(D0 | *VP);
+        HN = *VP & D0;
+        hout = ((HP & out) ? 1 : 0) - ((HN & out) ? 1 : 0);
+        HP = (HP << 1ul) | (hin > 0 ? 1ul : 0ul);
+        HN = (HN << 1ul) | neg;
+        *VP = HN | ~(X | HP);
+        *VN = HP & X;
+        return hout;
+}
 
-        //fprintf(stdout,"BEGINNING\t%lu %lu\n",VN,VP);
+/* Myers' block based algorithm for patterns of any length: the pattern
+   is cut into 64 residue blocks and each block passes the horizontal
+   delta of its last row on to the next. The score of the last row of
+   every block is kept, so with a threshold only the blocks down to the
+   last one that can still hold a score <= k are computed (Ukkonen's
+   cut-off): the next block is added when the last row of the current
+   one is <= k and blocks whose last row is >= k + height are dropped.
+   Cost is proportional to n * k / 64 rather than n * m / 64. */
+int bpm_blocks(const uint8_t* t,const uint8_t* p,int n,int m,int k)
+{
+        uint64_t* B = NULL;
+        uint64_t* VP = NULL;
+        uint64_t* VN = NULL;
+        int* score = NULL;
+        const uint64_t* eq;
+        uint64_t out;
+        int nb;
+        int last;
+        int best;
+        int hout;
+        int i,b;
+
+        if(m == 0){
+                return 0;
+        }
+        if(k < 0 || k > m){
+                k = m;
+        }
+        nb = (m + 63) >> 6;
+        MMALLOC(B, sizeof(uint64_t) * BPM_SOA_ALPHA * nb);
+        MMALLOC(VP, sizeof(uint64_t) * nb);
+        MMALLOC(VN, sizeof(uint64_t) * nb);
+        MMALLOC(score, sizeof(int) * nb);
+        memset(B, 0, sizeof(uint64_t) * BPM_SOA_ALPHA * nb);
+        for(i = 0; i < m;i++){
+                B[p[i] * nb + (i >> 6)] |= 1ul << (i & 63);
+        }
+        /* rows 1..k+1 can hold scores <= k in the first column */
+        last = MACRO_MIN((k + 64) >> 6, nb) - 1;
+        for(b = 0; b <= last;b++){
+                VP[b] = 0xFFFFFFFFFFFFFFFFul;
+                VN[b] = 0ul;
+                score[b] = MACRO_MIN((b + 1) << 6, m);
+        }
+        best = m;
         for(i = 0; i < n;i++){
-                //        fprintf(stdout,"%lu:\t",i);
-                X = (B[t[i]] | VN);
-                //fprintf(stdout,"%lu ", X);
-                D0 = ((VP+(X&VP)) ^ VP) | X ;
-                //fprintf(stdout,"%lu ", D0);
-                HN = VP & D0;
-                //fprintf(stdout,"%lu ", HN);
-                HP = VN | (~(VP | D0));
-                //fprintf(stdout,"%lu ", HP);
-                X = HP << 1ul;
-                //fprintf(stdout,"%lu ", X);
-                VN = X & D0;
-                //fprintf(stdout,"%lu ", VN);
+                eq = B + (size_t) t[i] * nb;
+                hout = 0;
+                for(b = 0; b <= last;b++){
+                        out = b == nb - 1 ? 1ul << ((m - 1) & 63) : 1ul << 63;
+                        hout = bpm_block(VP + b, VN + b, eq[b], hout, out);
+                        score[b] += hout;
+                }
+                if(last < nb - 1 && score[last] - hout <= k && ((eq[last + 1] & 1ul) || hout < 0)){
+                        /* the new block starts from a column where its
+                           rows are one more than the row above */
+                        b = last + 1;
+                        out = b == nb - 1 ? 1ul << ((m - 1) & 63) : 1ul << 63;
+                        VP[b] = 0xFFFFFFFFFFFFFFFFul;
+                        VN[b] = 0ul;
+                        score[b] = score[last] - hout + MACRO_MIN(64, m - (b << 6));
+                        score[b] += bpm_block(VP + b, VN + b, eq[b], hout, out);
+                        last = b;
+                }else{
+                        while(last > 0 && score[last] >= k + MACRO_MIN(64, m - (last << 6))){
+                                last--;
+                        }
+                }
+                if(last == nb - 1){
+                        best = MACRO_MIN(best, score[last]);
+                }else if(best > k && nb - 1 - last > n - i - 1){
+                        /* one block is added per column at most */
+                        break;
+                }
+        }
+        MFREE(B);
+        MFREE(VP);
+        MFREE(VN);
+        MFREE(score);
+        return best <= k ? best : k + 1;
+ERROR:
+        MFREE(B);
+        MFREE(VP);
+        MFREE(VN);
+        MFREE(score);
+        return k + 1;
+}
 
-                VP = (HN << 1ul) | (~(X | D0));
-                //fprintf(stdout,"%lu ", VP);
+int bpm_set_simd(int level)
+{
+        bpm_kernels.wide = bpm_256_words;
+        bpm_kernels.batch = bpm_batch_generic;
+        bpm_kernels.global_batch = bpm_global_batch_generic;
+#ifdef HAVE_AVX2
+        if(level >= SIMD_AVX2){
+                bpm_kernels.wide = bpm_wide_avx2;
+                bpm_kernels.batch = bpm_batch_avx2;
+                bpm_kernels.global_batch = bpm_global_batch_avx2;
+        }
+#endif
+#ifdef HAVE_AVX512
+        if(level >= SIMD_AVX512){
+                bpm_kernels.wide = bpm_wide_avx512;
+                bpm_kernels.batch = bpm_batch_avx512;
+                bpm_kernels.global_batch = bpm_global_batch_avx512;
+        }
+#endif
+        return OK;
+}
 
+/* Global (end to end) edit distance between t and p, restricted to the
+   diagonal band -k <= j - i <= k (Hyyro's banded bit-vector). The band
+   is 2k+1 rows high and slides down one row per text column, so the
+   vertical delta vectors are shifted right instead of HP / HN being
+   shifted left. A single 64 bit word covers the band for k <= 31
+   whatever the sequence lengths are. The score is followed along the
+   diagonal that ends in (m,n); scores never drop along a diagonal, so
+   the kernel stops as soon as it exceeds k. Returns the distance if it
+   is <= k, k+1 otherwise and -1 if k is out of range or memory ran
+   out. */
+int bpm_global_banded(const uint8_t* t,const uint8_t* p,int n,int m,int k)
+{
+        uint64_t buffer[BPM_SOA_ALPHA * BPM_BAND_WORDS];
+        uint64_t* P = NULL;
+        int nw;
+        int score;
+
+        ASSERT(k >= 0 && k <= BPM_GLOBAL_MAX_K, "Threshold %d out of range (0 - %d).", k, BPM_GLOBAL_MAX_K);
+        if(abs(n - m) > k){
+                return k + 1;
+        }
+        if(m == 0 || n == 0){
+                return MACRO_MAX(n, m);
+        }
+        if(k > 31){
+                return global_dp_banded(t, p, n, m, k);
+        }
 
-                diff += (HP & MASK)? 1 : 0;// >> m;
-                diff -= (HN & MASK)? 1 : 0;// >> m;
-                if(diff < k){
-                        k = diff;
+        nw = band_words(m, k);
+        P = buffer;
+        if(nw > BPM_BAND_WORDS){
+                P = NULL;
+                MMALLOC(P, sizeof(uint64_t) * BPM_SOA_ALPHA * nw);
+        }
+        set_band_peq(P, nw, p, m, k);
+        score = global_banded_kernel(P, nw, t, n, m, k);
+        if(P != buffer){
+                MFREE(P);
+        }
+        return score;
+ERROR:
+        if(P && P != buffer){
+                MFREE(P);
+        }
+        return -1;
+}
 
-                }
-                //fprintf(stdout,"%lu ", diff);
-                //fprintf(stdout,"\n");
+/* Same as bpm_global_banded(t, peq pattern, n, m, k), with the pattern
+   bitmasks built beforehand by set_bpm_peq, which has checked k. */
+uint8_t bpm_global_banded_peq(const struct bpm_peq* peq, const uint8_t* t,int n)
+{
+        int m = peq->m;
+        int k = peq->k;
 
+        if(abs(n - m) > k){
+                return k + 1;
+        }
+        if(m == 0 || n == 0){
+                return MACRO_MAX(n, m);
+        }
+        if(k > 31){
+                return global_dp_banded(t, peq->p, n, m, k);
         }
-        return k;
+        return global_banded_kernel(peq->P, peq->nw, t, n, m, k);
 }
 
-
-#ifdef HAVE_AVX2
-uint8_t bpm_256(const uint8_t* t,const uint8_t* p,int n,int m)
+struct bpm_peq* alloc_bpm_peq(void)
 {
-        __m256i VP,VN,D0,HN,HP,X,NOTONE;
-        __m256i xmm1,xmm2;
-        __m256i MASK;
-        __m256i B[13];
-
-        int i,j, k,diff;
+        struct bpm_peq* peq = NULL;
+
+        MMALLOC(peq, sizeof(struct bpm_peq));
+        peq->P = NULL;
+        peq->p = NULL;
+        peq->band = NULL;
+        peq->nw = 0;
+        peq->m = 0;
+        peq->k = -1;
+        peq->alloc = 0;
+        peq->band_alloc = 0;
+        return peq;
+ERROR:
+        free_bpm_peq(peq);
+        return NULL;
+}
 
-        alignas(32)  uint32_t f[21][8];
-        //int ALIGNED_(64) f[8];
-        if(m > 255){
-                m = 255;
+int set_bpm_peq(struct bpm_peq* peq, const uint8_t* p, int m, int k)
+{
+        int i;
+        ASSERT(peq != NULL, "No peq");
+        ASSERT(k >= 0 && k <= BPM_GLOBAL_MAX_K, "Threshold %d out of range (0 - %d).", k, BPM_GLOBAL_MAX_K);
+
+        peq->p = p;
+        peq->m = m;
+        peq->k = k;
+        peq->nw = 0;
+        if(k > 31 || m == 0){
+                return OK;
         }
-
-        for(i = 0; i < 21;i++){
-                for(j = 0;j < 8;j++){
-                        f[i][j] =0u;
-                }
+        peq->nw = band_words(m, k);
+        if(BPM_SOA_ALPHA * peq->nw > peq->alloc){
+                peq->alloc = BPM_SOA_ALPHA * peq->nw;
+                MREALLOC(peq->P, sizeof(uint64_t) * peq->alloc);
         }
-
-        for(i = 0; i < m;i++){
-                f[p[i]][i/32] |= (1 << (i % 32));
+        set_band_peq(peq->P, peq->nw, p, m, k);
+        /* the batched kernels compare the band rows of text column i,
+           band[i .. i+2k+1], instead of looking up P per lane; 0xFF
+           matches no residue */
+        if(m + 3 * k + 2 > peq->band_alloc){
+                peq->band_alloc = m + 3 * k + 2;
+                MREALLOC(peq->band, sizeof(uint8_t) * peq->band_alloc);
+        }
+        for(i = 0; i < m + 3 * k + 2;i++){
+                peq->band[i] = 0xFF;
         }
+        memcpy(peq->band + k + 1, p, m);
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-        for(i = 0; i < 13;i++){
-                B[i] = _mm256_load_si256((__m256i const*) &f[i]);
+void free_bpm_peq(struct bpm_peq* peq)
+{
+        if(peq){
+                if(peq->P){
+                        MFREE(peq->P);
+                }
+                if(peq->band){
+                        MFREE(peq->band);
+                }
+                MFREE(peq);
         }
+}
 
-        diff = m;
-        k = m;
+/* pattern position i is stored at bit i + k + 1 so that the window for
+   text column j starts at bit j. */
+static int band_words(int m, int k)
+{
+        return (m + 3 * k + 1) / 64 + 2;
+}
 
-        VP     = _mm256_set1_epi64x(0xFFFFFFFFFFFFFFFFul);
-        VN     = _mm256_setzero_si256();
-        NOTONE = _mm256_set1_epi64x(0xFFFFFFFFFFFFFFFFul);
-        MASK   = _mm256_set_epi64x (0ul,0ul,0ul,1);
-        m--;
+static void set_band_peq(uint64_t* P, int nw, const uint8_t* p, int m, int k)
+{
+        int i;
+        int b;
 
-        i = m / 64;
-        while(i){
-                bitShiftLeft256ymm(&MASK,64);
-                i--;
+        memset(P, 0, sizeof(uint64_t) * BPM_SOA_ALPHA * nw);
+        for(i = 0; i < m;i++){
+                b = i + k + 1;
+                P[p[i] * nw + (b >> 6)] |= 1ul << (b & 63);
         }
-        bitShiftLeft256ymm(&MASK,m%64);
+}
 
-        for(i = 0; i < n ;i++){
-                //X = (B[(int) *t] | VN);
+static inline uint8_t global_banded_kernel(const uint64_t* P, int nw, const uint8_t* t,int n,int m,int k)
+{
+        const uint64_t* row;
+        uint64_t VP,VN,D0,HN,HP,X,EQ;
+        uint64_t bmask;
+        uint64_t emask;
+        int i;
+        int w;
+        int b;
+        int score;
 
-                X = _mm256_or_si256(B[t[i]], VN);
-                                //fprintf(stdout,"%lu ", X);
-                //D0 = ((VP+(X&VP)) ^ VP) | X ;
+        w = 2 * k + 1;
+        bmask = (1ul << w) - 1ul;
+        emask = (bmask << 1) | 1ul;
 
-                //print_256(X);
-                xmm1 = _mm256_and_si256(X, VP);
+        /* bit b is row b - k of column 0; rows <= 0 lie above the matrix
+           and are treated as D[r][0] = -r */
+        VN = (1ul << (k + 1)) - 1ul;
+        VP = bmask & ~VN;
+        b = k - (n - m);
+        score = abs(n - m);
 
-                xmm2 = add256(0, VP, xmm1);
-                //xmm2 = _mm256_add_epi64(VP, xmm1);
-                xmm1 = _mm256_xor_si256(xmm2, VP);
-                D0 = _mm256_or_si256(xmm1, X);
-                //print_256(D0);
-                //HN = VP & D0;
-                HN =_mm256_and_si256(VP, D0);
-                //print_256(HN);
-                //HP = VN | ~(VP | D0);
+        for(i = 0; i < n;i++){
+                row = P + t[i] * nw;
+                EQ = row[i >> 6] >> (i & 63);
+                if(i & 63){
+                        EQ |= row[(i >> 6) + 1] << (64 - (i & 63));
+                }
+                /* bit w is the row entering at the bottom of the band;
+                   its left neighbour lies outside the band and only the
+                   diagonal (a match) or the carry from above reach it */
+                X = (EQ & emask) | VN;
+                D0 = (((X & VP) + VP) ^ VP) | X;
+                D0 &= emask;
+                HN = VP & D0;
+                HP = (VN | ~(VP | D0)) & bmask;
+                X = D0 >> 1;
+                VN = X & HP;
+                VP = (HN | ~(X | HP)) & bmask;
+
+                score += ((X >> b) & 1ul) ? 0 : 1;
+                if(score > k){
+                        break;
+                }
+        }
+        return score <= k ? score : k + 1;
+}
 
-                xmm1 = _mm256_or_si256(VP, D0);
-                xmm2 = _mm256_andnot_si256(xmm1, NOTONE);
-                HP = _mm256_or_si256(VN, xmm2);
-                //print_256(HP);
+/* Ukkonen banded dynamic programming; only used for very large k. Cell
+   (i,j) of the band is kept at j - i + k, so two rows of 2k+1 cells do
+   and k <= BPM_GLOBAL_MAX_K keeps them on the stack. */
+static uint8_t global_dp_banded(const uint8_t* t,const uint8_t* p,int n,int m,int k)
+{
+        int band_a[2 * BPM_GLOBAL_MAX_K + 1];
+        int band_b[2 * BPM_GLOBAL_MAX_K + 1];
+        int* prev = band_a;
+        int* cur = band_b;
+        int* tmp = NULL;
+        int w = 2 * k + 1;
+        int big = k + 1;
+        int best;
+        int i,j,d;
+
+        for(d = 0; d < w;d++){
+                j = d - k;
+                prev[d] = j >= 0 && j <= m ? j : big;
+        }
+        for(i = 1; i <= n;i++){
+                best = big;
+                for(d = 0; d < w;d++){
+                        j = i - k + d;
+                        if(j < 0 || j > m){
+                                cur[d] = big;
+                                continue;
+                        }
+                        if(j == 0){
+                                cur[d] = MACRO_MIN(i, big);
+                                best = MACRO_MIN(best, cur[d]);
+                                continue;
+                        }
+                        /* diagonal, above and left of (i,j) */
+                        cur[d] = prev[d] + (t[i-1] == p[j-1] ? 0 : 1);
+                        if(d + 1 < w){
+                                cur[d] = MACRO_MIN(cur[d], prev[d+1] + 1);
+                        }
+                        if(d){
+                                cur[d] = MACRO_MIN(cur[d], cur[d-1] + 1);
+                        }
+                        cur[d] = MACRO_MIN(cur[d], big);
+                        best = MACRO_MIN(best, cur[d]);
+                }
+                tmp = cur;
+                cur = prev;
+                prev = tmp;
+                if(best >= big){
+                        return big;
+                }
+        }
+        return MACRO_MIN(prev[m - n + k], big);
+}
 
-                //X = HP << 1ul;
-                X = HP;
-                bitShiftLeft256ymm(&X, 1);
+struct bpm_soa* alloc_bpm_soa(int numseq, int max_len)
+{
+        struct bpm_soa* soa = NULL;
+        size_t j;
+        int i;
+        MMALLOC(soa, sizeof(struct bpm_soa));
+        soa->s = NULL;
+        soa->len = NULL;
+        soa->numseq = numseq;
+        /* round up to whole ymm registers  */
+        soa->stride = ((MACRO_MAX(max_len,1) + 31) / 32) * 32;
+
+        MMALLOC(soa->s, sizeof(uint8_t) * (size_t) soa->stride * (size_t) numseq);
+        MMALLOC(soa->len, sizeof(int) * numseq);
+        for(j = 0; j < (size_t) soa->stride * (size_t) numseq;j++){
+                soa->s[j] = BPM_SOA_PAD;
+        }
+        for(i = 0; i < numseq;i++){
+                soa->len[i] = 0;
+        }
+        return soa;
+ERROR:
+        free_bpm_soa(soa);
+        return NULL;
+}
 
-                //print_256(X);
-                //VN = X & D0;
-                VN= _mm256_and_si256(X, D0);
-                //print_256(VN);
-                //VP = (HN << 1ul) | ~(X | D0);
-                xmm1 = HN;
-                bitShiftLeft256ymm(&xmm1, 1);
+int set_bpm_soa_seq(struct bpm_soa* soa, int i, const uint8_t* s, int len)
+{
+        uint8_t* row;
+        int j;
+        ASSERT(soa != NULL, "No soa");
+        ASSERT(i < soa->numseq, "Index %d out of range (%d).", i, soa->numseq);
+        ASSERT(len <= soa->stride, "Sequence too long: %d (stride: %d).", len, soa->stride);
+
+        row = soa->s + (size_t) i * soa->stride;
+        for(j = 0; j < len;j++){
+                row[j] = s[j];
+        }
+        for(j = len; j < soa->stride;j++){
+                row[j] = BPM_SOA_PAD;
+        }
+        soa->len[i] = len;
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-                xmm2 = _mm256_or_si256(X, D0);
+void free_bpm_soa(struct bpm_soa* soa)
+{
+        if(soa){
+                MFREE(soa->s);
+                MFREE(soa->len);
+                MFREE(soa);
+        }
+}
 
-                xmm2 = _mm256_andnot_si256(xmm2, NOTONE);
-                //xmm2 = _mm_andnot_si128 (xmm2,NOTONE);
-                VP = _mm256_or_si256(xmm1, xmm2);
-                //print_256(VP);
+int bpm_batch(const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs)
+{
+        return bpm_kernels.batch(seed, len, soa, idx, num, k, d_sc, d_cs);
+}
 
+/* Runs the lane kernels of lk over the candidates. A pattern has to fit
+   its lanes: with the seed as text the candidate lengths pick the lane
+   width, with the seed as pattern the seed length does. Candidates are
+   queued by lane width as patterns and in steps of 8 residues as texts,
+   so that the lanes of one kernel call finish together; patterns over
+   64 residues are compared one at a time. */
+int bpm_batch_lanes(const struct bpm_lane_kernels* lk, const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs)
+{
+        int q_idx[BPM_TEXT_CLASSES][BPM_MAX_LANES];
+        int q_pos[BPM_TEXT_CLASSES][BPM_MAX_LANES];
+        int q_num[BPM_TEXT_CLASSES];
+        const uint8_t* cand;
+        int i,c,w;
+
+        if(d_sc){
+                for(c = 0; c < 4;c++){
+                        q_num[c] = 0;
+                }
+                for(i = 0; i < num;i++){
+                        c = bpm_lane_width(soa->len[idx[i]]);
+                        if(c == 3){
+                                cand = soa->s + (size_t) idx[i] * soa->stride;
+                                d_sc[i] = bpm(seed, cand, len, soa->len[idx[i]]);
+                                d_sc[i] = k >= 0 ? MACRO_MIN(d_sc[i], k + 1) : d_sc[i];
+                                continue;
+                        }
+                        q_idx[c][q_num[c]] = idx[i];
+                        q_pos[c][q_num[c]] = i;
+                        q_num[c]++;
+                        if(q_num[c] == lk->lanes[c]){
+                                bpm_lane_flush(lk->sc[c], seed, len, soa, q_idx[c], q_pos[c], q_num[c], k, d_sc);
+                                q_num[c] = 0;
+                        }
+                }
+                for(c = 0; c < 3;c++){
+                        if(q_num[c]){
+                                bpm_lane_flush(lk->sc[c], seed, len, soa, q_idx[c], q_pos[c], q_num[c], k, d_sc);
+                        }
+                }
+        }
+        if(d_cs){
+                w = bpm_lane_width(len);
+                if(w == 3){
+                        for(i = 0; i < num;i++){
+                                cand = soa->s + (size_t) idx[i] * soa->stride;
+                                d_cs[i] = bpm(cand, seed, soa->len[idx[i]], len);
+                                d_cs[i] = k >= 0 ? MACRO_MIN(d_cs[i], k + 1) : d_cs[i];
+                        }
+                        return OK;
+                }
+                for(c = 0; c < BPM_TEXT_CLASSES;c++){
+                        q_num[c] = 0;
+                }
+                for(i = 0; i < num;i++){
+                        c = MACRO_MIN(soa->len[idx[i]] / 8, BPM_TEXT_CLASSES - 1);
+                        q_idx[c][q_num[c]] = idx[i];
+                        q_pos[c][q_num[c]] = i;
+                        q_num[c]++;
+                        if(q_num[c] == lk->lanes[w]){
+                                bpm_lane_flush(lk->cs[w], seed, len, soa, q_idx[c], q_pos[c], q_num[c], k, d_cs);
+                                q_num[c] = 0;
+                        }
+                }
+                for(c = 0; c < BPM_TEXT_CLASSES;c++){
+                        if(q_num[c]){
+                                bpm_lane_flush(lk->cs[w], seed, len, soa, q_idx[c], q_pos[c], q_num[c], k, d_cs);
+                        }
+                }
+        }
+        return OK;
+}
 
-                //diff += (HP & MASK) >> m;
-                diff += 1- _mm256_testz_si256(HP, MASK);
+int bpm_global_banded_batch(const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out)
+{
+        return bpm_kernels.global_batch(peq, soa, idx, num, out);
+}
 
-                ///diff -= (HN & MASK) >> m;
-                diff -= 1- _mm256_testz_si256(HN,MASK);
+/* Runs the banded global lane kernels of lk over the candidates. The
+   band of 2k+2 bits picks the lane width; the candidates that can be
+   decided from the lengths alone, k > 31 and seeds too long for the
+   signed 16 bit lengths and columns go through bpm_global_banded_peq.
+   All other candidates are within k residues of the seed length, so the
+   lanes of one call finish together. */
+int bpm_global_lanes(const struct bpm_lane_kernels* lk, const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out)
+{
+        int q_idx[BPM_MAX_LANES];
+        int q_pos[BPM_MAX_LANES];
+        int q_num;
+        int i,n,w;
+
+        if(peq->k < 0 || peq->k > 31 || peq->m == 0 || peq->m + peq->k >= INT16_MAX){
+                for(i = 0; i < num;i++){
+                        out[i] = bpm_global_banded_peq(peq, soa->s + (size_t) idx[i] * soa->stride, soa->len[idx[i]]);
+                }
+                return OK;
+        }
+        w = bpm_lane_width(2 * peq->k + 2);
+        q_num = 0;
+        for(i = 0; i < num;i++){
+                n = soa->len[idx[i]];
+                if(n == 0 || abs(n - peq->m) > peq->k){
+                        out[i] = bpm_global_banded_peq(peq, soa->s + (size_t) idx[i] * soa->stride, n);
+                        continue;
+                }
+                q_idx[q_num] = idx[i];
+                q_pos[q_num] = i;
+                q_num++;
+                if(q_num == lk->lanes[w]){
+                        bpm_lane_flush(lk->gl[w], peq->band, peq->m, soa, q_idx, q_pos, q_num, peq->k, out);
+                        q_num = 0;
+                }
+        }
+        if(q_num){
+                bpm_lane_flush(lk->gl[w], peq->band, peq->m, soa, q_idx, q_pos, q_num, peq->k, out);
+        }
+        return OK;
+}
 
-                //fprintf(stdout,"%d ",diff);
-                //xmm1 = _mm256_cmpgt_epi64(K, diff);
-                k = MACRO_MIN(k, diff);
+/* 0, 1 and 2 for sequences that fit 16, 32 and 64 bit lanes, 3 above */
+int bpm_lane_width(int len)
+{
+        if(len <= 16){
+                return 0;
         }
-        return k;
+        if(len <= 32){
+                return 1;
+        }
+        if(len <= 64){
+                return 2;
+        }
+        return 3;
 }
 
+/* one kernel call; results go back to the positions the candidates
+   had in the caller's list */
+void bpm_lane_flush(bpm_lane_fn f, const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, const int* pos, int num, int k, uint8_t* out)
+{
+        uint8_t res[BPM_MAX_LANES];
+        int j;
 
+        f(seed, len, soa, idx, num, k, res);
+        for(j = 0; j < num;j++){
+                out[pos[j]] = res[j];
+        }
+}
 
+#ifdef BPM_VECTOR_EXT
+/* Portable batched kernels written with the GCC / Clang generic vector
+   extensions: 128 bit vectors map to SSE2 on x86-64 and NEON on arm64,
+   so builds and CPUs without the kernels of bpm_simd.h still compare a
+   seed against 8 (16 bit lanes), 4 (32 bit) or 2 (64 bit) candidates
+   per vector, BPM_BATCH_SETS vectors at a time. Same recursion and
+   early stop as the AVX2 versions.
+   Comparisons give -1 in true lanes; min and blend use them as masks. */
+typedef uint16_t bpm_vu16 __attribute__((vector_size(16)));
+typedef int16_t bpm_vs16 __attribute__((vector_size(16)));
+typedef uint32_t bpm_vu32 __attribute__((vector_size(16)));
+typedef int32_t bpm_vs32 __attribute__((vector_size(16)));
+typedef uint64_t bpm_vu64 __attribute__((vector_size(16)));
+typedef int64_t bpm_vs64 __attribute__((vector_size(16)));
+
+#define BPM_VEC_LARGE 0x3FFF
+
+static inline int bpm_vec_all(bpm_vu64 x)
+{
+        return (x[0] & x[1]) == 0xFFFFFFFFFFFFFFFFul;
+}
 
-/* Must be called before BPM_256 is!!!  */
-void set_broadcast_mask(void)
+static inline int bpm_vec_any(bpm_vu64 x)
 {
-        BROADCAST_MASK[0] =  _mm256_set_epi64x(0x8000000000000000, 0x8000000000000000, 0x8000000000000000, 0x8000000000000000);
-        BROADCAST_MASK[1] = _mm256_set_epi64x(0x8000000000000000, 0x8000000000000000, 0x8000000000000000, 0x8000000000000001);
-        BROADCAST_MASK[2] = _mm256_set_epi64x(0x8000000000000000, 0x8000000000000000, 0x8000000000000001, 0x8000000000000000);
-        BROADCAST_MASK[3] = _mm256_set_epi64x(0x8000000000000000, 0x8000000000000000, 0x8000000000000001, 0x8000000000000001);
-        BROADCAST_MASK[4] = _mm256_set_epi64x(0x8000000000000000, 0x8000000000000001, 0x8000000000000000, 0x8000000000000000);
-        BROADCAST_MASK[5] = _mm256_set_epi64x(0x8000000000000000, 0x8000000000000001, 0x8000000000000000, 0x8000000000000001);
-        BROADCAST_MASK[6] = _mm256_set_epi64x(0x8000000000000000, 0x8000000000000001, 0x8000000000000001, 0x8000000000000000);
-        BROADCAST_MASK[7] = _mm256_set_epi64x(0x8000000000000000, 0x8000000000000001, 0x8000000000000001, 0x8000000000000001);
-        BROADCAST_MASK[8] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000000, 0x8000000000000000, 0x8000000000000000);
-        BROADCAST_MASK[9] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000000, 0x8000000000000000, 0x8000000000000001);
-        BROADCAST_MASK[10] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000000, 0x8000000000000001, 0x8000000000000000);
-        BROADCAST_MASK[11] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000000, 0x8000000000000001, 0x8000000000000001);
-        BROADCAST_MASK[12] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000001, 0x8000000000000000, 0x8000000000000000);
-        BROADCAST_MASK[13] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000001, 0x8000000000000000, 0x8000000000000001);
-        BROADCAST_MASK[14] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000001, 0x8000000000000001, 0x8000000000000000);
-        BROADCAST_MASK[15] = _mm256_set_epi64x(0x8000000000000001, 0x8000000000000001, 0x8000000000000001, 0x8000000000000001);
+        return (x[0] | x[1]) != 0;
 }
 
+/* seed is the text, the candidates are the patterns */
+#define BPM_VEC_BATCH_SC(W,N,UTYPE,STYPE)                                 \
+        static void bpm_vec_batch_sc_##W(const uint8_t* t,int n, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* out) \
+        {                                                               \
+                UTYPE f[BPM_SOA_ALPHA][BPM_BATCH_SETS * N];             \
+                UTYPE mask[BPM_BATCH_SETS * N];                         \
+                STYPE res[BPM_BATCH_SETS * N];                          \
+                bpm_vu##W VP[BPM_BATCH_SETS],VN[BPM_BATCH_SETS],MASK[BPM_BATCH_SETS]; \
+                bpm_vs##W DIFF[BPM_BATCH_SETS],K[BPM_BATCH_SETS];       \
+                bpm_vu##W D0,HN,HP,X;                                   \
+                bpm_vs##W M,R,DONE;                                     \
+                const uint8_t* p;                                       \
+                int i,j,m,s;                                            \
+                                                                        \
+                memset(f, 0, sizeof(f));                                \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        mask[j] = 0;                                    \
+                        res[j] = BPM_VEC_LARGE;                         \
+                }                                                       \
+                for(j = 0; j < num;j++){                                \
+                        p = soa->s + (size_t) idx[j] * soa->stride;     \
+                        m = soa->len[idx[j]];                           \
+                        for(i = 0; i < m;i++){                          \
+                                f[p[i]][j] |= (UTYPE) 1 << i;           \
+                        }                                               \
+                        if(m){                                          \
+                                mask[j] = (UTYPE) 1 << (m-1);           \
+                        }                                               \
+                        res[j] = m;                                     \
+                }                                                       \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        memcpy(&MASK[s], mask + s * N, sizeof(MASK[s])); \
+                        memcpy(&DIFF[s], res + s * N, sizeof(DIFF[s])); \
+                        K[s] = DIFF[s];                                 \
+                        VP[s] = ~(bpm_vu##W){0};                        \
+                        VN[s] = (bpm_vu##W){0};                         \
+                }                                                       \
+                for(i = 0; i < n;i++){                                  \
+                        for(s = 0; s < BPM_BATCH_SETS;s++){             \
+                                memcpy(&X, f[t[i]] + s * N, sizeof(X)); \
+                                X |= VN[s];                             \
+                                D0 = (((X & VP[s]) + VP[s]) ^ VP[s]) | X; \
+                                HN = VP[s] & D0;                        \
+                                HP = VN[s] | ~(VP[s] | D0);             \
+                                X = HP << 1;                            \
+                                VN[s] = X & D0;                         \
+                                VP[s] = (HN << 1) | ~(X | D0);          \
+                                DIFF[s] -= (HP & MASK[s]) == MASK[s];   \
+                                DIFF[s] += (HN & MASK[s]) == MASK[s];   \
+                                M = K[s] > DIFF[s];                     \
+                                K[s] = (DIFF[s] & M) | (K[s] & ~M);     \
+                        }                                               \
+                        if(k >= 0){                                     \
+                                DONE = ~(bpm_vs##W){0};                 \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        R = DIFF[s] - (STYPE) (n - i - 1); \
+                                        M = K[s] > R;                   \
+                                        DONE &= ((R & M) | (K[s] & ~M)) > (STYPE) k; \
+                                }                                       \
+                                if(bpm_vec_all((bpm_vu64) DONE)){       \
+                                        break;                          \
+                                }                                       \
+                        }                                               \
+                }                                                       \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        memcpy(res + s * N, &K[s], sizeof(K[s]));       \
+                }                                                       \
+                for(j = 0; j < num;j++){                                \
+                        out[j] = mask[j] ? (uint8_t) (k >= 0 ? MACRO_MIN(res[j], k+1) : res[j]) : 0; \
+                }                                                       \
+        }
 
-__m256i add256(uint32_t carry, __m256i A, __m256i B)
-{
-        A = _mm256_xor_si256(A, _mm256_set1_epi64x(0x8000000000000000));
-        __m256i s = _mm256_add_epi64(A, B);
-        __m256i cv = _mm256_cmpgt_epi64(A, s);
-        __m256i mv = _mm256_cmpeq_epi64(s, _mm256_set1_epi64x(0x7fffffffffffffff));
-        uint32_t c = _mm256_movemask_pd(_mm256_castsi256_pd(cv));
-        uint32_t m = _mm256_movemask_pd(_mm256_castsi256_pd(mv));
+/* candidates are the texts, the seed is the pattern; the lookups of
+   BPM_BATCH_COLS columns are done ahead of the column loop and ended
+   texts read padding (see the AVX2 version) */
+#define BPM_VEC_BATCH_CS(W,N,UTYPE,STYPE)                                 \
+        static void bpm_vec_batch_cs_##W(const uint8_t* p,int m, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* out) \
+        {                                                               \
+                UTYPE eq[BPM_BATCH_COLS][BPM_BATCH_SETS * N];           \
+                UTYPE peq[BPM_SOA_ALPHA];                               \
+                STYPE res[BPM_BATCH_SETS * N];                          \
+                const uint8_t* t[BPM_BATCH_SETS * N];                   \
+                bpm_vu##W VP[BPM_BATCH_SETS],VN[BPM_BATCH_SETS];        \
+                bpm_vs##W DIFF[BPM_BATCH_SETS],K[BPM_BATCH_SETS],LEN[BPM_BATCH_SETS]; \
+                bpm_vu##W D0,HN,HP,X,MASK;                              \
+                bpm_vs##W M,DONE;                                       \
+                int i,j,n,c,cn,s;                                       \
+                                                                        \
+                if(!m){                                                 \
+                        for(j = 0; j < num;j++){                        \
+                                out[j] = 0;                             \
+                        }                                               \
+                        return;                                         \
+                }                                                       \
+                for(i = 0; i < BPM_SOA_ALPHA;i++){                      \
+                        peq[i] = 0;                                     \
+                }                                                       \
+                for(i = 0; i < m;i++){                                  \
+                        peq[p[i]] |= (UTYPE) 1 << i;                    \
+                }                                                       \
+                peq[BPM_SOA_PAD] = 0;                                   \
+                n = 0;                                                  \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        K[s] = (bpm_vs##W){0} + (STYPE) m;              \
+                        DIFF[s] = (bpm_vs##W){0} + (STYPE) m;           \
+                        VP[s] = ~(bpm_vu##W){0};                        \
+                        VN[s] = (bpm_vu##W){0};                         \
+                }                                                       \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        t[j] = soa->s;                                  \
+                        res[j] = 0;                                     \
+                        if(j < num){                                    \
+                                t[j] += (size_t) idx[j] * soa->stride;  \
+                                res[j] = soa->len[idx[j]];              \
+                                n = MACRO_MAX(n, soa->len[idx[j]]);     \
+                        }                                               \
+                }                                                       \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        memcpy(&LEN[s], res + s * N, sizeof(LEN[s]));   \
+                }                                                       \
+                MASK = (bpm_vu##W){0} + (UTYPE) ((UTYPE) 1 << (m-1));   \
+                for(c = 0; c < n;c += BPM_BATCH_COLS){                  \
+                        cn = MACRO_MIN(BPM_BATCH_COLS, n - c);          \
+                        for(j = 0; j < BPM_BATCH_SETS * N;j++){         \
+                                for(i = 0; i < cn;i++){                 \
+                                        eq[i][j] = peq[t[j][c+i]];      \
+                                }                                       \
+                        }                                               \
+                        for(i = 0; i < cn;i++){                         \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        memcpy(&X, eq[i] + s * N, sizeof(X)); \
+                                        X |= VN[s];                     \
+                                        D0 = (((X & VP[s]) + VP[s]) ^ VP[s]) | X; \
+                                        HN = VP[s] & D0;                \
+                                        HP = VN[s] | ~(VP[s] | D0);     \
+                                        X = HP << 1;                    \
+                                        VN[s] = X & D0;                 \
+                                        VP[s] = (HN << 1) | ~(X | D0);  \
+                                        DIFF[s] -= (HP & MASK) == MASK; \
+                                        DIFF[s] += (HN & MASK) == MASK; \
+                                        M = K[s] > DIFF[s];             \
+                                        K[s] = (DIFF[s] & M) | (K[s] & ~M); \
+                                }                                       \
+                                if(k >= 0){                             \
+                                        /* done lanes need K > k, unused ones nothing */ \
+                                        DONE = ~(bpm_vs##W){0};         \
+                                        for(s = 0; s < BPM_BATCH_SETS;s++){ \
+                                                M = LEN[s] > (STYPE) (c + i + 1); \
+                                                M = (DIFF[s] - (LEN[s] - (STYPE) (c + i + 1)) > (STYPE) k) | ~M; \
+                                                DONE &= (M & (K[s] > (STYPE) k)) | (LEN[s] == 0); \
+                                        }                               \
+                                        if(bpm_vec_all((bpm_vu64) DONE)){ \
+                                                goto done;              \
+                                        }                               \
+                                }                                       \
+                        }                                               \
+                }                                                       \
+        done:                                                           \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        memcpy(res + s * N, &K[s], sizeof(K[s]));       \
+                }                                                       \
+                for(j = 0; j < num;j++){                                \
+                        out[j] = (uint8_t) (k >= 0 ? MACRO_MIN(res[j], k+1) : res[j]); \
+                }                                                       \
+        }
 
-        {
-                c = m + 2*c; //  lea
-                carry += c;
-                m ^= carry;
-                carry >>= 4;
-                m &= 0x0f;
+/* banded global distance (global_banded_kernel) with the candidates as
+   texts: every lane compares its residue with the 2k+2 seed residues of
+   its band, band[c .. c+2k+1] for column c, and builds the bitmask from
+   the top row down. A lane stops adding to its score once the text has
+   ended or the score is above k. */
+#define BPM_VEC_BATCH_GL(W,N,UTYPE,STYPE)                                 \
+        static void bpm_vec_batch_gl_##W(const uint8_t* band,int m, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* out) \
+        {                                                               \
+                UTYPE eq[BPM_BATCH_COLS][BPM_BATCH_SETS * N];           \
+                UTYPE diag[BPM_BATCH_SETS * N];                         \
+                STYPE res[BPM_BATCH_SETS * N];                          \
+                STYPE len[BPM_BATCH_SETS * N];                          \
+                const uint8_t* t[BPM_BATCH_SETS * N];                   \
+                bpm_vu##W VP[BPM_BATCH_SETS],VN[BPM_BATCH_SETS],EQ[BPM_BATCH_SETS],R[BPM_BATCH_SETS],DIAG[BPM_BATCH_SETS]; \
+                bpm_vs##W SCORE[BPM_BATCH_SETS],LEN[BPM_BATCH_SETS],ACTIVE[BPM_BATCH_SETS]; \
+                bpm_vu##W D0,HN,HP,X,B,BMASK,EMASK;                     \
+                bpm_vs##W ANY;                                          \
+                UTYPE bmask;                                            \
+                int i,j,n,c,cn,r,s,w;                                   \
+                                                                        \
+                w = 2 * k + 1;                                          \
+                bmask = (UTYPE) (((UTYPE) 1 << w) - 1);                 \
+                n = 0;                                                  \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        t[j] = soa->s;                                  \
+                        len[j] = 0;                                     \
+                        res[j] = 0;                                     \
+                        diag[j] = 0;                                    \
+                        if(j < num){                                    \
+                                t[j] += (size_t) idx[j] * soa->stride;  \
+                                len[j] = soa->len[idx[j]];              \
+                                res[j] = abs(soa->len[idx[j]] - m);     \
+                                diag[j] = (UTYPE) 1 << (k - (len[j] - m)); \
+                                n = MACRO_MAX(n, len[j]);               \
+                        }                                               \
+                }                                                       \
+                BMASK = (bpm_vu##W){0} + bmask;                         \
+                EMASK = (BMASK << 1) | 1;                               \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        memcpy(&LEN[s], len + s * N, sizeof(LEN[s]));   \
+                        memcpy(&SCORE[s], res + s * N, sizeof(SCORE[s])); \
+                        memcpy(&DIAG[s], diag + s * N, sizeof(DIAG[s])); \
+                        VN[s] = (bpm_vu##W){0} + (UTYPE) (((UTYPE) 1 << (k + 1)) - 1); \
+                        VP[s] = BMASK & ~VN[s];                         \
+                        ACTIVE[s] = LEN[s] > 0;                         \
+                }                                                       \
+                for(c = 0; c < n;c += BPM_BATCH_COLS){                  \
+                        cn = MACRO_MIN(BPM_BATCH_COLS, n - c);          \
+                        for(j = 0; j < BPM_BATCH_SETS * N;j++){         \
+                                for(i = 0; i < cn;i++){                 \
+                                        eq[i][j] = t[j][c+i];           \
+                                }                                       \
+                        }                                               \
+                        for(i = 0; i < cn;i++){                         \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        memcpy(&R[s], eq[i] + s * N, sizeof(R[s])); \
+                                        EQ[s] = (bpm_vu##W){0};         \
+                                }                                       \
+                                for(r = w; r >= 0;r--){                 \
+                                        B = (bpm_vu##W){0} + (UTYPE) band[c+i+r]; \
+                                        for(s = 0; s < BPM_BATCH_SETS;s++){ \
+                                                EQ[s] = (EQ[s] << 1) - (bpm_vu##W) (R[s] == B); \
+                                        }                               \
+                                }                                       \
+                                ANY = (bpm_vs##W){0};                   \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        X = EQ[s] | VN[s];              \
+                                        D0 = (((X & VP[s]) + VP[s]) ^ VP[s]) | X; \
+                                        D0 &= EMASK;                    \
+                                        HN = VP[s] & D0;                \
+                                        HP = VN[s] | (~(VP[s] | D0) & BMASK); \
+                                        X = D0 >> 1;                    \
+                                        VN[s] = X & HP;                 \
+                                        VP[s] = HN | (~(X | HP) & BMASK); \
+                                        SCORE[s] -= ((X & DIAG[s]) == 0) & ACTIVE[s]; \
+                                        ACTIVE[s] = (LEN[s] > (STYPE) (c + i + 1)) & (SCORE[s] <= (STYPE) k); \
+                                        ANY |= ACTIVE[s];               \
+                                }                                       \
+                                if(!bpm_vec_any((bpm_vu64) ANY)){       \
+                                        goto done;                      \
+                                }                                       \
+                        }                                               \
+                }                                                       \
+        done:                                                           \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        memcpy(res + s * N, &SCORE[s], sizeof(SCORE[s])); \
+                }                                                       \
+                for(j = 0; j < num;j++){                                \
+                        out[j] = (uint8_t) res[j];                      \
+                }                                                       \
         }
-        return _mm256_add_epi64(s, BROADCAST_MASK[m]);
-}
 
+BPM_VEC_BATCH_SC(16,8,uint16_t,int16_t)
+BPM_VEC_BATCH_SC(32,4,uint32_t,int32_t)
+BPM_VEC_BATCH_SC(64,2,uint64_t,int64_t)
 
-//----------------------------------------------------------------------------
-// bit shift left a 256-bit value using ymm registers
-//          __m256i *data - data to shift
-//          int count     - number of bits to shift
-// return:  __m256i       - carry out bit(s)
+BPM_VEC_BATCH_CS(16,8,uint16_t,int16_t)
+BPM_VEC_BATCH_CS(32,4,uint32_t,int32_t)
+BPM_VEC_BATCH_CS(64,2,uint64_t,int64_t)
 
-void bitShiftLeft256ymm (__m256i *data, int count)
-{
-        __m256i innerCarry, rotate;
+BPM_VEC_BATCH_GL(16,8,uint16_t,int16_t)
+BPM_VEC_BATCH_GL(32,4,uint32_t,int32_t)
+BPM_VEC_BATCH_GL(64,2,uint64_t,int64_t)
 
-        innerCarry = _mm256_srli_epi64 (*data, 64 - count);                        // carry outs in bit 0 of each qword
-        rotate     = _mm256_permute4x64_epi64 (innerCarry, 0x93);                  // rotate ymm left 64 bits
-        innerCarry = _mm256_blend_epi32 (_mm256_setzero_si256 (), rotate, 0xFC);   // clear lower qword
-        *data    = _mm256_slli_epi64 (*data, count);                               // shift all qwords left
-        *data    = _mm256_or_si256 (*data, innerCarry);                            // propagate carrys from low qwords
-        //carryOut   = _mm256_xor_si256 (innerCarry, rotate);                        // clear all except lower qword
-        //return carryOut;
-}
+/* Same lane layout as the AVX2 kernels with half the lanes. */
+static const struct bpm_lane_kernels bpm_vec_lanes = {
+        {bpm_vec_batch_sc_16, bpm_vec_batch_sc_32, bpm_vec_batch_sc_64},
+        {bpm_vec_batch_cs_16, bpm_vec_batch_cs_32, bpm_vec_batch_cs_64},
+        {bpm_vec_batch_gl_16, bpm_vec_batch_gl_32, bpm_vec_batch_gl_64},
+        {8 * BPM_BATCH_SETS, 4 * BPM_BATCH_SETS, 2 * BPM_BATCH_SETS}
+};
 
-__m256i bitShiftRight256ymm (__m256i *data, int count)
+static int bpm_batch_generic(const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs)
 {
-        __m256i innerCarry, carryOut, rotate;
-
+        return bpm_batch_lanes(&bpm_vec_lanes, seed, len, soa, idx, num, k, d_sc, d_cs);
+}
 
-        innerCarry = _mm256_slli_epi64(*data, 64 - count);
-        rotate =  _mm256_permute4x64_epi64 (innerCarry, 0x39);
-        innerCarry = _mm256_blend_epi32 (_mm256_setzero_si256 (), rotate, 0x3F);
-        *data = _mm256_srli_epi64(*data, count);
-        *data = _mm256_or_si256(*data,  innerCarry);
+static int bpm_global_batch_generic(const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out)
+{
+        return bpm_global_lanes(&bpm_vec_lanes, peq, soa, idx, num, out);
+}
+#else
+/* One comparison at a time. */
+static int bpm_batch_generic(const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs)
+{
+        const uint8_t* cand;
+        int i;
+        for(i = 0; i < num;i++){
+                cand = soa->s + (size_t) idx[i] * soa->stride;
+                if(d_sc){
+                        d_sc[i] = bpm(seed, cand, len, soa->len[idx[i]]);
+                        d_sc[i] = k >= 0 ? MACRO_MIN(d_sc[i], k + 1) : d_sc[i];
+                }
+                if(d_cs){
+                        d_cs[i] = bpm(cand, seed, soa->len[idx[i]], len);
+                        d_cs[i] = k >= 0 ? MACRO_MIN(d_cs[i], k + 1) : d_cs[i];
+                }
+        }
+        return OK;
+}
 
-        carryOut   = _mm256_xor_si256 (innerCarry, rotate);                        //FIXME: not sure if this is correct!!!
-        return carryOut;
+static int bpm_global_batch_generic(const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out)
+{
+        int i;
+        for(i = 0; i < num;i++){
+                out[i] = bpm_global_banded_peq(peq, soa->s + (size_t) idx[i] * soa->stride, soa->len[idx[i]]);
+        }
+        return OK;
 }
 #endif
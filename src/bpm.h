@@ -29,12 +29,82 @@
 
 #include "tldevel.h"
 
-/* Must be called before bpm_256!!!!  */
-extern void set_broadcast_mask(void);
+/* Alphabet size and padding residue used in the batched kernels. */
+#define BPM_SOA_ALPHA 32
+#define BPM_SOA_PAD 31
 
+/* Padded copy of the (internal) sequences: sequence i starts at
+   s + i * stride and is padded with BPM_SOA_PAD up to stride, a
+   multiple of 32 the batched kernels read whole blocks of. */
+struct bpm_soa{
+        uint8_t* s;
+        int* len;
+        int stride;
+        int numseq;
+};
+
+/* Semi-global edit distance of pattern p within text t. The kernel
+   follows the pattern length: one 64 bit word up to 64 residues, two
+   words up to 128, 256 bits up to 255 and bpm_blocks above that; the
+   result saturates at 255. bpm_256 is the same function. The 256 bit
+   and batched kernels are the scalar ones until init_simd() (simd.h)
+   has selected the best the CPU supports; all of them give the same
+   results. */
 extern uint8_t bpm_256(const uint8_t* t,const uint8_t* p,int n,int m);
 extern uint8_t bpm(const uint8_t* t,const uint8_t* p,int n,int m);
 
+/* Semi-global edit distance for patterns of any length with a 32 bit
+   result (Myers' block based kernel). With k >= 0 only the 64 row
+   blocks that can still reach a score <= k are computed and distances
+   above k are reported as k+1; k < 0 gives the exact distance. */
+extern int bpm_blocks(const uint8_t* t,const uint8_t* p,int n,int m,int k);
+
+/* Global (end to end) edit distance; symmetric in t and p. Only the
+   diagonal band of width 2k+1 is computed: returns the distance if it
+   is <= k and k+1 otherwise. k has to be 0 - 254; -1 is returned for
+   other thresholds or if memory ran out. No length limit. */
+extern int bpm_global_banded(const uint8_t* t,const uint8_t* p,int n,int m,int k);
+
+/* Pattern bitmasks (Peq) of bpm_global_banded for one pattern and
+   threshold. A seed compared against many candidates is encoded once
+   with set_bpm_peq and used as the pattern of every comparison; p must
+   stay valid meanwhile. bpm_global_banded_peq(peq, t, n) equals
+   bpm_global_banded(t, p, n, m, k). */
+struct bpm_peq{
+        uint64_t* P;
+        const uint8_t* p;
+        uint8_t* band;          /* p between k+1 and 2k+1 0xFF, for the batched kernels */
+        int nw;                 /* words per residue */
+        int m;
+        int k;
+        int alloc;
+        int band_alloc;
+};
+
+extern struct bpm_peq* alloc_bpm_peq(void);
+extern int set_bpm_peq(struct bpm_peq* peq, const uint8_t* p, int m, int k);
+extern uint8_t bpm_global_banded_peq(const struct bpm_peq* peq, const uint8_t* t,int n);
+extern void free_bpm_peq(struct bpm_peq* peq);
+
+/* bpm_global_banded_peq for num sequences (idx) of the soa at once, one
+   candidate per 16, 32 or 64 bit lane depending on k:
+   out[i] = bpm_global_banded_peq(peq, cand_i, len_i). */
+extern int bpm_global_banded_batch(const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out);
+
+/* Compares one seed against num sequences (idx) of the soa. d_sc[i] is
+   bpm_256(seed, cand_i) (seed as text), d_cs[i] is bpm_256(cand_i,
+   seed). Either output may be NULL. With k >= 0 distances above k are
+   reported as k+1 and lanes stop once every candidate is above k;
+   k < 0 gives exact distances.
+   Used for the distance estimates of sequence_distance.c; the
+   clustering scan uses bpm_global_banded_batch, which runs on the same
+   lanes. */
+extern int bpm_batch(const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs);
+
+extern struct bpm_soa* alloc_bpm_soa(int numseq, int max_len);
+extern int set_bpm_soa_seq(struct bpm_soa* soa, int i, const uint8_t* s, int len);
+extern void free_bpm_soa(struct bpm_soa* soa);
+
 
 
 #endif
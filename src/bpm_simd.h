@@ -0,0 +1,626 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* 256 bit kernels of bpm.c. This file has no include guard: bpm.c
+   includes it once per instruction set with SIMD_SUFFIX (appended to
+   every name, see SIMD_FN) and SIMD_TARGET (function attribute) set.
+   With BPM_SIMD_VL the AVX-512VL forms of the 256 bit instructions are
+   used where AVX2 has no equivalent. */
+
+#if !defined(SIMD_SUFFIX) || !defined(SIMD_TARGET)
+#error "bpm_simd.h needs SIMD_SUFFIX and SIMD_TARGET"
+#endif
+
+/* taken from Alexander Yee: http://www.numberworld.org/y-cruncher/internals/addition.html#ks_add */
+static inline SIMD_TARGET __m256i SIMD_FN(add256)(uint32_t carry, __m256i A, __m256i B)
+{
+        A = _mm256_xor_si256(A, _mm256_set1_epi64x(0x8000000000000000));
+        __m256i s = _mm256_add_epi64(A, B);
+        __m256i cv = _mm256_cmpgt_epi64(A, s);
+        __m256i mv = _mm256_cmpeq_epi64(s, _mm256_set1_epi64x(0x7fffffffffffffff));
+        uint32_t c = _mm256_movemask_pd(_mm256_castsi256_pd(cv));
+        uint32_t m = _mm256_movemask_pd(_mm256_castsi256_pd(mv));
+
+        {
+                c = m + 2*c; //  lea
+                carry += c;
+                m ^= carry;
+                carry >>= 4;
+                m &= 0x0f;
+        }
+        return _mm256_add_epi64(s, _mm256_load_si256((__m256i const*) broadcast_mask[m]));
+}
+
+//----------------------------------------------------------------------------
+// bit shift left a 256-bit value using ymm registers
+//          __m256i *data - data to shift
+//          int count     - number of bits to shift
+
+static inline SIMD_TARGET void SIMD_FN(bitShiftLeft256ymm) (__m256i *data, int count)
+{
+        __m256i innerCarry, rotate;
+
+        innerCarry = _mm256_srli_epi64 (*data, 64 - count);                        // carry outs in bit 0 of each qword
+        rotate     = _mm256_permute4x64_epi64 (innerCarry, 0x93);                  // rotate ymm left 64 bits
+        innerCarry = _mm256_blend_epi32 (_mm256_setzero_si256 (), rotate, 0xFC);   // clear lower qword
+        *data    = _mm256_slli_epi64 (*data, count);                               // shift all qwords left
+        *data    = _mm256_or_si256 (*data, innerCarry);                            // propagate carrys from low qwords
+}
+
+static SIMD_TARGET uint8_t SIMD_FN(bpm_wide)(const uint8_t* t,const uint8_t* p,int n,int m)
+{
+        __m256i VP,VN,D0,HN,HP,X,NOTONE;
+        __m256i xmm1,xmm2;
+        __m256i MASK;
+
+        int i,j, k,diff;
+
+        alignas(32) uint32_t f[BPM_SOA_ALPHA][8];
+        if(m > 255){
+                m = 255;
+        }
+
+        for(i = 0; i < BPM_SOA_ALPHA;i++){
+                for(j = 0;j < 8;j++){
+                        f[i][j] =0u;
+                }
+        }
+
+        for(i = 0; i < m;i++){
+                f[p[i]][i/32] |= (1u << (i % 32));
+        }
+
+        diff = m;
+        k = m;
+
+        VP     = _mm256_set1_epi64x(0xFFFFFFFFFFFFFFFFul);
+        VN     = _mm256_setzero_si256();
+        NOTONE = _mm256_set1_epi64x(0xFFFFFFFFFFFFFFFFul);
+        MASK   = _mm256_set_epi64x (0ul,0ul,0ul,1);
+        m--;
+
+        i = m / 64;
+        while(i){
+                SIMD_FN(bitShiftLeft256ymm)(&MASK,64);
+                i--;
+        }
+        SIMD_FN(bitShiftLeft256ymm)(&MASK,m%64);
+
+        for(i = 0; i < n ;i++){
+                //X = (B[(int) *t] | VN);
+                X = _mm256_or_si256(_mm256_load_si256((__m256i const*) &f[t[i]]), VN);
+
+                //D0 = ((VP+(X&VP)) ^ VP) | X ;
+                xmm1 = _mm256_and_si256(X, VP);
+                xmm2 = SIMD_FN(add256)(0, VP, xmm1);
+                xmm1 = _mm256_xor_si256(xmm2, VP);
+                D0 = _mm256_or_si256(xmm1, X);
+
+                //HN = VP & D0;
+                HN =_mm256_and_si256(VP, D0);
+
+                //HP = VN | ~(VP | D0);
+                xmm1 = _mm256_or_si256(VP, D0);
+                xmm2 = _mm256_andnot_si256(xmm1, NOTONE);
+                HP = _mm256_or_si256(VN, xmm2);
+
+                //X = HP << 1ul;
+                X = HP;
+                SIMD_FN(bitShiftLeft256ymm)(&X, 1);
+
+                //VN = X & D0;
+                VN= _mm256_and_si256(X, D0);
+
+                //VP = (HN << 1ul) | ~(X | D0);
+                xmm1 = HN;
+                SIMD_FN(bitShiftLeft256ymm)(&xmm1, 1);
+                xmm2 = _mm256_or_si256(X, D0);
+                xmm2 = _mm256_andnot_si256(xmm2, NOTONE);
+                VP = _mm256_or_si256(xmm1, xmm2);
+
+                //diff += (HP & MASK) >> m;
+                diff += 1- _mm256_testz_si256(HP, MASK);
+
+                ///diff -= (HN & MASK) >> m;
+                diff -= 1- _mm256_testz_si256(HN,MASK);
+
+                k = MACRO_MIN(k, diff);
+        }
+        return k;
+}
+
+/* Batched kernels: one seed against BPM_BATCH_SETS * N candidates, one
+   candidate per W-bit lane. Lanes never carry into each other so the
+   plain epi16 / epi32 / epi64 adds replace add256(). The sets are
+   independent registers stepped in the same column loop, which hides
+   the latency of the bit-vector update. With k >= 0 the batch stops
+   once every lane is above k: the last row can drop by at most one per
+   remaining column. */
+static inline SIMD_TARGET __m256i SIMD_FN(bpm_set1_epi16)(uint64_t x)
+{
+        return _mm256_set1_epi16((short) x);
+}
+
+static inline SIMD_TARGET __m256i SIMD_FN(bpm_set1_epi32)(uint64_t x)
+{
+        return _mm256_set1_epi32((int) x);
+}
+
+static inline SIMD_TARGET __m256i SIMD_FN(bpm_set1_epi64)(uint64_t x)
+{
+        return _mm256_set1_epi64x((long long) x);
+}
+
+/* bit i set where p[i] == a, for the first 16 / 32 / 64 residues */
+static inline SIMD_TARGET uint64_t SIMD_FN(bpm_match_16)(const uint8_t* p, int a)
+{
+        return (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*) p), _mm_set1_epi8((char) a)));
+}
+
+static inline SIMD_TARGET uint64_t SIMD_FN(bpm_match_32)(const uint8_t* p, int a)
+{
+        return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const*) p), _mm256_set1_epi8((char) a)));
+}
+
+static inline SIMD_TARGET uint64_t SIMD_FN(bpm_match_64)(const uint8_t* p, int a)
+{
+        return SIMD_FN(bpm_match_32)(p, a) | (SIMD_FN(bpm_match_32)(p + 32, a) << 32);
+}
+
+static inline SIMD_TARGET __m256i SIMD_FN(bpm_min_epi16)(__m256i a, __m256i b)
+{
+        return _mm256_min_epi16(a, b);
+}
+
+static inline SIMD_TARGET __m256i SIMD_FN(bpm_min_epi32)(__m256i a, __m256i b)
+{
+        return _mm256_min_epi32(a, b);
+}
+
+static inline SIMD_TARGET __m256i SIMD_FN(bpm_min_epi64)(__m256i a, __m256i b)
+{
+#ifdef BPM_SIMD_VL
+        return _mm256_min_epi64(a, b);
+#else
+        return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+#endif
+}
+
+/* Pattern bitmasks of text columns c .. c+cn-1 for the lanes of the
+   batched kernels: eq[i * lanes + j] = peq[t[j][c+i]]. */
+/* 16 lanes x 16 columns at a time: the bitmasks are looked up as low
+   and high byte with pshufb (32 entries, two tables each), then the
+   16 x 16 block is transposed. Reads up to 15 residues past cn, which
+   stay within the padded row as c is a multiple of BPM_BATCH_COLS. */
+static inline SIMD_TARGET void SIMD_FN(bpm_cs_fill_16)(uint16_t* eq, int lanes, const uint8_t* const* t, int c, int cn, const uint16_t* peq)
+{
+        alignas(16) uint8_t lo[BPM_SOA_ALPHA];
+        alignas(16) uint8_t hi[BPM_SOA_ALPHA];
+        __m256i E[16];
+        __m256i A[16];
+        __m128i L0,L1,H0,H1,R,S,X,Y;
+        int i,j,r,q,g,h;
+
+        for(i = 0; i < BPM_SOA_ALPHA;i++){
+                lo[i] = peq[i] & 0xFF;
+                hi[i] = peq[i] >> 8;
+        }
+        L0 = _mm_load_si128((__m128i const*) lo);
+        L1 = _mm_load_si128((__m128i const*) (lo + 16));
+        H0 = _mm_load_si128((__m128i const*) hi);
+        H1 = _mm_load_si128((__m128i const*) (hi + 16));
+        for(j = 0; j < lanes;j += 16){
+                for(i = 0; i < cn;i += 16){
+                        for(r = 0; r < 16;r++){
+                                R = _mm_loadu_si128((__m128i const*) (t[j+r] + c + i));
+                                /* bit 4 of the residue picks the table */
+                                S = _mm_slli_epi16(R, 3);
+                                X = _mm_blendv_epi8(_mm_shuffle_epi8(L0, R), _mm_shuffle_epi8(L1, R), S);
+                                Y = _mm_blendv_epi8(_mm_shuffle_epi8(H0, R), _mm_shuffle_epi8(H1, R), S);
+                                E[r] = _mm256_set_m128i(_mm_unpackhi_epi8(X, Y), _mm_unpacklo_epi8(X, Y));
+                        }
+                        /* per 128 bit half: pairs of rows, then quads,
+                           then the 8 rows of one column */
+                        for(r = 0; r < 8;r++){
+                                A[2*r] = _mm256_unpacklo_epi16(E[2*r], E[2*r+1]);
+                                A[2*r+1] = _mm256_unpackhi_epi16(E[2*r], E[2*r+1]);
+                        }
+                        for(q = 0; q < 4;q++){
+                                for(g = 0; g < 2;g++){
+                                        E[4*q+2*g] = _mm256_unpacklo_epi32(A[4*q+g], A[4*q+2+g]);
+                                        E[4*q+2*g+1] = _mm256_unpackhi_epi32(A[4*q+g], A[4*q+2+g]);
+                                }
+                        }
+                        /* E[4q + 2g + h] holds columns 4g + 2h and 4g + 2h + 1 of rows 4q .. 4q+3 */
+                        for(g = 0; g < 4;g++){
+                                for(h = 0; h < 2;h++){
+                                        A[2*g+h] = h ? _mm256_unpackhi_epi64(E[g], E[4+g]) : _mm256_unpacklo_epi64(E[g], E[4+g]);
+                                        A[8+2*g+h] = h ? _mm256_unpackhi_epi64(E[8+g], E[12+g]) : _mm256_unpacklo_epi64(E[8+g], E[12+g]);
+                                }
+                        }
+                        for(r = 0; r < 8;r++){
+                                _mm256_store_si256((__m256i*) (eq + (i + r) * lanes + j), _mm256_permute2x128_si256(A[r], A[8+r], 0x20));
+                                _mm256_store_si256((__m256i*) (eq + (i + r + 8) * lanes + j), _mm256_permute2x128_si256(A[r], A[8+r], 0x31));
+                        }
+                }
+        }
+}
+
+/* 8 lanes x 8 columns at a time: one gather per lane, then an 8 x 8
+   transpose. Reads up to 7 residues past cn, which stay within the
+   padded row as c is a multiple of BPM_BATCH_COLS (32). */
+static inline SIMD_TARGET void SIMD_FN(bpm_cs_fill_32)(uint32_t* eq, int lanes, const uint8_t* const* t, int c, int cn, const uint32_t* peq)
+{
+        __m256i E[8];
+        __m256i A0,A1,A2,A3,B0,B1,B2,B3;
+        int i,j,r;
+
+        for(j = 0; j < lanes;j += 8){
+                for(i = 0; i < cn;i += 8){
+                        for(r = 0; r < 8;r++){
+                                E[r] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const*) (t[j+r] + c + i)));
+                                E[r] = _mm256_i32gather_epi32((int const*) peq, E[r], 4);
+                        }
+                        A0 = _mm256_unpacklo_epi32(E[0], E[1]);
+                        A1 = _mm256_unpackhi_epi32(E[0], E[1]);
+                        A2 = _mm256_unpacklo_epi32(E[2], E[3]);
+                        A3 = _mm256_unpackhi_epi32(E[2], E[3]);
+                        B0 = _mm256_unpacklo_epi32(E[4], E[5]);
+                        B1 = _mm256_unpackhi_epi32(E[4], E[5]);
+                        B2 = _mm256_unpacklo_epi32(E[6], E[7]);
+                        B3 = _mm256_unpackhi_epi32(E[6], E[7]);
+                        E[0] = _mm256_unpacklo_epi64(A0, A2);
+                        E[1] = _mm256_unpackhi_epi64(A0, A2);
+                        E[2] = _mm256_unpacklo_epi64(A1, A3);
+                        E[3] = _mm256_unpackhi_epi64(A1, A3);
+                        E[4] = _mm256_unpacklo_epi64(B0, B2);
+                        E[5] = _mm256_unpackhi_epi64(B0, B2);
+                        E[6] = _mm256_unpacklo_epi64(B1, B3);
+                        E[7] = _mm256_unpackhi_epi64(B1, B3);
+                        for(r = 0; r < 4;r++){
+                                _mm256_store_si256((__m256i*) (eq + (i + r) * lanes + j), _mm256_permute2x128_si256(E[r], E[r+4], 0x20));
+                                _mm256_store_si256((__m256i*) (eq + (i + r + 4) * lanes + j), _mm256_permute2x128_si256(E[r], E[r+4], 0x31));
+                        }
+                }
+        }
+}
+
+static inline SIMD_TARGET void SIMD_FN(bpm_cs_fill_64)(uint64_t* eq, int lanes, const uint8_t* const* t, int c, int cn, const uint64_t* peq)
+{
+        int i,j;
+        for(j = 0; j < lanes;j++){
+                for(i = 0; i < cn;i++){
+                        eq[i * lanes + j] = peq[t[j][c+i]];
+                }
+        }
+}
+
+/* seed is the text, the candidates are the patterns: all lanes read the
+   same text residue so the column loop is pure SIMD. Only the bitmasks
+   of residues in the seed are built, by comparing whole candidates (the
+   soa stride is a multiple of 32) with each of them. */
+#define BPM_BATCH_SC(W,N,UTYPE)                                         \
+        static SIMD_TARGET void SIMD_FN(bpm_batch_sc_##W)(const uint8_t* t,int n, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* out) \
+        {                                                               \
+                alignas(32) UTYPE f[BPM_SOA_ALPHA][BPM_BATCH_SETS * N]; \
+                alignas(32) UTYPE mask[BPM_BATCH_SETS * N];             \
+                alignas(32) UTYPE res[BPM_BATCH_SETS * N];              \
+                __m256i VP[BPM_BATCH_SETS],VN[BPM_BATCH_SETS],DIFF[BPM_BATCH_SETS],K[BPM_BATCH_SETS],MASK[BPM_BATCH_SETS]; \
+                __m256i D0,HN,HP,X,NOTONE,KV,DONE;                      \
+                alignas(32) UTYPE lm[BPM_BATCH_SETS * N];               \
+                const uint8_t* c[BPM_BATCH_SETS * N];                   \
+                uint32_t letters;                                       \
+                uint32_t l;                                             \
+                int i,j,m,a,s;                                          \
+                                                                        \
+                letters = 0;                                            \
+                for(i = 0; i < n;i++){                                  \
+                        letters |= 1u << t[i];                          \
+                }                                                       \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        m = 0;                                          \
+                        c[j] = soa->s;                                  \
+                        if(j < num){                                    \
+                                c[j] += (size_t) idx[j] * soa->stride;  \
+                                m = soa->len[idx[j]];                   \
+                        }                                               \
+                        lm[j] = m ? (UTYPE) ~(UTYPE) 0 >> (W - m) : 0;  \
+                        mask[j] = m ? (UTYPE) 1 << (m-1) : 0;           \
+                        res[j] = j < num ? m : BPM_BATCH_LARGE;         \
+                }                                                       \
+                for(l = letters; l;l &= l - 1){                         \
+                        a = __builtin_ctz(l);                           \
+                        for(j = 0; j < BPM_BATCH_SETS * N;j++){         \
+                                f[a][j] = (UTYPE) SIMD_FN(bpm_match_##W)(c[j], a) & lm[j]; \
+                        }                                               \
+                }                                                       \
+                KV = SIMD_FN(bpm_set1_epi##W)(k);                       \
+                NOTONE = _mm256_set1_epi64x(0xFFFFFFFFFFFFFFFFul);      \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        MASK[s] = _mm256_load_si256((__m256i const*) (mask + s * N)); \
+                        DIFF[s] = _mm256_load_si256((__m256i const*) (res + s * N)); \
+                        K[s] = DIFF[s];                                 \
+                        VP[s] = NOTONE;                                 \
+                        VN[s] = _mm256_setzero_si256();                 \
+                }                                                       \
+                for(i = 0; i < n;i++){                                  \
+                        for(s = 0; s < BPM_BATCH_SETS;s++){             \
+                                X = _mm256_or_si256(_mm256_load_si256((__m256i const*) (f[t[i]] + s * N)), VN[s]); \
+                                D0 = _mm256_add_epi##W(_mm256_and_si256(X, VP[s]), VP[s]); \
+                                D0 = _mm256_or_si256(_mm256_xor_si256(D0, VP[s]), X); \
+                                HN = _mm256_and_si256(VP[s], D0);       \
+                                HP = _mm256_or_si256(VN[s], _mm256_andnot_si256(_mm256_or_si256(VP[s], D0), NOTONE)); \
+                                X = _mm256_slli_epi##W(HP, 1);          \
+                                VN[s] = _mm256_and_si256(X, D0);        \
+                                VP[s] = _mm256_or_si256(_mm256_slli_epi##W(HN, 1), _mm256_andnot_si256(_mm256_or_si256(X, D0), NOTONE)); \
+                                DIFF[s] = _mm256_sub_epi##W(DIFF[s], _mm256_cmpeq_epi##W(_mm256_and_si256(HP, MASK[s]), MASK[s])); \
+                                DIFF[s] = _mm256_add_epi##W(DIFF[s], _mm256_cmpeq_epi##W(_mm256_and_si256(HN, MASK[s]), MASK[s])); \
+                                K[s] = SIMD_FN(bpm_min_epi##W)(K[s], DIFF[s]); \
+                        }                                               \
+                        if(k >= 0){                                     \
+                                DONE = NOTONE;                          \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        X = _mm256_sub_epi##W(DIFF[s], SIMD_FN(bpm_set1_epi##W)(n - i - 1)); \
+                                        DONE = _mm256_and_si256(DONE, _mm256_cmpgt_epi##W(SIMD_FN(bpm_min_epi##W)(K[s], X), KV)); \
+                                }                                       \
+                                if(_mm256_movemask_epi8(DONE) == -1){   \
+                                        break;                          \
+                                }                                       \
+                        }                                               \
+                }                                                       \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        _mm256_store_si256((__m256i*) (res + s * N), K[s]); \
+                }                                                       \
+                for(j = 0; j < num;j++){                                \
+                        out[j] = mask[j] ? (uint8_t) (k >= 0 ? MACRO_MIN(res[j], (UTYPE) (k+1)) : res[j]) : 0; \
+                }                                                       \
+        }
+
+/* candidates are the texts, the seed is the pattern: every lane looks
+   up its own residue in the shared seed bitmasks. The lookups of
+   BPM_BATCH_COLS columns are done ahead of the column loop. Lanes whose
+   text has ended read padding, which matches nothing, and the last row
+   never drops on such columns, so their minimum is final. */
+#define BPM_BATCH_CS(W,N,UTYPE)                                         \
+        static SIMD_TARGET void SIMD_FN(bpm_batch_cs_##W)(const uint8_t* p,int m, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* out) \
+        {                                                               \
+                alignas(32) UTYPE eq[BPM_BATCH_COLS][BPM_BATCH_SETS * N]; \
+                alignas(32) UTYPE res[BPM_BATCH_SETS * N];              \
+                alignas(32) UTYPE peq[BPM_SOA_ALPHA];                   \
+                const uint8_t* t[BPM_BATCH_SETS * N];                   \
+                __m256i VP[BPM_BATCH_SETS],VN[BPM_BATCH_SETS],DIFF[BPM_BATCH_SETS],K[BPM_BATCH_SETS],LEN[BPM_BATCH_SETS]; \
+                __m256i D0,HN,HP,X,NOTONE,MASK,KV,ACTIVE,COL,DONE;      \
+                int i,j,n,c,cn,s;                                       \
+                                                                        \
+                if(!m){                                                 \
+                        for(j = 0; j < num;j++){                        \
+                                out[j] = 0;                             \
+                        }                                               \
+                        return;                                         \
+                }                                                       \
+                for(i = 0; i < BPM_SOA_ALPHA;i++){                      \
+                        peq[i] = 0;                                     \
+                }                                                       \
+                for(i = 0; i < m;i++){                                  \
+                        peq[p[i]] |= (UTYPE) 1 << i;                    \
+                }                                                       \
+                peq[BPM_SOA_PAD] = 0;                                   \
+                n = 0;                                                  \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        if(j < num){                                    \
+                                t[j] = soa->s + (size_t) idx[j] * soa->stride; \
+                                res[j] = soa->len[idx[j]];              \
+                                n = MACRO_MAX(n, soa->len[idx[j]]);     \
+                        }else{                                          \
+                                t[j] = soa->s;                          \
+                                res[j] = 0;                             \
+                        }                                               \
+                }                                                       \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        LEN[s] = _mm256_load_si256((__m256i const*) (res + s * N)); \
+                }                                                       \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        res[j] = j < num ? m : BPM_BATCH_LARGE;         \
+                }                                                       \
+                MASK = SIMD_FN(bpm_set1_epi##W)((UTYPE) 1 << (m-1));    \
+                KV = SIMD_FN(bpm_set1_epi##W)(k);                       \
+                NOTONE = _mm256_set1_epi64x(0xFFFFFFFFFFFFFFFFul);      \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        DIFF[s] = SIMD_FN(bpm_set1_epi##W)(m);          \
+                        K[s] = _mm256_load_si256((__m256i const*) (res + s * N)); \
+                        VP[s] = NOTONE;                                 \
+                        VN[s] = _mm256_setzero_si256();                 \
+                }                                                       \
+                for(c = 0; c < n;c += BPM_BATCH_COLS){                  \
+                        cn = MACRO_MIN(BPM_BATCH_COLS, n - c);          \
+                        SIMD_FN(bpm_cs_fill_##W)(eq[0], BPM_BATCH_SETS * N, t, c, cn, peq); \
+                        for(i = 0; i < cn;i++){                         \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        X = _mm256_or_si256(_mm256_load_si256((__m256i const*) (eq[i] + s * N)), VN[s]); \
+                                        D0 = _mm256_add_epi##W(_mm256_and_si256(X, VP[s]), VP[s]); \
+                                        D0 = _mm256_or_si256(_mm256_xor_si256(D0, VP[s]), X); \
+                                        HN = _mm256_and_si256(VP[s], D0); \
+                                        HP = _mm256_or_si256(VN[s], _mm256_andnot_si256(_mm256_or_si256(VP[s], D0), NOTONE)); \
+                                        X = _mm256_slli_epi##W(HP, 1);  \
+                                        VN[s] = _mm256_and_si256(X, D0); \
+                                        VP[s] = _mm256_or_si256(_mm256_slli_epi##W(HN, 1), _mm256_andnot_si256(_mm256_or_si256(X, D0), NOTONE)); \
+                                        DIFF[s] = _mm256_sub_epi##W(DIFF[s], _mm256_cmpeq_epi##W(_mm256_and_si256(HP, MASK), MASK)); \
+                                        DIFF[s] = _mm256_add_epi##W(DIFF[s], _mm256_cmpeq_epi##W(_mm256_and_si256(HN, MASK), MASK)); \
+                                        K[s] = SIMD_FN(bpm_min_epi##W)(K[s], DIFF[s]); \
+                                }                                       \
+                                if(k >= 0){                             \
+                                        /* lanes that are done only need K > k */ \
+                                        COL = SIMD_FN(bpm_set1_epi##W)(c + i + 1); \
+                                        DONE = NOTONE;                  \
+                                        for(s = 0; s < BPM_BATCH_SETS;s++){ \
+                                                ACTIVE = _mm256_cmpgt_epi##W(LEN[s], COL); \
+                                                X = _mm256_sub_epi##W(DIFF[s], _mm256_sub_epi##W(LEN[s], COL)); \
+                                                X = _mm256_or_si256(_mm256_cmpgt_epi##W(X, KV), _mm256_andnot_si256(ACTIVE, NOTONE)); \
+                                                X = _mm256_and_si256(X, _mm256_cmpgt_epi##W(K[s], KV)); \
+                                                /* unused lanes have no length */ \
+                                                X = _mm256_or_si256(X, _mm256_cmpeq_epi##W(LEN[s], _mm256_setzero_si256())); \
+                                                DONE = _mm256_and_si256(DONE, X); \
+                                        }                               \
+                                        if(_mm256_movemask_epi8(DONE) == -1){ \
+                                                goto done;              \
+                                        }                               \
+                                }                                       \
+                        }                                               \
+                }                                                       \
+        done:                                                           \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        _mm256_store_si256((__m256i*) (res + s * N), K[s]); \
+                }                                                       \
+                for(j = 0; j < num;j++){                                \
+                        out[j] = (uint8_t) (k >= 0 ? MACRO_MIN(res[j], (UTYPE) (k+1)) : res[j]); \
+                }                                                       \
+        }
+
+/* banded global distance with the candidates as texts (see the generic
+   version in bpm.c): each lane compares its residue with the 2k+2 seed
+   residues of its band. The residues are transposed into the lane
+   layout by the fills of the cs kernels, through an identity table. */
+#define BPM_BATCH_GL(W,N,UTYPE)                                         \
+        static SIMD_TARGET void SIMD_FN(bpm_batch_gl_##W)(const uint8_t* band,int m, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* out) \
+        {                                                               \
+                alignas(32) UTYPE eq[BPM_BATCH_COLS][BPM_BATCH_SETS * N]; \
+                alignas(32) UTYPE res[BPM_BATCH_SETS * N];              \
+                alignas(32) UTYPE diag[BPM_BATCH_SETS * N];             \
+                alignas(32) UTYPE ident[BPM_SOA_ALPHA];                 \
+                const uint8_t* t[BPM_BATCH_SETS * N];                   \
+                __m256i VP[BPM_BATCH_SETS],VN[BPM_BATCH_SETS],EQ[BPM_BATCH_SETS],R[BPM_BATCH_SETS]; \
+                __m256i SCORE[BPM_BATCH_SETS],LEN[BPM_BATCH_SETS],DIAG[BPM_BATCH_SETS],ACTIVE[BPM_BATCH_SETS]; \
+                __m256i D0,HN,HP,X,B,BMASK,EMASK,KV,COL,ZERO,ANY;       \
+                UTYPE bmask;                                            \
+                int i,j,n,c,cn,r,s,w;                                   \
+                                                                        \
+                for(i = 0; i < BPM_SOA_ALPHA;i++){                      \
+                        ident[i] = i;                                   \
+                }                                                       \
+                w = 2 * k + 1;                                          \
+                bmask = (UTYPE) (((UTYPE) 1 << w) - 1);                 \
+                n = 0;                                                  \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        t[j] = soa->s;                                  \
+                        res[j] = 0;                                     \
+                        diag[j] = 0;                                    \
+                        if(j < num){                                    \
+                                t[j] += (size_t) idx[j] * soa->stride;  \
+                                res[j] = soa->len[idx[j]];              \
+                                diag[j] = (UTYPE) 1 << (k - (soa->len[idx[j]] - m)); \
+                                n = MACRO_MAX(n, soa->len[idx[j]]);     \
+                        }                                               \
+                }                                                       \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        LEN[s] = _mm256_load_si256((__m256i const*) (res + s * N)); \
+                }                                                       \
+                for(j = 0; j < BPM_BATCH_SETS * N;j++){                 \
+                        res[j] = j < num ? abs(soa->len[idx[j]] - m) : 0; \
+                }                                                       \
+                ZERO = _mm256_setzero_si256();                          \
+                KV = SIMD_FN(bpm_set1_epi##W)(k);                       \
+                BMASK = SIMD_FN(bpm_set1_epi##W)(bmask);                \
+                EMASK = _mm256_or_si256(_mm256_slli_epi##W(BMASK, 1), SIMD_FN(bpm_set1_epi##W)(1)); \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        SCORE[s] = _mm256_load_si256((__m256i const*) (res + s * N)); \
+                        DIAG[s] = _mm256_load_si256((__m256i const*) (diag + s * N)); \
+                        VN[s] = SIMD_FN(bpm_set1_epi##W)(((UTYPE) 1 << (k + 1)) - 1); \
+                        VP[s] = _mm256_andnot_si256(VN[s], BMASK);      \
+                        ACTIVE[s] = _mm256_cmpgt_epi##W(LEN[s], ZERO);  \
+                }                                                       \
+                for(c = 0; c < n;c += BPM_BATCH_COLS){                  \
+                        cn = MACRO_MIN(BPM_BATCH_COLS, n - c);          \
+                        SIMD_FN(bpm_cs_fill_##W)(eq[0], BPM_BATCH_SETS * N, t, c, cn, ident); \
+                        for(i = 0; i < cn;i++){                         \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        R[s] = _mm256_load_si256((__m256i const*) (eq[i] + s * N)); \
+                                        EQ[s] = ZERO;                   \
+                                }                                       \
+                                for(r = w; r >= 0;r--){                 \
+                                        B = SIMD_FN(bpm_set1_epi##W)(band[c+i+r]); \
+                                        for(s = 0; s < BPM_BATCH_SETS;s++){ \
+                                                EQ[s] = _mm256_sub_epi##W(_mm256_slli_epi##W(EQ[s], 1), _mm256_cmpeq_epi##W(R[s], B)); \
+                                        }                               \
+                                }                                       \
+                                COL = SIMD_FN(bpm_set1_epi##W)(c + i + 1); \
+                                ANY = ZERO;                             \
+                                for(s = 0; s < BPM_BATCH_SETS;s++){     \
+                                        X = _mm256_or_si256(EQ[s], VN[s]); \
+                                        D0 = _mm256_add_epi##W(_mm256_and_si256(X, VP[s]), VP[s]); \
+                                        D0 = _mm256_or_si256(_mm256_xor_si256(D0, VP[s]), X); \
+                                        D0 = _mm256_and_si256(D0, EMASK); \
+                                        HN = _mm256_and_si256(VP[s], D0); \
+                                        HP = _mm256_or_si256(VN[s], _mm256_andnot_si256(_mm256_or_si256(VP[s], D0), BMASK)); \
+                                        X = _mm256_srli_epi##W(D0, 1);  \
+                                        VN[s] = _mm256_and_si256(X, HP); \
+                                        VP[s] = _mm256_or_si256(HN, _mm256_andnot_si256(_mm256_or_si256(X, HP), BMASK)); \
+                                        X = _mm256_cmpeq_epi##W(_mm256_and_si256(X, DIAG[s]), ZERO); \
+                                        SCORE[s] = _mm256_sub_epi##W(SCORE[s], _mm256_and_si256(X, ACTIVE[s])); \
+                                        ACTIVE[s] = _mm256_andnot_si256(_mm256_cmpgt_epi##W(SCORE[s], KV), _mm256_cmpgt_epi##W(LEN[s], COL)); \
+                                        ANY = _mm256_or_si256(ANY, ACTIVE[s]); \
+                                }                                       \
+                                if(_mm256_testz_si256(ANY, ANY)){       \
+                                        goto done;                      \
+                                }                                       \
+                        }                                               \
+                }                                                       \
+        done:                                                           \
+                for(s = 0; s < BPM_BATCH_SETS;s++){                     \
+                        _mm256_store_si256((__m256i*) (res + s * N), SCORE[s]); \
+                }                                                       \
+                for(j = 0; j < num;j++){                                \
+                        out[j] = (uint8_t) res[j];                      \
+                }                                                       \
+        }
+
+BPM_BATCH_SC(16,16,uint16_t)
+BPM_BATCH_SC(32,8,uint32_t)
+BPM_BATCH_SC(64,4,uint64_t)
+
+BPM_BATCH_CS(16,16,uint16_t)
+BPM_BATCH_CS(32,8,uint32_t)
+BPM_BATCH_CS(64,4,uint64_t)
+
+BPM_BATCH_GL(16,16,uint16_t)
+BPM_BATCH_GL(32,8,uint32_t)
+BPM_BATCH_GL(64,4,uint64_t)
+
+#undef BPM_BATCH_SC
+#undef BPM_BATCH_CS
+#undef BPM_BATCH_GL
+
+static const struct bpm_lane_kernels SIMD_FN(bpm_lanes) = {
+        {SIMD_FN(bpm_batch_sc_16), SIMD_FN(bpm_batch_sc_32), SIMD_FN(bpm_batch_sc_64)},
+        {SIMD_FN(bpm_batch_cs_16), SIMD_FN(bpm_batch_cs_32), SIMD_FN(bpm_batch_cs_64)},
+        {SIMD_FN(bpm_batch_gl_16), SIMD_FN(bpm_batch_gl_32), SIMD_FN(bpm_batch_gl_64)},
+        {16 * BPM_BATCH_SETS, 8 * BPM_BATCH_SETS, 4 * BPM_BATCH_SETS}
+};
+
+static int SIMD_FN(bpm_batch)(const uint8_t* seed,int len, const struct bpm_soa* soa, const int* idx, int num, int k, uint8_t* d_sc, uint8_t* d_cs)
+{
+        return bpm_batch_lanes(&SIMD_FN(bpm_lanes), seed, len, soa, idx, num, k, d_sc, d_cs);
+}
+
+static int SIMD_FN(bpm_global_batch)(const struct bpm_peq* peq, const struct bpm_soa* soa, const int* idx, int num, uint8_t* out)
+{
+        return bpm_global_lanes(&SIMD_FN(bpm_lanes), peq, soa, idx, num, out);
+}
@@ -21,14 +21,32 @@
 */
 
 #include "euclidean_dist.h"
+#include "simd.h"
 #include "rng.h"
-#include <xmmintrin.h>
+#if defined(HAVE_AVX2) || defined(HAVE_AVX512)
 #include <immintrin.h>
+#endif
 #include "float.h"
+#include <string.h>
 /* These functions were taken from:  */
 /* https://stackoverflow.com/questions/6996764/fastest-way-to-do-horizontal-float-vector-sum-on-x86 */
-float hsum256_ps_avx(__m256 v);
-float hsum_ps_sse3(__m128 v);
+#if defined(HAVE_AVX2) || defined(HAVE_AVX512)
+static SIMD_TARGET_AVX2 float hsum256_ps_avx(__m256 v);
+static SIMD_TARGET_SSE41 float hsum_ps_sse3(__m128 v);
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define EDIST_VECTOR_EXT
+static int edist_generic(const float* a,const float* b, const int len, float* ret);
+#else
+#define edist_generic edist_serial
+#endif
+#ifdef HAVE_AVX512
+static int edist_avx512(const float* a,const float* b, const int len, float* ret);
+#endif
+
+/* selected by edist_set_simd() */
+static int (*edist_kernel)(const float* a,const float* b, const int len, float* ret) = edist_generic;
 
 
 #ifdef ITEST
@@ -40,14 +58,17 @@ int main(int argc, char *argv[])
         double r;
         float d1,d2;
         int i,j,c;
+        int level;
         int max_iter = 10;
         int num_element = 128;
 //        mat = galloc(mat,1000,8,0.0);
-//void* _mm_malloc (size_t size, size_t align)
 
         MMALLOC(mat, sizeof(float*)* 1000);
         for(i = 0; i < 1000;i++){
-                mat[i] = _mm_malloc(sizeof(float)*num_element, 32);
+                mat[i] = NULL;
+                if(posix_memalign((void**) &mat[i], 32, sizeof(float)*num_element)){
+                        ERROR_MSG("posix_memalign failed.");
+                }
         }
 
         RUNP( rng =init_rng(0));
@@ -61,52 +82,40 @@ int main(int argc, char *argv[])
                 }
         }
         LOG_MSG("Check for correctness.");
-#ifdef HAVE_AVX2
-        for(i = 0; i < 1000;i++){
-                for(j = 0; j <= i;j++){
-                        edist_serial(mat[i], mat[j], num_element, &d1);
-                        edist_256(mat[i], mat[j], num_element, &d2);
-                        if(fabsf(d1-d2) > 10e-6){
-                                ERROR_MSG("DIFFER: %d\t%d\t%f\t%f  (%e %e)\n", i,j,d1,d2, fabsf(d1-d2), FLT_EPSILON);
-
+        for(level = SIMD_SCALAR; level <= simd_cpu_level();level++){
+                RUN(edist_set_simd(level));
+                for(i = 0; i < 1000;i++){
+                        for(j = 0; j <= i;j++){
+                                edist_serial(mat[i], mat[j], num_element, &d1);
+                                edist(mat[i], mat[j], num_element, &d2);
+                                if(fabsf(d1-d2) > 10e-6){
+                                        ERROR_MSG("DIFFER: %d\t%d\t%f\t%f  (%e %e)\n", i,j,d1,d2, fabsf(d1-d2), FLT_EPSILON);
+
+                                }
                         }
                 }
         }
-#endif
         DECLARE_TIMER(t);
 
-        LOG_MSG("Timing serial");
-        START_TIMER(t);
-        for(c = 0; c < max_iter;c++){
-        for(i = 0; i < 1000;i++){
-                for(j = 0; j <= i;j++){
-                        edist_serial(mat[i], mat[j], num_element, &d1);
-
-
+        for(level = SIMD_SCALAR; level <= simd_cpu_level();level++){
+                if(level == SIMD_SSE41){
+                        continue;
                 }
-        }
-        }
-        STOP_TIMER(t);
-        LOG_MSG("%f\tsec.",GET_TIMING(t));
-
-#ifdef HAVE_AVX2
-        LOG_MSG("Timing AVX");
-        START_TIMER(t);
-        for(c = 0; c < max_iter; c++){
-        for(i = 0; i < 1000;i++){
-                for(j = 0; j <= i;j++){
-
-                        edist_256(mat[i], mat[j], num_element, &d2);
-
+                RUN(edist_set_simd(level));
+                LOG_MSG("Timing %s", simd_level_name(level));
+                START_TIMER(t);
+                for(c = 0; c < max_iter; c++){
+                        for(i = 0; i < 1000;i++){
+                                for(j = 0; j <= i;j++){
+                                        edist(mat[i], mat[j], num_element, &d2);
+                                }
+                        }
                 }
+                STOP_TIMER(t);
+                LOG_MSG("%f\tsec.",GET_TIMING(t));
         }
-        }
-        STOP_TIMER(t);
-        LOG_MSG("%f\tsec.",GET_TIMING(t));
-
-#endif
         for(i = 0; i < 1000;i++){
-                _mm_free(mat[i]);
+                MFREE(mat[i]);
         }
         MFREE(mat);
 
@@ -151,9 +160,92 @@ int edist_serial_d(const double* a,const double* b,const int len, double* ret)
         return OK;
 }
 
+int edist(const float* a,const float* b, const int len, float* ret)
+{
+        return edist_kernel(a, b, len, ret);
+}
+
+int edist_set_simd(int level)
+{
+        edist_kernel = edist_generic;
 #ifdef HAVE_AVX2
+        if(level >= SIMD_AVX2){
+                edist_kernel = edist_256;
+        }
+#endif
+#ifdef HAVE_AVX512
+        if(level >= SIMD_AVX512){
+                edist_kernel = edist_avx512;
+        }
+#endif
+        return OK;
+}
+
+#ifdef EDIST_VECTOR_EXT
+/* Baseline kernel with the generic vector extensions (SSE2 / NEON):
+   rows are padded to a multiple of 8 floats, so two vectors of 4 are
+   summed per step. */
+typedef float edist_v4 __attribute__((vector_size(16)));
 
-int edist_256(const float* a,const float* b, const int len, float* ret)
+static int edist_generic(const float* a,const float* b, const int len, float* ret)
+{
+        edist_v4 r1 = {0.0f, 0.0f, 0.0f, 0.0f};
+        edist_v4 r2 = {0.0f, 0.0f, 0.0f, 0.0f};
+        edist_v4 x1,x2;
+        int i;
+        for(i = 0;i < len;i+=8){
+                memcpy(&x1, a + i, sizeof(edist_v4));
+                memcpy(&x2, b + i, sizeof(edist_v4));
+                x1 -= x2;
+                r1 += x1 * x1;
+                memcpy(&x1, a + i + 4, sizeof(edist_v4));
+                memcpy(&x2, b + i + 4, sizeof(edist_v4));
+                x1 -= x2;
+                r2 += x1 * x1;
+        }
+        r1 += r2;
+        *ret = sqrtf(r1[0] + r1[1] + r1[2] + r1[3]);
+        return OK;
+}
+#endif
+
+#ifdef HAVE_AVX512
+/* rows are padded to a multiple of 8 floats (and 32 byte aligned): the
+   part that does not fill a 512 bit register is done 8 at a time */
+static SIMD_TARGET_AVX512 int edist_avx512(const float* a,const float* b, const int len, float* ret)
+{
+        int i;
+        __m512 zmm1;
+        __m512 zmm2;
+        __m512 r = _mm512_setzero_ps();
+        __m256 xmm1;
+        __m256 xmm2;
+        float d;
+        for(i = 0;i + 16 <= len;i+=16){
+                zmm1 = _mm512_loadu_ps(a);
+                zmm2 = _mm512_loadu_ps(b);
+                zmm1 = _mm512_sub_ps(zmm1, zmm2);
+                r = _mm512_fmadd_ps(zmm1, zmm1, r);
+                a+=16;
+                b+=16;
+        }
+        d = _mm512_reduce_add_ps(r);
+        for(;i < len;i+=8){
+                xmm1 = _mm256_load_ps(a);
+                xmm2 = _mm256_load_ps(b);
+                xmm1 = _mm256_sub_ps(xmm1, xmm2);
+                xmm1 = _mm256_mul_ps(xmm1, xmm1);
+                d += hsum256_ps_avx(xmm1);
+                a+=8;
+                b+=8;
+        }
+        *ret = sqrtf(d);
+        return OK;
+}
+#endif
+
+#ifdef HAVE_AVX2
+SIMD_TARGET_AVX2 int edist_256(const float* a,const float* b, const int len, float* ret)
 {
 
         float d = 0.0f;
@@ -178,11 +270,10 @@ int edist_256(const float* a,const float* b, const int len, float* ret)
         *ret = sqrtf(d);
         return OK;
 }
+#endif
 
-
-
-
-float hsum256_ps_avx(__m256 v)
+#if defined(HAVE_AVX2) || defined(HAVE_AVX512)
+static SIMD_TARGET_AVX2 float hsum256_ps_avx(__m256 v)
 {
         __m128 vlow  = _mm256_castps256_ps128(v);
         __m128 vhigh = _mm256_extractf128_ps(v, 1); // high 128
@@ -191,7 +282,7 @@ float hsum256_ps_avx(__m256 v)
         // (no wasted instructions, and all of them are the 4B minimum)
 }
 
-float hsum_ps_sse3(__m128 v)
+static SIMD_TARGET_SSE41 float hsum_ps_sse3(__m128 v)
 {
         __m128 shuf = _mm_movehdup_ps(v);        // broadcast elements 3,1 to 2,0
         __m128 sums = _mm_add_ps(v, shuf);
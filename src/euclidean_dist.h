@@ -27,7 +27,10 @@
 
 
 
-extern  int edist_256(const float* a,const float* b, const int len, float* ret);
+/* Euclidean distance of two rows padded to a multiple of 8 floats and
+   32 byte aligned, with the kernel picked by edist_set_simd(). */
+extern int edist(const float* a,const float* b, const int len, float* ret);
+extern int edist_256(const float* a,const float* b, const int len, float* ret);
 extern int edist_serial(const float* a,const float* b,const int len, float* ret);
 extern int edist_serial_d(const double* a,const double* b,const int len, double* ret);
 
@@ -28,23 +28,62 @@
 #define FORMAT_FA 1
 #define FORMAT_MSF 2
 #define FORMAT_CLU 3
+#define FORMAT_SNB 4
+#define FORMAT_FQ 5
 
 #include <stdint.h>
+#include <stddef.h>
 
+/* Count of a unique sequence in one input sample. */
+struct sample_count{
+        int sample;
+        int count;
+};
+
+/* A record is a view into the arenas of struct msa.  */
 struct msa_seq{
         char* name;
         char* seq;
         uint8_t* s;
-        int* gaps;
+        int* gaps;              /* NULL unless the input is aligned */
+        struct msa_seq* dup;    /* next record with the same sequence */
+        struct sample_count* abund;     /* non-zero counts per sample, pooled input only */
+        int num_abund;
+        int sample;             /* input file the record came from */
         int len;
         int name_len;
-        int alloc_len;
         int count;
         int cluster;
 };
 
+/* Growable byte arena. While reading, records are addressed by offset;
+   the msa_seq pointers are set once the arenas stop moving. */
+struct msa_arena{
+        char* data;
+        long int used;
+        long int alloc;
+};
+
+/* Read filters applied while parsing fastq input; 0 (-1 for max_ee)
+   switches a filter off. */
+struct seq_filter{
+        double min_qual;        /* mean Phred quality */
+        double max_ee;          /* expected errors: sum of 10^(-q/10) */
+        int min_len;
+        int max_len;
+        int num_reads;
+        int num_kept;
+};
+
 struct msa{
         struct msa_seq** sequences;
+        struct msa_seq* seq_store;
+        long int* name_off;     /* into names; -(file offset + 1) for lazy names */
+        long int* seq_off;      /* same offset into residues, internal and gap_counts */
+        struct msa_arena names;
+        struct msa_arena residues;
+        struct msa_arena internal;
+        struct msa_arena gap_counts;   /* ints; empty unless aligned */
         int** sip;
         int* nsip;
         int* plen;
@@ -54,11 +93,41 @@ struct msa{
         int aligned;
         int letter_freq[128];
         int L;
+        int encoded;    /* alphabet internal was filled with while reading; -1 if none */
+        int num_unique; /* set if the records come prepared from a .snb file */
+        int have_counts;        /* counts set by the reader (fastq: one per read) */
+        struct seq_filter filter;
+        char** sample_names;    /* one per input file when pooling */
+        int num_samples;
+        struct sample_count* abund_store;
+        int lazy_names;         /* leave names in the input file (mapped fasta/fastq only) */
+        char** name_src;        /* per input file: where lazy names are read back from */
+        int num_name_src;
+        const char* src_buf;    /* while parsing lazily: buffer and its offset in the file */
+        long int src_pos;
+        void* map;      /* .snb file the records point into */
+        size_t map_size;
+};
 
-
-
+/* Reads lazy names back from their files. load_msa_names points the
+   names of the records given at the reader's buffer (valid until the
+   next load) reading in file order; unload_msa_names drops them again. */
+struct name_reader{
+        int* fd;                /* per name_src, opened on first use */
+        int num_fd;
+        char* buf;
+        long int alloc;
+        char* span;
+        long int alloc_span;
+        struct name_pos* pos;
+        int alloc_pos;
 };
 
+struct name_reader* open_name_reader(struct msa* msa);
+int load_msa_names(struct name_reader* nr, struct msa* msa, struct msa_seq** seq, int n);
+void unload_msa_names(struct msa* msa, struct msa_seq** seq, int n);
+void close_name_reader(struct name_reader* nr);
+
 /* dealign */
 int dealign_msa(struct msa* msa);
 
@@ -68,6 +137,9 @@ int convert_msa_to_internal(struct msa* msa, int type);
 /* rw functions */
 
 struct msa* read_input(char* infile,struct msa* msa);
+struct msa* read_inputs(char** infile, int num_infiles, struct msa* msa);
+struct msa* alloc_msa(void);
+int resize_msa(struct msa* msa);
 int write_msa(struct msa* msa, char* outfile, int type);
 void free_msa(struct msa* msa);
 
@@ -0,0 +1,365 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "msa_sort.h"
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#ifdef MSA_SORT_TEST
+#include "rng.h"
+#endif
+
+#include <string.h>
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+/* count descending in the high half, length descending in the low
+   half; the input order is kept by the stable sort */
+struct sort_key{
+        uint64_t key;
+        int id;
+};
+
+static int radix_sort_keys(struct sort_key* keys, long int n);
+static uint64_t count_key(const struct msa_seq* seq);
+
+#ifdef MSA_SORT_TEST
+static int compare_ref(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+        struct msa* msa = NULL;
+        struct rng_state* rng = NULL;
+        struct msa_seq** ref = NULL;
+        int* expect = NULL;
+        int num = 5000;
+        int num_unique = 4000;
+        int threads[3] = {1, 3, 8};
+        int i,t;
+        int r;
+
+        RUNP(rng = init_rng(42));
+        for(t = 0; t < 3;t++){
+#ifdef HAVE_OPENMP
+                omp_set_num_threads(threads[t]);
+#endif
+                RUNP(msa = alloc_msa());
+                while(msa->alloc_numseq < num){
+                        RUN(resize_msa(msa));
+                }
+                /* few distinct counts and lengths: many ties; headers
+                   can give negative counts */
+                for(i = 0; i < num;i++){
+                        r = tl_random_int(rng, 5);
+                        if(r == 0){
+                                msa->seq_store[i].count = tl_random_int(rng, 1 << 20);
+                        }else if(r == 1){
+                                msa->seq_store[i].count = -1 - tl_random_int(rng, 5);
+                        }else{
+                                msa->seq_store[i].count = 1 + tl_random_int(rng, 5);
+                        }
+                        msa->seq_store[i].len = 50 + tl_random_int(rng, 3);
+                        msa->seq_store[i].dup = NULL;
+                        msa->seq_store[i].cluster = i;
+                        msa->sequences[i] = msa->seq_store + i;
+                }
+                /* the last records are duplicates of earlier ones */
+                for(i = num_unique; i < num;i++){
+                        msa->seq_store[i].cluster = -i;
+                        msa->seq_store[i - num_unique].dup = msa->seq_store + i;
+                }
+                /* cluster holds the input position; the offsets must move along */
+                for(i = 0; i < num;i++){
+                        msa->name_off[i] = msa->seq_store[i].cluster;
+                        msa->seq_off[i] = -msa->seq_store[i].cluster;
+                }
+                msa->numseq = num_unique;
+
+                MMALLOC(ref, sizeof(struct msa_seq*) * num_unique);
+                MMALLOC(expect, sizeof(int) * num_unique);
+                for(i = 0; i < num_unique;i++){
+                        ref[i] = msa->sequences[i];
+                }
+                qsort(ref, num_unique, sizeof(struct msa_seq*), compare_ref);
+                for(i = 0; i < num_unique;i++){
+                        expect[i] = ref[i]->cluster;
+                }
+
+                RUN(sort_msa_by_count(msa, num));
+                for(i = 0; i < num;i++){
+                        ASSERT(msa->sequences[i] == msa->seq_store + i, "Record %d not in store order.", i);
+                        ASSERT(msa->name_off[i] == msa->seq_store[i].cluster && msa->seq_off[i] == -msa->seq_store[i].cluster, "Offsets of record %d not moved along.", i);
+                        if(i < num_unique){
+                                ASSERT(msa->seq_store[i].cluster == expect[i], "Record %d: %d, expected %d", i, msa->seq_store[i].cluster, expect[i]);
+                                if(msa->seq_store[i].cluster < num - num_unique){
+                                        ASSERT(msa->seq_store[i].dup->cluster == -(msa->seq_store[i].cluster + num_unique), "Duplicate of record %d lost.", i);
+                                }
+                        }else{
+                                ASSERT(msa->seq_store[i].cluster == -i, "Duplicate %d out of order.", i);
+                        }
+                }
+                LOG_MSG("%d threads: sorted %d records.", threads[t], num_unique);
+                MFREE(ref);
+                MFREE(expect);
+                ref = NULL;
+                expect = NULL;
+                msa->numseq = 0;
+                free_msa(msa);
+                msa = NULL;
+        }
+        MFREE(rng);
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+
+/* the comparison the radix sort replaces, made total */
+int compare_ref(const void *a, const void *b)
+{
+        struct msa_seq* const *one = a;
+        struct msa_seq* const *two = b;
+
+        if((*one)->count != (*two)->count){
+                return (*one)->count < (*two)->count ? 1 : -1;
+        }
+        if((*one)->len != (*two)->len){
+                return (*one)->len < (*two)->len ? 1 : -1;
+        }
+        return (*one)->cluster - (*two)->cluster;
+}
+#endif
+
+int sort_msa_by_count(struct msa* msa, int num_records)
+{
+        struct sort_key* keys = NULL;
+        struct msa_seq* store = NULL;
+        long int* name_off = NULL;
+        long int* seq_off = NULL;
+        int* pos = NULL;
+        int* order = NULL;
+        int n;
+        int i,j;
+
+        n = msa->numseq;
+        MMALLOC(keys, sizeof(struct sort_key) * MACRO_MAX(n, 1));
+        MMALLOC(pos, sizeof(int) * MACRO_MAX(num_records, 1));
+
+        /* keys are made in store order, which is the input order */
+        for(i = 0; i < num_records;i++){
+                pos[i] = -1;
+        }
+        for(i = 0; i < n;i++){
+                pos[msa->sequences[i] - msa->seq_store] = 0;
+        }
+        j = 0;
+        for(i = 0; i < num_records;i++){
+                if(pos[i] == 0){
+                        keys[j].key = count_key(msa->seq_store + i);
+                        keys[j].id = i;
+                        j++;
+                }
+        }
+        RUN(radix_sort_keys(keys, n));
+
+        MMALLOC(order, sizeof(int) * MACRO_MAX(num_records, 1));
+        for(i = 0; i < n;i++){
+                pos[keys[i].id] = i;
+                order[i] = keys[i].id;
+        }
+        j = n;
+        for(i = 0; i < num_records;i++){
+                if(pos[i] == -1){
+                        pos[i] = j;
+                        order[j] = i;
+                        j++;
+                }
+        }
+
+        /* move the records, and the offsets indexed by them, once */
+        MMALLOC(store, sizeof(struct msa_seq) * msa->alloc_numseq);
+        MMALLOC(name_off, sizeof(long int) * msa->alloc_numseq);
+        MMALLOC(seq_off, sizeof(long int) * msa->alloc_numseq);
+#ifdef HAVE_OPENMP
+#pragma omp parallel for shared(msa, store, name_off, seq_off, pos, order) private(i, j)
+#endif
+        for(i = 0; i < num_records;i++){
+                j = order[i];
+                store[i] = msa->seq_store[j];
+                if(store[i].dup){
+                        store[i].dup = store + pos[store[i].dup - msa->seq_store];
+                }
+                name_off[i] = msa->name_off[j];
+                seq_off[i] = msa->seq_off[j];
+        }
+        MFREE(msa->seq_store);
+        MFREE(msa->name_off);
+        MFREE(msa->seq_off);
+        msa->seq_store = store;
+        msa->name_off = name_off;
+        msa->seq_off = seq_off;
+        for(i = 0; i < num_records;i++){
+                msa->sequences[i] = msa->seq_store + i;
+        }
+
+        MFREE(keys);
+        MFREE(pos);
+        MFREE(order);
+        return OK;
+ERROR:
+        if(keys){
+                MFREE(keys);
+        }
+        if(pos){
+                MFREE(pos);
+        }
+        if(order){
+                MFREE(order);
+        }
+        if(store){
+                MFREE(store);
+        }
+        if(name_off){
+                MFREE(name_off);
+        }
+        if(seq_off){
+                MFREE(seq_off);
+        }
+        return FAIL;
+}
+
+/* flipping the sign bit makes the unsigned order the signed one, so
+   negative counts from the headers sort after the positive ones */
+uint64_t count_key(const struct msa_seq* seq)
+{
+        return ((uint64_t) ~((uint32_t) seq->count ^ 0x80000000u) << 32) | (uint64_t) ~((uint32_t) seq->len ^ 0x80000000u);
+}
+
+/* Stable LSD radix sort, RADIX_BITS per pass. Each thread counts the
+   digits of a contiguous slice of the keys; the per thread offsets are
+   laid out digit by digit, thread by thread, so the scatter keeps the
+   order of equal digits. Digits that are the same in all keys are
+   skipped. */
+int radix_sort_keys(struct sort_key* keys, long int n)
+{
+        struct sort_key* tmp = NULL;
+        struct sort_key* from = NULL;
+        struct sort_key* to = NULL;
+        struct sort_key* swap = NULL;
+        long int* hist = NULL;
+        uint64_t diff;
+        long int i;
+        int num_threads;
+        int shift;
+
+        if(n < 2){
+                return OK;
+        }
+        num_threads = 1;
+#ifdef HAVE_OPENMP
+        num_threads = omp_get_max_threads();
+#endif
+        MMALLOC(tmp, sizeof(struct sort_key) * n);
+        MMALLOC(hist, sizeof(long int) * RADIX_SIZE * num_threads);
+
+        diff = 0;
+#ifdef HAVE_OPENMP
+#pragma omp parallel for num_threads(num_threads) reduction(|:diff)
+#endif
+        for(i = 1; i < n;i++){
+                diff |= keys[i].key ^ keys[0].key;
+        }
+
+        from = keys;
+        to = tmp;
+        for(shift = 0; shift < 64; shift += RADIX_BITS){
+                if(!((diff >> shift) & (RADIX_SIZE - 1))){
+                        continue;
+                }
+#ifdef HAVE_OPENMP
+#pragma omp parallel num_threads(num_threads) shared(from, to, hist, shift, n)
+#endif
+                {
+                        long int* h = NULL;
+                        long int sum;
+                        long int c;
+                        long int start;
+                        long int end;
+                        long int j;
+                        int team;
+                        int t;
+                        int d;
+
+                        t = 0;
+                        team = 1;
+#ifdef HAVE_OPENMP
+                        t = omp_get_thread_num();
+                        team = omp_get_num_threads();
+#endif
+                        start = n * t / team;
+                        end = n * (t+1) / team;
+                        h = hist + (long int) t * RADIX_SIZE;
+                        for(d = 0; d < RADIX_SIZE;d++){
+                                h[d] = 0;
+                        }
+                        for(j = start; j < end;j++){
+                                h[(from[j].key >> shift) & (RADIX_SIZE - 1)]++;
+                        }
+#ifdef HAVE_OPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+                        {
+                                sum = 0;
+                                for(d = 0; d < RADIX_SIZE;d++){
+                                        for(j = 0; j < team;j++){
+                                                c = hist[j * RADIX_SIZE + d];
+                                                hist[j * RADIX_SIZE + d] = sum;
+                                                sum += c;
+                                        }
+                                }
+                        }
+                        for(j = start; j < end;j++){
+                                to[h[(from[j].key >> shift) & (RADIX_SIZE - 1)]++] = from[j];
+                        }
+                }
+                swap = from;
+                from = to;
+                to = swap;
+        }
+        if(from != keys){
+                memcpy(keys, from, sizeof(struct sort_key) * n);
+        }
+        MFREE(tmp);
+        MFREE(hist);
+        return OK;
+ERROR:
+        if(tmp){
+                MFREE(tmp);
+        }
+        if(hist){
+                MFREE(hist);
+        }
+        return FAIL;
+}
@@ -0,0 +1,38 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef MSA_SORT_H
+#define MSA_SORT_H
+
+#include "global.h"
+#include "msa.h"
+
+/* Orders the unique records for the greedy clustering: most abundant
+   first, ties broken by length (longest first) and then by position in
+   the input, so the seeds do not depend on the machine or the C
+   library. The keys are sorted with a parallel LSD radix sort; the
+   permutation is then applied once to the record store, so that
+   msa->sequences[i] == msa->seq_store + i. The duplicates (records
+   numseq .. num_records - 1) follow in input order. */
+extern int sort_msa_by_count(struct msa* msa, int num_records);
+
+#endif
@@ -36,7 +36,16 @@ struct parameters*init_param(void)
         param->num_infiles = 0;
         param->input = NULL;
         param->outfile = NULL;
+        param->snb_file = NULL;
+        param->batch_file = NULL;
         param->help_flag = 0;
+        param->nthreads = 8;
+        param->index_type = SEQNET_INDEX_QGRAM;
+        param->min_qual = 0.0;
+        param->max_ee = -1.0;
+        param->min_len = 0;
+        param->max_len = 0;
+        param->lazy_names = 0;
         param->t_total = 0.0f;
         param->t_unique = 0.0f;
         return param;
@@ -28,15 +28,29 @@
 #define KALIGNDIST_BPM 1
 #define KALIGNDIST_WU 2
 
+/* candidate index used by the greedy clustering (seq_index.h) */
+#define SEQNET_INDEX_LENGTH 0
+#define SEQNET_INDEX_QGRAM 1
+#define SEQNET_INDEX_DELETION 2
+
 struct parameters{
         char **infile;
         char *input;
         char *outfile;
+        char *snb_file;
+        char *batch_file;       /* manifest: one job per line */
         int threshold;
         double t_unique;
         double t_total;
         int out_format;
         int num_infiles;
+        int nthreads;
+        int index_type;
+        double min_qual;
+        double max_ee;
+        int min_len;
+        int max_len;
+        int lazy_names;
         int help_flag;
 };
 
@@ -24,29 +24,76 @@
 #include "msa.h"
 #include "parameters.h"
 #include "bpm.h"
+#include "seq_index.h"
+#include "snb.h"
+#include "msa_sort.h"
+#include "abundance.h"
 #include <getopt.h>
 #include "alphabet.h"
+#include "simd.h"
 
 #include "matrix_io.h"
 
+#include <sys/stat.h>
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
 #define OPT_T_UNIQUE 1
 #define OPT_T_TOTAL 2
 
 #define OPT_SHOWW 5
+#define OPT_NTHREADS 6
+#define OPT_INDEX 7
+#define OPT_SNB 8
+#define OPT_MINQUAL 9
+#define OPT_MAXEE 10
+#define OPT_MINLEN 11
+#define OPT_MAXLEN 12
+#define OPT_BATCH 13
+#define OPT_LAZYNAMES 14
+
+/* number of candidates handed to a thread in one go  */
+#define SCAN_BATCH 1024
+/* share of the sequences that has to fit the padded copy of the scan */
+#define SCAN_SOA_SHARE 0.99
+
+#define MANIFEST_LINE_LEN 4096
+
+/* one line of a --batch manifest */
+struct batch_job{
+        char* infile;
+        char* outfile;
+        long int size;
+};
 
 int run_seqnet(struct parameters* param);
+static int run_batch(struct parameters* param);
+static int read_manifest(char* manifest, char* outfile, struct batch_job** jobs, int* num_jobs);
+static int compare_job_size(const void *a, const void *b);
+static void scan_candidates(struct msa* msa, const struct bpm_soa* soa, const struct bpm_peq* peq, const int* work, uint8_t* dist, int from, int to);
+static struct bpm_soa* alloc_scan_soa(struct msa* msa);
 
 int print_seqnet_header(void);
 int print_seqnet_help(int argc, char * argv[]);
 int print_seqnet_warranty(void);
 int print_AVX_warning(void);
-static int calc_diff(struct msa* msa, uint8_t* seq_a,int len_a,  int i);
 
-static int compare_seq_based_on_count(const void *a, const void *b);
+static int collapse_duplicates(struct msa* msa);
+static int compare_dup(const void *a, const void *b);
+static int same_seq(const void *a, const void *b);
+
+/* used by collapse_duplicates */
+struct dup_key{
+        uint64_t hash;
+        struct msa_seq* seq;
+        int id;
+};
 
 int print_seqnet_help(int argc, char * argv[])
 {
-        const char usage[] = " -i <seq file> -o <out prefix> ";
+        const char usage[] = " -i <seq file> [-i <seq file> ...] -o <out prefix> ";
         fprintf(stdout,"\nUsage: %s %s\n\n",basename(argv[0]) ,usage);
         fprintf(stdout,"Options:\n\n");
 
@@ -54,7 +101,20 @@ int print_seqnet_help(int argc, char * argv[])
 
         fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--mintotal","Minimum number of sequences to form a cluster." ,"[0]"  );
         fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--minuniq","Minimum number of unique sequences to make up a cluster." ,"[NA]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--nthreads","Number of threads." ,"[8]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--index","Candidate index: length, qgram or deletion." ,"[qgram]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--snb","Also write the prepared input to this binary file; read it back with -i." ,"[NA]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--batch","Cluster each file listed here on its own: <input> [<out prefix>] per line." ,"[NA]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--minqual","Drop fastq reads below this mean quality." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--maxee","Drop fastq reads with more expected errors." ,"[NA]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--minlen","Drop fastq reads shorter than this." ,"[0]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--maxlen","Drop fastq reads longer than this." ,"[NA]"  );
+        fprintf(stdout,"%*s%-*s: %s %s\n",3,"",MESSAGE_MARGIN-3,"--lazynames","Keep names in the input file; read them back when needed." ,"[off]"  );
 
+        fprintf(stdout,"\n");
+        fprintf(stdout,"Besides the input, clustering keeps a copy of the unique sequences padded\n");
+        fprintf(stdout,"to a multiple of 32 residues for the vector kernels (32 bytes each for\n");
+        fprintf(stdout,"sequences of up to 32 residues).\n");
         fprintf(stdout,"\n");
 
         return OK;
@@ -98,7 +158,7 @@ int print_seqnet_header(void)
 int print_AVX_warning(void)
 {
         fprintf(stdout,"\n");
-        fprintf(stdout,"WARNING: AVX2 instruction set not found!\n");
+        fprintf(stdout,"WARNING: AVX2 not supported by this CPU or build!\n");
         fprintf(stdout,"         Seqnet will not run optimally.\n");
         fprintf(stdout,"\n");
 
@@ -123,6 +183,15 @@ int main(int argc, char *argv[])
                         {"threshold",  required_argument, 0, 't'},
                         {"mintotal",  required_argument, 0, OPT_T_TOTAL},
                         {"minuniq",  required_argument, 0, OPT_T_UNIQUE},
+                        {"nthreads",  required_argument, 0, OPT_NTHREADS},
+                        {"index",  required_argument, 0, OPT_INDEX},
+                        {"snb",  required_argument, 0, OPT_SNB},
+                        {"minqual",  required_argument, 0, OPT_MINQUAL},
+                        {"maxee",  required_argument, 0, OPT_MAXEE},
+                        {"minlen",  required_argument, 0, OPT_MINLEN},
+                        {"maxlen",  required_argument, 0, OPT_MAXLEN},
+                        {"batch",  required_argument, 0, OPT_BATCH},
+                        {"lazynames",  0, 0, OPT_LAZYNAMES},
                         {"output",  required_argument, 0, 'o'},
                         {"outfile",  required_argument, 0, 'o'},
                         {"out",  required_argument, 0, 'o'},
@@ -149,14 +218,49 @@ int main(int argc, char *argv[])
                 case OPT_T_UNIQUE :
                         param->t_unique = atof(optarg);
                         break;
+                case OPT_NTHREADS:
+                        param->nthreads = atoi(optarg);
+                        break;
+                case OPT_INDEX:
+                        if(!strcmp(optarg, "length")){
+                                param->index_type = SEQNET_INDEX_LENGTH;
+                        }else if(!strcmp(optarg, "qgram")){
+                                param->index_type = SEQNET_INDEX_QGRAM;
+                        }else if(!strcmp(optarg, "deletion")){
+                                param->index_type = SEQNET_INDEX_DELETION;
+                        }else{
+                                param->index_type = -1;
+                        }
+                        break;
+                case OPT_SNB:
+                        param->snb_file = optarg;
+                        break;
+                case OPT_MINQUAL:
+                        param->min_qual = atof(optarg);
+                        break;
+                case OPT_MAXEE:
+                        param->max_ee = atof(optarg);
+                        break;
+                case OPT_MINLEN:
+                        param->min_len = atoi(optarg);
+                        break;
+                case OPT_MAXLEN:
+                        param->max_len = atoi(optarg);
+                        break;
+                case OPT_BATCH:
+                        param->batch_file = optarg;
+                        break;
+                case OPT_LAZYNAMES:
+                        param->lazy_names = 1;
+                        break;
 
                 case 'h':
                         param->help_flag = 1;
                         break;
                 case 'i':
-                        param->num_infiles =1;
-                        MMALLOC(param->infile, sizeof(char*));
-                        param->infile[0] = optarg;
+                        MREALLOC(param->infile, sizeof(char*) * (param->num_infiles + 1));
+                        param->infile[param->num_infiles] = optarg;
+                        param->num_infiles++;
 
                         break;
                 case 't':
@@ -176,9 +280,11 @@ int main(int argc, char *argv[])
         }
 
         print_seqnet_header();
-#ifndef HAVE_AVX2
-        RUN(print_AVX_warning());
-#endif
+        /* selects the kernels for this CPU; before anything is read */
+        RUN(init_simd());
+        if(simd_level() < SIMD_AVX2){
+                RUN(print_AVX_warning());
+        }
 
         if(showw){
                 print_seqnet_warranty();
@@ -203,24 +309,61 @@ int main(int argc, char *argv[])
         }
 
 
-        if (param->num_infiles == 0){
-                RUN(print_seqnet_help(argc, argv));
-                LOG_MSG("No infiles");
-                return EXIT_SUCCESS;
+        if(param->nthreads < 1){
+                LOG_MSG("--nthreads has to be at least 1 (got %d).", param->nthreads);
+                free_parameters(param);
+                return EXIT_FAILURE;
+        }
+
+        /* distances are kept in 8 bits with threshold + 1 as the
+           "too far" mark */
+        if(param->threshold < 0 || param->threshold > 254){
+                LOG_MSG("--threshold has to be between 0 and 254 (got %d).", param->threshold);
+                free_parameters(param);
+                return EXIT_FAILURE;
         }
-        if (param->num_infiles >= 2){
-                LOG_MSG("Too many input files:");
-                for(c = 0; c < param->num_infiles;c++){
-                        LOG_MSG("  %s",param->infile[c]);
+
+        if(param->index_type == -1){
+                LOG_MSG("--index has to be one of length, qgram or deletion.");
+                free_parameters(param);
+                return EXIT_FAILURE;
+        }
+
+        if(param->lazy_names && param->snb_file){
+                LOG_MSG("--lazynames can not be combined with --snb.");
+                free_parameters(param);
+                return EXIT_FAILURE;
+        }
+
+        if(param->batch_file){
+                if(param->num_infiles){
+                        LOG_MSG("--batch can not be combined with input files.");
+                        free_parameters(param);
+                        return EXIT_FAILURE;
+                }
+                if(param->snb_file){
+                        LOG_MSG("--batch can not be combined with --snb.");
+                        free_parameters(param);
+                        return EXIT_FAILURE;
                 }
-                LOG_MSG("Version %s only accepts one input file!\n", PACKAGE_VERSION);
+        }else if (param->num_infiles == 0){
+                RUN(print_seqnet_help(argc, argv));
+                LOG_MSG("No infiles");
                 return EXIT_SUCCESS;
         }
 
-
         log_command_line(argc, argv);
 
-        RUN(run_seqnet(param));
+        LOG_MSG("Using %s kernels.", simd_level_name(simd_level()));
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(param->nthreads);
+        LOG_MSG("Using %d threads.", param->nthreads);
+#endif
+        if(param->batch_file){
+                RUN(run_batch(param));
+        }else{
+                RUN(run_seqnet(param));
+        }
         free_parameters(param);
         return EXIT_SUCCESS;
 ERROR:
@@ -233,31 +376,50 @@ int run_seqnet(struct parameters* param)
 {
         struct msa* msa = NULL;
         FILE* f_ptr = NULL;
+        FILE* m_ptr = NULL;
 
         int i,j;
 
 
         uint8_t d;
         uint8_t* seq_a;
-        uint8_t* seq_b;
-        int len_a,len_b;
-        int num_threads = 8;
-        char* tmp = NULL;
+        int len_a;
+        struct seq_index* si = NULL;
+        struct bpm_peq* peq = NULL;
+        struct bpm_soa* soa = NULL;
+        struct msa_seq* dup = NULL;
+        struct msa_seq** members = NULL;
+        struct name_reader* nr = NULL;
+        int num_members;
+        int num_records;
+        int* work = NULL;
+        uint8_t* dist = NULL;
+        int num_work;
+        int seed = 0;
+        int c;
+        int b;
         char* buffer = NULL;
-        char* t1;
-        char* t2;
-        int total_count;
-        int count;
         int max_name_len;
+        int num_clu = 1;
+        int* seq_in_clu = NULL;
+        int num_seq_in_clu = 0;
+        int left;
+        int counts_in_clu;
+        int* sample_total = NULL;
         DECLARE_TIMER(t1);
         /* Step 1: read all input sequences & figure out output  */
         START_TIMER(t1);
-        for(i = 0; i < param->num_infiles;i++){
-                RUNP(msa = read_input(param->infile[i],msa));
-        }
+        RUNP(msa = alloc_msa());
+        msa->filter.min_qual = param->min_qual;
+        msa->filter.max_ee = param->max_ee;
+        msa->filter.min_len = param->min_len;
+        msa->filter.max_len = param->max_len;
+        msa->lazy_names = param->lazy_names;
+        RUNP(msa = read_inputs(param->infile, param->num_infiles, msa));
         STOP_TIMER(t1);
         LOG_MSG("Detected: %d sequences in %f sec.", msa->numseq,GET_TIMING(t1));
-        max_name_len = 0;
+        /* the buffer is also used for the output file names */
+        max_name_len = MSA_NAME_LEN;
         for(i = 0; i < msa->numseq;i++){
                 if(max_name_len < msa->sequences[i]->name_len){
                         max_name_len = msa->sequences[i]->name_len;
@@ -266,68 +428,59 @@ int run_seqnet(struct parameters* param)
         LOG_MSG("Longest name: %d",max_name_len);
         MMALLOC(buffer, sizeof(char) * (max_name_len));
 
-        total_count = 0;
-        //tmp = mal
-        /* Get sequence counts; from my sample : ; delimited naming scheme   */
-        for(i = 0; i < msa->numseq;i++){
-                strncpy(buffer, msa->sequences[i]->name, max_name_len);
-                tmp= buffer;
-                //tmp = msa->sequences[i]->name;
-                count = 0;
-                t1  = strchr(tmp, ';');
-                while (t1 != NULL){
-                        /* String to scan is in string..token */
-                        *t1++ = '\0';
-                        //printf("a = %s\n", tmp);
-                        t2 = strtok(tmp, ":");
-                        j = 0;
-                        while (t2 != NULL){
-                                if(j & 1){
-                                        count += atoi(t2);
-                                }
-                                t2 = strtok(NULL, ":");
-                                j++;
-                        }
-                        tmp = t1;
-                        t1 = strchr(tmp, ';');
-                }
-                t2 = strtok(tmp, ":");
-                j = 0;
-                while (t2 != NULL){
-                        if(j & 1){
-                                count += atoi(t2);
-                        }
-                        t2 = strtok(NULL, ":");
-                        j++;
+        if(msa->num_unique){
+                /* a .snb cache already holds the counts, the merged
+                   duplicates and the count order */
+                num_records = msa->numseq;
+                msa->numseq = msa->num_unique;
+        }else{
+                /* fastq reads count once each */
+                if(!msa->have_counts){
+                        RUN(set_counts_from_names(msa));
                 }
-                msa->sequences[i]->count = count;
-                total_count += count;
-        }
 
+                /* cluster unique sequences only; the duplicates stay behind them */
+                num_records = msa->numseq;
+                RUN(collapse_duplicates(msa));
+                if(msa->sample_names){
+                        RUN(set_sample_counts(msa));
+                }
 
-        qsort(msa->sequences, msa->numseq, sizeof(struct msa_seq* ),compare_seq_based_on_count);
+                RUN(sort_msa_by_count(msa, num_records));
+                if(param->snb_file){
+                        RUN(write_snb(msa, num_records, param->snb_file));
+                }
+        }
 
 
         //>640_RS:1;mTCR_215-RS-1:1;mTCR_412-RS-5:1
-        /* Kind of essential */
-#ifdef HAVE_AVX2
-        set_broadcast_mask();
-#endif
-
-
-        int num_clu = 1;
-        int* seq_in_clu = NULL;
-        int num_seq_in_clu = 0;
-        int left = msa->numseq;
-        int counts_in_clu;
-
 
+        left = msa->numseq;
+        RUNP(si = build_seq_index(msa, param->threshold, param->index_type));
         MMALLOC(seq_in_clu, sizeof(int) * msa->numseq);
+        MMALLOC(work, sizeof(int) * msa->numseq);
+        MMALLOC(dist, sizeof(uint8_t) * msa->numseq);
+        MMALLOC(members, sizeof(struct msa_seq*) * num_records);
+        RUNP(nr = open_name_reader(msa));
+        RUNP(peq = alloc_bpm_peq());
+        RUNP(soa = alloc_scan_soa(msa));
+        if(msa->sample_names){
+                /* cluster x sample counts, one row per cluster written */
+                MMALLOC(sample_total, sizeof(int) * msa->num_samples);
+                snprintf(buffer, max_name_len,"%s_samples.tsv",param->outfile);
+                RUNP(m_ptr = fopen(buffer,"w"));
+                fprintf(m_ptr,"cluster");
+                for(i = 0; i < msa->num_samples;i++){
+                        fprintf(m_ptr,"\t%s", msa->sample_names[i]);
+                }
+                fprintf(m_ptr,"\n");
+        }
 
         while(1){
-                /* select seed  */
+                /* select seed; everything before the previous seed is
+                   already clustered */
                 j = -1;
-                for(i = 0; i < msa->numseq;i++){
+                for(i = seed; i < msa->numseq;i++){
                         if(msa->sequences[i]->cluster == 0){
                                 j = i;
                                 break;
@@ -337,57 +490,106 @@ int run_seqnet(struct parameters* param)
                         LOG_MSG("Quitting");
                         break;
                 }
+                seed = j;
                 seq_a = msa->sequences[j]->s;
                 len_a = msa->sequences[j]->len;
 
+                /* Scan all remaining candidates against the seed in
+                   batches. Each thread fills its own slice of dist; the
+                   cluster members are collected afterwards in index
+                   order so the output does not depend on the number of
+                   threads. The distance is the global edit distance,
+                   computed only within the threshold band, for one
+                   candidate per SIMD lane (bpm_global_banded_batch).
+                   Only the unclustered sequences the index reports as
+                   possible hits (seq_index.h) are visited. */
+                RUN(seq_index_candidates(si, seq_a, len_a, param->threshold, work, &num_work));
+                RUN(set_bpm_peq(peq, seq_a, len_a, param->threshold));
+#ifdef HAVE_OPENMP
+                if(omp_in_parallel()){
+                        /* a --batch job: the batches become tasks any
+                           idle thread of the pool can pick up */
+#pragma omp taskloop grainsize(1) shared(msa, soa, peq, work, dist, num_work)
+                        for(b = 0; b < num_work;b+= SCAN_BATCH){
+                                scan_candidates(msa, soa, peq, work, dist, b, MACRO_MIN(b + SCAN_BATCH, num_work));
+                        }
+                }else{
+#pragma omp parallel for shared(msa, soa, peq, work, dist, num_work) private(b) schedule(dynamic,1)
+                        for(b = 0; b < num_work;b+= SCAN_BATCH){
+                                scan_candidates(msa, soa, peq, work, dist, b, MACRO_MIN(b + SCAN_BATCH, num_work));
+                        }
+                }
+#else
+                for(b = 0; b < num_work;b+= SCAN_BATCH){
+                        scan_candidates(msa, soa, peq, work, dist, b, MACRO_MIN(b + SCAN_BATCH, num_work));
+                }
+#endif
+
                 num_seq_in_clu =0;
                 counts_in_clu = 0;
-                for(i = j; i < msa->numseq;i++){
-                        //START_TIMER(t1);
-                        if(msa->sequences[i]->cluster == 0 ){
-                                seq_b = msa->sequences[i]->s;
-                                len_b = msa->sequences[i]->len;
-
-                                d = MACRO_MAX(
-                                        bpm_256(seq_a,seq_b,len_a,len_b),
-                                        bpm_256(seq_b,seq_a,len_b,len_a)
-                                        );
-
-                                if(d <= param->threshold){
-                                        seq_in_clu[num_seq_in_clu] = i;
-                                        num_seq_in_clu++;
-                                        counts_in_clu += msa->sequences[i]->count;
-                                }
-
-                                //calc_diff(msa, seq_a, len_a, i);
-                                //STOP_TIMER(t1);
+                for(c = 0; c < num_work;c++){
+                        d = dist[c];
+                        if(d <= param->threshold){
+                                i = work[c];
+                                seq_in_clu[num_seq_in_clu] = i;
+                                num_seq_in_clu++;
+                                counts_in_clu += msa->sequences[i]->count;
                         }
-
                 }
                 /* shall I print out the sequences?  */
                 if(num_seq_in_clu >= param->t_unique && counts_in_clu >= param->t_total){
+                        /* keep the lines of one cluster together when
+                           several jobs write to stdout */
+                        flockfile(stdout);
+                        if(param->batch_file){
+                                fprintf(stdout,"%s\t", param->outfile);
+                        }
                         fprintf(stdout,"CLUSTER%d: %d unique %d total number of sequences\n",num_clu, num_seq_in_clu, counts_in_clu);
+                        funlockfile(stdout);
+                        if(msa->sample_names){
+                                for(i = 0; i < msa->num_samples;i++){
+                                        sample_total[i] = 0;
+                                }
+                                for(i = 0; i < num_seq_in_clu;i++){
+                                        dup = msa->sequences[seq_in_clu[i]];
+                                        for(c = 0; c < dup->num_abund;c++){
+                                                sample_total[dup->abund[c].sample] += dup->abund[c].count;
+                                        }
+                                }
+                                fprintf(m_ptr,"cluster%d", num_clu);
+                                for(i = 0; i < msa->num_samples;i++){
+                                        fprintf(m_ptr,"\t%d", sample_total[i]);
+                                }
+                                fprintf(m_ptr,"\n");
+                        }
 
                         snprintf(buffer, max_name_len,"%s_cluster%d_t%d_u%d.fa",param->outfile, num_clu,counts_in_clu, num_seq_in_clu);
-                        f_ptr = fopen(buffer,"w");
+                        RUNP(f_ptr = fopen(buffer,"w"));
+                        num_members = 0;
                         for(i = 0; i < num_seq_in_clu;i++){
                                 j = seq_in_clu[i];
-                                fprintf(f_ptr,">%s\n%s\n", msa->sequences[j]->name,msa->sequences[j]->seq);
-                                //                left--;
-                                //j = seq_in_clu[i];
-                                //msa->sequences[j]->cluster = num_clu;
-                                //fprintf(stdout,"%d\t%s\n",msa->sequences[j]->count,msa->sequences[j]->seq);
-                                //msa->sequences[j]->count = 0;
+                                for(dup = msa->sequences[j]; dup; dup = dup->dup){
+                                        members[num_members] = dup;
+                                        num_members++;
+                                }
+                        }
+                        /* lazy names are read back for this cluster only */
+                        RUN(load_msa_names(nr, msa, members, num_members));
+                        for(i = 0; i < num_members;i++){
+                                fprintf(f_ptr,">%s\n%s\n", members[i]->name,members[i]->seq);
                         }
+                        unload_msa_names(msa, members, num_members);
                         //fprintf(stdout,"%d remaining\n",left);
 
                         fclose(f_ptr);
+                        f_ptr = NULL;
                         num_clu++;
                 }
                 for(i = 0; i < num_seq_in_clu;i++){
                         left--;
                         j = seq_in_clu[i];
                         msa->sequences[j]->cluster = num_clu;
+                        RUN(seq_index_remove(si, j));
                         //fprintf(stdout,"%d\t%s\n",msa->sequences[j]->count,msa->sequences[j]->seq);
                         //msa->sequences[j]->count = 0;
                 }
@@ -398,48 +600,432 @@ int run_seqnet(struct parameters* param)
         }
 
         MFREE(seq_in_clu);
+        MFREE(work);
+        MFREE(dist);
+        if(sample_total){
+                MFREE(sample_total);
+        }
+        MFREE(members);
+        close_name_reader(nr);
+        free_bpm_peq(peq);
+        free_bpm_soa(soa);
+        if(m_ptr){
+                fclose(m_ptr);
+        }
+        free_seq_index(si);
         MFREE(buffer);
 
+        msa->numseq = num_records;
         free_msa(msa);
         /* If we just want to reformat end here */
         return OK;
 ERROR:
+        /* in --batch mode the other jobs go on */
+        if(seq_in_clu){
+                MFREE(seq_in_clu);
+        }
+        if(work){
+                MFREE(work);
+        }
+        if(dist){
+                MFREE(dist);
+        }
+        if(sample_total){
+                MFREE(sample_total);
+        }
+        if(members){
+                MFREE(members);
+        }
+        close_name_reader(nr);
+        free_bpm_peq(peq);
+        free_bpm_soa(soa);
+        if(f_ptr){
+                fclose(f_ptr);
+        }
+        if(m_ptr){
+                fclose(m_ptr);
+        }
+        free_seq_index(si);
+        if(buffer){
+                MFREE(buffer);
+        }
+        free_msa(msa);
         return FAIL;
 }
 
 
 
-int calc_diff(struct msa* msa, uint8_t* seq_a,int len_a,  int i)
+/* The seed is the pattern: its bitmasks (peq) are built once per seed
+   and shared by all threads. Candidates in the padded copy go through
+   the batched kernel, the few longer ones one at a time. */
+void scan_candidates(struct msa* msa, const struct bpm_soa* soa, const struct bpm_peq* peq, const int* work, uint8_t* dist, int from, int to)
+{
+        int idx[SCAN_BATCH];
+        int pos[SCAN_BATCH];
+        uint8_t res[SCAN_BATCH];
+        int num;
+        int c;
+        int i;
+
+        num = 0;
+        for(c = from; c < to;c++){
+                i = work[c];
+                if(msa->sequences[i]->len > soa->stride){
+                        dist[c] = bpm_global_banded_peq(peq, msa->sequences[i]->s, msa->sequences[i]->len);
+                        continue;
+                }
+                idx[num] = i;
+                pos[num] = c;
+                num++;
+        }
+        if(num){
+                bpm_global_banded_batch(peq, soa, idx, num, res);
+                for(c = 0; c < num;c++){
+                        dist[pos[c]] = res[c];
+                }
+        }
+}
+
+/* Padded copy (bpm.h) of the unique sequences the scan reads its lanes
+   from. It comes on top of the residue arena: numseq x stride bytes,
+   where the stride is at least 32, so for short reads it is several
+   times the arena. The kernels rely on the padding (whole 16 and 32 byte
+   loads past the end of a sequence) and can not read the arena in place.
+   The stride covers SCAN_SOA_SHARE of the sequences so that a few very
+   long ones do not multiply the memory; those stay out of the copy and
+   are compared one at a time. */
+struct bpm_soa* alloc_scan_soa(struct msa* msa)
+{
+        struct bpm_soa* soa = NULL;
+        int* num_len = NULL;
+        int max_len;
+        int len;
+        int i;
+        int c;
+
+        max_len = 0;
+        for(i = 0; i < msa->numseq;i++){
+                max_len = MACRO_MAX(max_len, msa->sequences[i]->len);
+        }
+        MMALLOC(num_len, sizeof(int) * (max_len + 1));
+        for(i = 0; i <= max_len;i++){
+                num_len[i] = 0;
+        }
+        for(i = 0; i < msa->numseq;i++){
+                num_len[msa->sequences[i]->len]++;
+        }
+        c = 0;
+        for(len = 0; len < max_len;len++){
+                c += num_len[len];
+                if(c >= SCAN_SOA_SHARE * msa->numseq){
+                        break;
+                }
+        }
+        MFREE(num_len);
+
+        RUNP(soa = alloc_bpm_soa(msa->numseq, len));
+        LOG_MSG("Padded copy of the unique sequences: %0.1f Mb.", (double) soa->stride * (double) msa->numseq / (double) (1 << 20));
+        if(soa->stride < max_len){
+                LOG_MSG("Sequences longer than %d are compared one at a time.", soa->stride);
+        }
+        for(i = 0; i < msa->numseq;i++){
+                if(msa->sequences[i]->len <= soa->stride){
+                        RUN(set_bpm_soa_seq(soa, i, msa->sequences[i]->s, msa->sequences[i]->len));
+                }
+        }
+        return soa;
+ERROR:
+        if(num_len){
+                MFREE(num_len);
+        }
+        free_bpm_soa(soa);
+        return NULL;
+}
+
+/* Clusters every job of the manifest independently. Jobs are tasks on
+   one thread team, largest input first; within a job the distance scan
+   spawns its batches as tasks on the same team (see run_seqnet), so
+   threads done with small jobs help out with the large ones. */
+int run_batch(struct parameters* param)
 {
-        uint8_t* seq_b;
-        int len_b;
+        struct batch_job* jobs = NULL;
+        struct parameters* job_param = NULL;
+        int num_jobs = 0;
+        int status;
+        int i;
+
+        RUN(read_manifest(param->batch_file, param->outfile, &jobs, &num_jobs));
+        qsort(jobs, num_jobs, sizeof(struct batch_job), compare_job_size);
+        LOG_MSG("Clustering %d samples.", num_jobs);
+
+        MMALLOC(job_param, sizeof(struct parameters) * num_jobs);
+        for(i = 0; i < num_jobs;i++){
+                job_param[i] = *param;
+                job_param[i].infile = &jobs[i].infile;
+                job_param[i].num_infiles = 1;
+                job_param[i].outfile = jobs[i].outfile;
+        }
+        status = OK;
+#ifdef HAVE_OPENMP
+#pragma omp parallel shared(status, job_param, num_jobs) private(i)
+#pragma omp single
+#endif
+        for(i = 0; i < num_jobs;i++){
+#ifdef HAVE_OPENMP
+#pragma omp task firstprivate(i) shared(status, job_param)
+#endif
+                if(run_seqnet(job_param + i) != OK){
+                        WARNING_MSG("Clustering %s failed.", job_param[i].infile[0]);
+#ifdef HAVE_OPENMP
+#pragma omp atomic write
+#endif
+                        status = FAIL;
+                }
+        }
+        if(status != OK){
+                ERROR_MSG("Not all samples could be clustered.");
+        }
+        for(i = 0; i < num_jobs;i++){
+                MFREE(jobs[i].infile);
+                MFREE(jobs[i].outfile);
+        }
+        MFREE(jobs);
+        MFREE(job_param);
+        return OK;
+ERROR:
+        if(jobs){
+                for(i = 0; i < num_jobs;i++){
+                        MFREE(jobs[i].infile);
+                        MFREE(jobs[i].outfile);
+                }
+                MFREE(jobs);
+        }
+        if(job_param){
+                MFREE(job_param);
+        }
+        return FAIL;
+}
 
-        int j;
-        uint8_t d;
-        for(j = 0;j < msa->numseq;j++){
-                seq_b = msa->sequences[j]->s;
-                len_b = msa->sequences[j]->len;
-                d =    bpm_256(seq_a,seq_b,len_a,len_b);
-                //lk_dist[d]++;
+/* Each line holds an input file and optionally its output prefix;
+   without one the prefix is <outfile>_<input name up to the first '.'>.
+   Blank lines and lines starting with '#' are skipped. */
+int read_manifest(char* manifest, char* outfile, struct batch_job** jobs, int* num_jobs)
+{
+        struct batch_job* j = NULL;
+        struct batch_job* job = NULL;
+        struct stat st;
+        FILE* f_ptr = NULL;
+        char* line = NULL;
+        char* in = NULL;
+        char* out = NULL;
+        char* base = NULL;
+        int base_len;
+        int alloc;
+        int n;
+        int len;
+
+        RUNP(f_ptr = fopen(manifest, "r"));
+        MMALLOC(line, sizeof(char) * MANIFEST_LINE_LEN);
+        alloc = 16;
+        n = 0;
+        MMALLOC(j, sizeof(struct batch_job) * alloc);
+        while(fgets(line, MANIFEST_LINE_LEN, f_ptr)){
+                in = strtok(line, " \t\r\n");
+                if(!in || *in == '#'){
+                        continue;
+                }
+                out = strtok(NULL, " \t\r\n");
+                if(n == alloc){
+                        alloc <<= 1;
+                        MREALLOC(j, sizeof(struct batch_job) * alloc);
+                }
+                job = j + n;
+                job->infile = NULL;
+                job->outfile = NULL;
+                n++;
+                MMALLOC(job->infile, sizeof(char) * (strlen(in) + 1));
+                strcpy(job->infile, in);
+                if(out){
+                        MMALLOC(job->outfile, sizeof(char) * (strlen(out) + 1));
+                        strcpy(job->outfile, out);
+                }else{
+                        base = strrchr(in, '/');
+                        base = base ? base + 1 : in;
+                        base_len = strcspn(base, ".");
+                        len = base_len + 1;
+                        if(outfile){
+                                len += strlen(outfile) + 1;
+                        }
+                        MMALLOC(job->outfile, sizeof(char) * len);
+                        if(outfile){
+                                snprintf(job->outfile, len, "%s_%.*s", outfile, base_len, base);
+                        }else{
+                                snprintf(job->outfile, len, "%.*s", base_len, base);
+                        }
+                }
+                if(stat(in, &st) != 0){
+                        ERROR_MSG("File: %s listed in %s does not exist.", in, manifest);
+                }
+                job->size = st.st_size;
+        }
+        fclose(f_ptr);
+        f_ptr = NULL;
+        MFREE(line);
+        if(!n){
+                ERROR_MSG("%s lists no input files.", manifest);
         }
+        *jobs = j;
+        *num_jobs = n;
         return OK;
+ERROR:
+        if(f_ptr){
+                fclose(f_ptr);
+        }
+        if(line){
+                MFREE(line);
+        }
+        if(j){
+                while(n--){
+                        if(j[n].infile){
+                                MFREE(j[n].infile);
+                        }
+                        if(j[n].outfile){
+                                MFREE(j[n].outfile);
+                        }
+                }
+                MFREE(j);
+        }
+        return FAIL;
 }
 
+int compare_job_size(const void *a, const void *b)
+{
+        const struct batch_job* ja = (const struct batch_job*) a;
+        const struct batch_job* jb = (const struct batch_job*) b;
 
+        if(ja->size != jb->size){
+                return ja->size < jb->size ? 1 : -1;
+        }
+        return strcmp(ja->infile, jb->infile);
+}
 
-int compare_seq_based_on_count(const void *a, const void *b)
+/* Merges records with identical (encoded) sequences. The first record of
+   each group stays in msa->sequences[0..numseq) with the summed count;
+   the others are chained to it through ->dup and moved behind the
+   unique sequences, so msa->sequences still lists every record. Hashing
+   runs in parallel; groups are formed by sorting the hashes. */
+int collapse_duplicates(struct msa* msa)
 {
-        struct msa_seq* const *one = a;
-        struct msa_seq* const *two = b;
+        struct dup_key* keys = NULL;
+        struct msa_seq** tmp = NULL;
+        uint8_t* is_dup = NULL;
+        struct msa_seq* rep = NULL;
+        struct msa_seq* last = NULL;
+        uint64_t h;
+        int num_unique;
+        int i,j;
+
+        if(msa->numseq < 2){
+                return OK;
+        }
+        MMALLOC(keys, sizeof(struct dup_key) * msa->numseq);
+        MMALLOC(tmp, sizeof(struct msa_seq*) * msa->numseq);
+        MMALLOC(is_dup, sizeof(uint8_t) * msa->numseq);
+#ifdef HAVE_OPENMP
+#pragma omp parallel for shared(msa, keys, is_dup) private(i, j, h)
+#endif
+        for(i = 0; i < msa->numseq;i++){
+                /* FNV-1a */
+                h = 0xcbf29ce484222325ul;
+                for(j = 0; j < msa->sequences[i]->len;j++){
+                        h ^= msa->sequences[i]->s[j];
+                        h *= 0x100000001b3ul;
+                }
+                keys[i].hash = h;
+                keys[i].seq = msa->sequences[i];
+                keys[i].id = i;
+                is_dup[i] = 0;
+        }
+        qsort(keys, msa->numseq, sizeof(struct dup_key), compare_dup);
+
+        /* within a group the records are in input order */
+        rep = NULL;
+        last = NULL;
+        for(i = 0; i < msa->numseq;i++){
+                if(rep && same_seq(&keys[i-1], &keys[i])){
+                        rep->count += keys[i].seq->count;
+                        last->dup = keys[i].seq;
+                        last = keys[i].seq;
+                        is_dup[keys[i].id] = 1;
+                }else{
+                        rep = keys[i].seq;
+                        last = rep;
+                }
+        }
+
+        num_unique = 0;
+        for(i = 0; i < msa->numseq;i++){
+                if(!is_dup[i]){
+                        tmp[num_unique] = msa->sequences[i];
+                        num_unique++;
+                }
+        }
+        j = num_unique;
+        for(i = 0; i < msa->numseq;i++){
+                if(is_dup[i]){
+                        tmp[j] = msa->sequences[i];
+                        j++;
+                }
+        }
+        for(i = 0; i < msa->numseq;i++){
+                msa->sequences[i] = tmp[i];
+        }
+        LOG_MSG("Collapsed %d records into %d unique sequences.", msa->numseq, num_unique);
+        msa->numseq = num_unique;
 
-        if((*one)->count  < (*two)->count){
-                return 1;
+        MFREE(keys);
+        MFREE(tmp);
+        MFREE(is_dup);
+        return OK;
+ERROR:
+        if(keys){
+                MFREE(keys);
+        }
+        if(tmp){
+                MFREE(tmp);
+        }
+        if(is_dup){
+                MFREE(is_dup);
         }
-        if((*one)->count  ==  (*two)->count){
+        return FAIL;
+}
+
+int same_seq(const void *a, const void *b)
+{
+        const struct dup_key* ka = (const struct dup_key*) a;
+        const struct dup_key* kb = (const struct dup_key*) b;
+
+        if(ka->hash != kb->hash || ka->seq->len != kb->seq->len){
                 return 0;
         }
-        return -1;
+        return memcmp(ka->seq->s, kb->seq->s, ka->seq->len) == 0;
+}
 
-/* integer comparison: returns negative if b > a
-   and positive if a > b */
+int compare_dup(const void *a, const void *b)
+{
+        const struct dup_key* ka = (const struct dup_key*) a;
+        const struct dup_key* kb = (const struct dup_key*) b;
+        int c;
+
+        if(ka->hash != kb->hash){
+                return ka->hash < kb->hash ? -1 : 1;
+        }
+        if(ka->seq->len != kb->seq->len){
+                return ka->seq->len - kb->seq->len;
+        }
+        c = memcmp(ka->seq->s, kb->seq->s, ka->seq->len);
+        if(c){
+                return c;
+        }
+        return ka->id - kb->id;
 }
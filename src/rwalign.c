@@ -23,6 +23,28 @@
 #include "global.h"
 #include "msa.h"
 #include "alphabet.h"
+#include "snb.h"
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RWALIGN_MMAP 1
+#endif
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#define RWALIGN_ZLIB 1
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#define RWALIGN_GZ_THREAD 1
+#endif
+#endif
 
 #ifdef BUFFER_LEN
 
@@ -31,6 +53,28 @@
 
 #define BUFFER_LEN 65536
 
+/* initial number of records; grows geometrically */
+#define MSA_INIT_NUMSEQ 512
+
+/* smallest byte range handed to a parser thread */
+#define FASTA_MIN_CHUNK (1 << 20)
+
+/* records used to guess the alphabet before parsing */
+#define FASTA_SNIFF_RECORDS 1000
+
+/* gzip input: size and number of the buffers between the decompressing
+   thread and the parser */
+#define GZ_BLOCK (4 << 20)
+#define GZ_QUEUE_LEN 4
+
+/* lazy names closer than this are read in one go, up to NAME_READ_SPAN */
+#define NAME_READ_GAP 4096
+#define NAME_READ_SPAN (1 << 20)
+
+/* BGZF input: decompressed bytes per window; one window is parsed
+   while the next is inflated */
+#define BGZF_WINDOW (16 << 20)
+
 /* only local; */
 struct line_buffer{
         struct out_line** lines;
@@ -45,10 +89,114 @@ struct out_line{
         int seq_id;
 };
 
+/* msf and clustal files deliver each sequence in blocks; they are
+   staged here and moved into the arenas once the file is read */
+/* partial last line (fastq: record) of a block, completed by the next
+   one */
+struct fasta_carry{
+        char* buf;
+        size_t len;
+        size_t alloc;
+        int started;
+        int type;       /* FORMAT_FA or FORMAT_FQ, from the first byte */
+        int lazy;       /* record where names are instead of copying them */
+        long int pos;   /* input offset of the next block */
+        long int start; /* input offset of buf[0] */
+};
+
+/* a lazy name to read back */
+struct name_pos{
+        long int off;
+        int file;
+        int len;
+        int id;
+};
+
+#ifdef RWALIGN_GZ_THREAD
+/* ring of buffers filled by the decompressing thread */
+struct gz_queue{
+        gzFile f;
+        char* buf[GZ_QUEUE_LEN];
+        int len[GZ_QUEUE_LEN];
+        int head;
+        int num;
+        int done;       /* 1 at end of input, -1 on a read error */
+        int stop;       /* set by the parser to give up early */
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+};
+#endif
+
+#if defined(RWALIGN_ZLIB) && defined(RWALIGN_MMAP)
+/* block table of a BGZF file and the two windows it is inflated into */
+struct bgzf_input{
+        const uint8_t* map;
+        long int* off;
+        int* bsize;
+        uint32_t* isize;
+        long int* out;
+        int* win;       /* first block of each window, then the end */
+        int num_win;
+        char* buf[2];
+        long int len[2];
+#ifdef RWALIGN_GZ_THREAD
+        int num_done;   /* windows inflated */
+        int num_used;   /* windows parsed */
+        int status;     /* -1 on a corrupt block */
+        int stop;       /* set by the parser to give up early */
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+#endif
+};
+#endif
+
+struct seq_stage{
+        char* name;
+        char* seq;
+        int* gaps;
+        int len;
+        int alloc_len;
+        int num_gaps;
+};
+
 
 
 
 struct msa* read_fasta(char* infile, struct msa* msa);
+#ifndef RWALIGN_ZLIB
+static int read_fasta_stream(FILE* f_ptr, struct msa* msa);
+#endif
+static struct msa* read_records(char* infile, int type, struct msa* msa);
+static int parse_fasta_buffer(struct msa* msa, const char* buf, size_t size);
+static int parse_fastq_buffer(struct msa* msa, const char* buf, size_t size);
+static int parse_records(struct msa* msa, const char* buf, size_t size, int format);
+static int parse_records_parallel(struct msa* msa, const char* buf, size_t size, int format);
+static size_t next_record(const char* buf, size_t size, size_t pos, int format);
+static size_t complete_records(const char* buf, size_t size, int format);
+static void set_char_types(uint8_t* type);
+static int add_sequence_line(struct msa* msa, const uint8_t* type, struct alphabet* a, const char* p, const char* eol);
+static int keep_read(struct seq_filter* f, const double* ee, const char* qual, int len);
+static int sniff_alphabet(const char* buf, size_t size, int format, int* type);
+static void sniff_line(int* freq, const char* p, const char* eol);
+static int encode_last_residues(struct msa* msa, struct alphabet* a, int n);
+static int feed_fasta(struct msa* msa, struct fasta_carry* c, const char* buf, size_t n, int last);
+static int carry_append(struct fasta_carry* c, const char* buf, size_t n);
+static const char* after_newlines(const char* buf, size_t n, int k);
+static int compare_name_pos(const void *a, const void *b);
+#ifdef RWALIGN_ZLIB
+static int read_fasta_gz(struct msa* msa, char* infile);
+#ifdef RWALIGN_MMAP
+static int read_fasta_bgzf(struct msa* msa, const uint8_t* map, size_t size);
+static int inflate_bgzf_window(struct bgzf_input* bi, int w);
+static int inflate_bgzf_block(const uint8_t* block, int bsize, char* out, uint32_t isize);
+#endif
+#ifdef RWALIGN_GZ_THREAD
+static void* gz_producer(void* arg);
+#ifdef RWALIGN_MMAP
+static void* bgzf_producer(void* arg);
+#endif
+#endif
+#endif
 struct msa* read_msf(char* infile, struct msa* msa);
 struct msa* read_clu(char* infile, struct msa* msa);
 
@@ -57,13 +205,23 @@ int write_msa_clustal(struct msa* msa,char* outfile);
 int write_msa_msf(struct msa* msa,char* outfile);
 
 /* memory functions  */
-struct msa* alloc_msa(void);
-int resize_msa(struct msa* msa);
 
+static int arena_reserve(struct msa_arena* a, long int n);
+static void free_arena(struct msa_arena* a);
+static int add_msa_seq(struct msa* msa, const char* name, int len);
+static int add_msa_residue(struct msa* msa, char c);
+static int add_msa_residues(struct msa* msa, const char* p, int n);
+static int add_msa_gaps(struct msa* msa, int n);
+static int close_msa_seq(struct msa* msa);
+static int append_msa_store(struct msa* msa, struct msa* part);
+static int finish_msa_store(struct msa* msa);
+static int set_msa_seq_views(struct msa* msa);
 
-struct msa_seq* alloc_msa_seq(void);
-int resize_msa_seq(struct msa_seq* seq);
-void free_msa_seq(struct msa_seq* seq);
+static int stage_residue(struct seq_stage* st, char c);
+static int stage_gap(struct seq_stage* st);
+static int resize_stages(struct seq_stage** stages, int* alloc, int n);
+static int commit_stages(struct msa* msa, struct seq_stage* stages, int n);
+static void free_stages(struct seq_stage* stages, int alloc);
 
 
 
@@ -76,8 +234,8 @@ void free_line_buffer(struct line_buffer* lb);
 static int detect_alignment_format(char* infile,int* type);
 static int detect_aligned(struct msa* msa);
 static int detect_alphabet(struct msa* msa);
+static int guess_alphabet(int* letter_freq, int* type);
 static int set_sip_nsip(struct msa* msa);
-static int null_terminate_sequences(struct msa* msa);
 static int sort_out_lines(const void *a, const void *b);
 static int make_linear_sequence(struct msa_seq* seq, char* linear_seq);
 int GCGMultchecksum(struct msa* msa);
@@ -87,6 +245,9 @@ int GCGchecksum(char *seq, int len);
 
 #ifdef RWALIGN_TEST
 int print_msa(struct msa* msa);
+static int pooled_input_test(void);
+static int fastq_sniff_test(void);
+
 int main(int argc, char *argv[])
 {
         struct msa* msa = NULL;
@@ -95,6 +256,11 @@ int main(int argc, char *argv[])
 
         char* datadir;
 
+        RUN(pooled_input_test());
+        RUN(fastq_sniff_test());
+        if(argc < 2){
+                return EXIT_SUCCESS;
+        }
         datadir = getenv("testdatafiledir");
 
         snprintf(buffer,BUFFER_LEN, "%s/%s", datadir, argv[1]);
@@ -112,6 +278,83 @@ ERROR:
         return EXIT_FAILURE;
 }
 
+/* Pools a good and a malformed file; the failure has to come back
+   as NULL without touching the records twice. */
+int pooled_input_test(void)
+{
+        struct msa* msa = NULL;
+        char* infile[2] = {"rwtest_pool.fa", "rwtest_pool.fq"};
+        FILE* f_ptr = NULL;
+
+        RUNP(f_ptr = fopen(infile[0], "w"));
+        fprintf(f_ptr,">a\nACGTACGTAC\n>b\nACGTACGTAA\n");
+        fclose(f_ptr);
+
+        RUNP(f_ptr = fopen(infile[1], "w"));
+        fprintf(f_ptr,"@r1\nACGTACGT\n+\nIIIIIIII\n@r2\nACGTACGA\n+\nIIIIIIII\n");
+        fclose(f_ptr);
+
+        RUNP(msa = alloc_msa());
+        infile[1] = "rwtest_pool.fa";
+        RUNP(msa = read_inputs(infile, 2, msa));
+        ASSERT(msa->numseq == 4, "Pooled %d records, expected 4.", msa->numseq);
+        ASSERT(msa->num_samples == 2, "Found %d samples, expected 2.", msa->num_samples);
+        free_msa(msa);
+
+        /* fasta and fastq can not be pooled */
+        RUNP(msa = alloc_msa());
+        infile[1] = "rwtest_pool.fq";
+        ASSERT(read_inputs(infile, 2, msa) == NULL, "Fasta and fastq were pooled.");
+        free_msa(msa);
+
+        /* quality and sequence lengths differ */
+        RUNP(f_ptr = fopen(infile[1], "w"));
+        fprintf(f_ptr,"@r1\nACGTACGT\n+\nII\n@r2\nACGT\n");
+        fclose(f_ptr);
+        RUNP(msa = alloc_msa());
+        ASSERT(read_inputs(infile, 2, msa) == NULL, "Malformed fastq was read.");
+        free_msa(msa);
+        msa = NULL;
+
+        remove(infile[0]);
+        remove(infile[1]);
+        LOG_MSG("Pooled input tests OK.");
+        return OK;
+ERROR:
+        if(msa){
+                free_msa(msa);
+        }
+        return FAIL;
+}
+
+/* DNA reads (CRLF, blank line at the end) with qualities that look
+   like protein; only the sequence lines may decide. */
+int fastq_sniff_test(void)
+{
+        struct msa* msa = NULL;
+        char* infile = "rwtest_sniff.fq";
+        FILE* f_ptr = NULL;
+
+        RUNP(f_ptr = fopen(infile, "w"));
+        fprintf(f_ptr,"@r1\r\nACGTACGT\r\n+\r\nFFEEIIHH\r\n@r2\r\nACGTACGA\r\n+\r\nFFEEIIHH\r\n@r3\r\nACGTTCGA\r\n+\r\nFFEEIIHH\r\n\r\n");
+        fclose(f_ptr);
+
+        RUNP(msa = read_input(infile, NULL));
+        ASSERT(msa->numseq == 3, "Read %d records, expected 3.", msa->numseq);
+        ASSERT(msa->encoded == defDNA, "Reads taken for alphabet %d.", msa->encoded);
+        free_msa(msa);
+        msa = NULL;
+
+        remove(infile);
+        LOG_MSG("Fastq sniffing tests OK.");
+        return OK;
+ERROR:
+        if(msa){
+                free_msa(msa);
+        }
+        return FAIL;
+}
+
 int print_msa(struct msa* msa)
 {
         int i;
@@ -121,13 +364,17 @@ int print_msa(struct msa* msa)
         for(i = 0; i < msa->numseq;i++){
                 fprintf(stdout,"%s\n", msa->sequences[i]->name);
                 for(j = 0;j < msa->sequences[i]->len;j++){
-                        for(c = 0;c < msa->sequences[i]->gaps[j];c++){
-                                fprintf(stdout,"-");
+                        if(msa->sequences[i]->gaps){
+                                for(c = 0;c < msa->sequences[i]->gaps[j];c++){
+                                        fprintf(stdout,"-");
+                                }
                         }
                         fprintf(stdout,"%c", msa->sequences[i]->seq[j]);
                 }
-                for(c = 0;c < msa->sequences[i]->gaps[ msa->sequences[i]->len];c++){
-                        fprintf(stdout,"-");
+                if(msa->sequences[i]->gaps){
+                        for(c = 0;c < msa->sequences[i]->gaps[ msa->sequences[i]->len];c++){
+                                fprintf(stdout,"-");
+                        }
                 }
                 fprintf(stdout,"\n");
         }
@@ -151,14 +398,15 @@ struct msa* read_input(char* infile,struct msa* msa)
         START_TIMER(timer);
         RUN(detect_alignment_format(infile, &type));
 
-
-        if(type == FORMAT_FA){
-                RUNP(msa = read_fasta(infile,msa));
-        }else if(type == FORMAT_MSF){
-                RUNP(msa = read_msf(infile,msa));
-        }else if(type == FORMAT_CLU){
-                RUNP(msa = read_clu(infile,msa));
+        if(type == FORMAT_SNB){
+                /* prepared records; nothing left to detect */
+                RUNP(msa = read_snb(infile, msa));
+                STOP_TIMER(timer);
+                LOG_MSG("Done reading input sequences in %f seconds.", GET_TIMING(timer));
+                return msa;
         }
+        RUNP(msa = read_records(infile, type, msa));
+        RUN(finish_msa_store(msa));
 
         RUN(detect_alphabet(msa));
         RUN(detect_aligned(msa));
@@ -172,6 +420,142 @@ ERROR:
         return NULL;
 }
 
+/* Reads several input files at once, one thread per file, and pools
+   their records in the order of the files. Each record remembers its
+   file as sample; the alphabet is detected over all files together. */
+struct msa* read_inputs(char** infile, int num_infiles, struct msa* msa)
+{
+        struct msa** part = NULL;
+        char* name = NULL;
+        int* type = NULL;
+        int status;
+        int first;
+        int i,j;
+
+        if(num_infiles == 1){
+                return read_input(infile[0], msa);
+        }
+        ASSERT(msa != NULL, "No alignment");
+        ASSERT(msa->numseq == 0, "Pooled input has to start from an empty alignment.");
+
+        DECLARE_TIMER(timer);
+
+        START_TIMER(timer);
+        MMALLOC(type, sizeof(int) * num_infiles);
+        MMALLOC(part, sizeof(struct msa*) * num_infiles);
+        for(i = 0; i < num_infiles;i++){
+                part[i] = NULL;
+        }
+        for(i = 0; i < num_infiles;i++){
+                if(!my_file_exists(infile[i])){
+                        ERROR_MSG("File: %s does not exist.",infile[i]);
+                }
+                RUN(detect_alignment_format(infile[i], &type[i]));
+                if(type[i] == FORMAT_SNB){
+                        ERROR_MSG("A .snb file can not be combined with other input (%s).", infile[i]);
+                }
+                RUNP(part[i] = alloc_msa());
+                part[i]->filter = msa->filter;
+                part[i]->lazy_names = msa->lazy_names;
+        }
+        status = OK;
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for(i = 0; i < num_infiles;i++){
+                /* the readers free their msa on failure */
+                if(read_records(infile[i], type[i], part[i]) == NULL){
+                        part[i] = NULL;
+#ifdef HAVE_OPENMP
+#pragma omp atomic write
+#endif
+                        status = FAIL;
+                }
+        }
+        if(status != OK){
+                ERROR_MSG("Failed to read the input files.");
+        }
+
+        MMALLOC(msa->sample_names, sizeof(char*) * num_infiles);
+        for(i = 0; i < num_infiles;i++){
+                msa->sample_names[i] = NULL;
+        }
+        msa->num_samples = num_infiles;
+        msa->have_counts = part[0]->have_counts;
+        if(msa->lazy_names){
+                MMALLOC(msa->name_src, sizeof(char*) * num_infiles);
+                for(i = 0; i < num_infiles;i++){
+                        msa->name_src[i] = NULL;
+                }
+                msa->num_name_src = num_infiles;
+        }
+        for(i = 0; i < num_infiles;i++){
+                if(part[i]->have_counts != msa->have_counts){
+                        ERROR_MSG("Fasta and fastq input can not be pooled (%s).", infile[i]);
+                }
+                first = msa->numseq;
+                RUN(append_msa_store(msa, part[i]));
+                for(j = first; j < msa->numseq;j++){
+                        msa->seq_store[j].sample = i;
+                }
+                if(part[i]->name_src){
+                        msa->name_src[i] = part[i]->name_src[0];
+                        part[i]->name_src[0] = NULL;
+                }
+                free_msa(part[i]);
+                part[i] = NULL;
+
+                /* samples are named after their file */
+                name = strrchr(infile[i], '/');
+                name = name ? name + 1 : infile[i];
+                MMALLOC(msa->sample_names[i], sizeof(char) * (strlen(name) + 1));
+                strcpy(msa->sample_names[i], name);
+        }
+        MFREE(part);
+        MFREE(type);
+
+        RUN(finish_msa_store(msa));
+
+        RUN(detect_alphabet(msa));
+        RUN(detect_aligned(msa));
+
+        RUN(set_sip_nsip(msa));
+
+        STOP_TIMER(timer);
+        LOG_MSG("Done reading %d input files in %f seconds.", num_infiles, GET_TIMING(timer));
+        return msa;
+ERROR:
+        if(part){
+                for(i = 0; i < num_infiles;i++){
+                        free_msa(part[i]);
+                }
+                MFREE(part);
+        }
+        if(type){
+                MFREE(type);
+        }
+        return NULL;
+}
+
+/* Appends the records of one fasta, fastq, msf or clustal file to msa;
+   the store is left open. On failure msa has been freed. */
+struct msa* read_records(char* infile, int type, struct msa* msa)
+{
+        if(type == FORMAT_FA || type == FORMAT_FQ){
+                RUNP(msa = read_fasta(infile,msa));
+                if(msa->filter.num_reads){
+                        LOG_MSG("%s: kept %d of %d reads.", infile, msa->filter.num_kept, msa->filter.num_reads);
+                }
+        }else if(type == FORMAT_MSF){
+                RUNP(msa = read_msf(infile,msa));
+        }else if(type == FORMAT_CLU){
+                RUNP(msa = read_clu(infile,msa));
+        }
+        return msa;
+ERROR:
+        return NULL;
+}
+
 int write_msa(struct msa* msa, char* outfile, int type)
 {
 
@@ -198,23 +582,52 @@ int detect_alignment_format(char* infile,int* type)
 {
         FILE* f_ptr = NULL;
         char line[BUFFER_LEN];
+        char magic[8];
         int hints[3];
         int line_len;
         int line_number;
         int set;
         int i;
+#ifdef RWALIGN_MMAP
+        struct stat st;
+#endif
         ASSERT(infile != NULL,"No input file");
         /* sanity checks  */
         if(!my_file_exists(infile)){
                 ERROR_MSG("File: %s does not exist.",infile);
         }
-
+#ifdef RWALIGN_MMAP
+        /* a pipe can only be read once - assume fasta */
+        if(stat(infile, &st) == 0 && !S_ISREG(st.st_mode)){
+                *type = FORMAT_FA;
+                return OK;
+        }
+#endif
         line_number = 0;
+        memset(magic, 0, 8);
         for(i = 0; i < 3; i++){
                 hints[i] =0;
         }
         RUNP(f_ptr = fopen(infile, "r"));
 
+        if(fread(magic, 1, 8, f_ptr) == 8 && !memcmp(magic, SNB_MAGIC, 8)){
+                fclose(f_ptr);
+                *type = FORMAT_SNB;
+                return OK;
+        }
+        /* compressed input is taken to be fasta */
+        if((uint8_t) magic[0] == 0x1f && (uint8_t) magic[1] == 0x8b){
+                fclose(f_ptr);
+                *type = FORMAT_FA;
+                return OK;
+        }
+        if(magic[0] == '@'){
+                fclose(f_ptr);
+                *type = FORMAT_FQ;
+                return OK;
+        }
+        rewind(f_ptr);
+
         /* scan through first line header  */
         while(fgets(line, BUFFER_LEN, f_ptr)){
                 line_len = strnlen(line, BUFFER_LEN);
@@ -286,17 +699,44 @@ ERROR:
 
 /* detect alphabet */
 int detect_alphabet(struct msa* msa)
+{
+        struct alphabet* a = NULL;
+        int type;
+
+        ASSERT(msa != NULL, "No alignment");
+
+        if(guess_alphabet(msa->letter_freq, &type) != OK){
+                ERROR_MSG("Could not detect any AA or nucleotides.");
+        }
+        if(type == defDNA){
+                LOG_MSG("Detected DNA sequences.");
+        }else{
+                LOG_MSG("Detected protein sequences.");
+        }
+        /* the reader may already have encoded everything */
+        if(msa->encoded == type){
+                RUNP(a = create_alphabet(type));
+                msa->L = a->L;
+                MFREE(a);
+        }else{
+                RUN(convert_msa_to_internal(msa, type));
+        }
+        msa->encoded = type;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Picks the alphabet with the fewest letters outside it. */
+int guess_alphabet(int* letter_freq, int* type)
 {
         int i;
-        int min,c;
         uint8_t DNA[128];
         uint8_t protein[128];
-        int diff[3];
+        int diff[2];
         char DNA_letters[]= "acgtuACGTUnN";
         char protein_letters[] = "acdefghiklmnpqrstvwyACDEFGHIKLMNPQRSTVWY";
 
-        ASSERT(msa != NULL, "No alignment");
-
         for(i = 0; i <128;i++){
                 DNA[i] = 0;
                 protein[i] = 0;
@@ -313,39 +753,23 @@ int detect_alphabet(struct msa* msa)
         diff[0] = 0;
         diff[1] = 0;
         for(i = 0; i < 128;i++){
-                if((msa->letter_freq[i]) && (!DNA[i])){
+                if((letter_freq[i]) && (!DNA[i])){
                         diff[0]++;
                 }
-                if((msa->letter_freq[i]) && (!protein[i])){
+                if((letter_freq[i]) && (!protein[i])){
                         diff[1]++;
                 }
         }
 
         if( diff[0] + diff[1] == 0){
-                ERROR_MSG("Could not detect any AA or nucleotides.");
+                return FAIL;
         }
-        c = -1;
-        min = 2147483647;
-        for(i = 0; i < 2;i++){
-                if(diff[i] < min){
-                        min = diff[i];
-                        c = i;
-                }
-        }
-        if(c == 0){
-                LOG_MSG("Detected DNA sequences.");
-                msa->L = defDNA;
-                RUN(convert_msa_to_internal(msa, defDNA));
-        }else if(c == 1){
-                LOG_MSG("Detected protein sequences.");
-                msa->L = redPROTEIN;
-                RUN(convert_msa_to_internal(msa, redPROTEIN));
+        if(diff[1] < diff[0]){
+                *type = redPROTEIN;
         }else{
-                ERROR_MSG("Alphabet not recognized.");
+                *type = defDNA;
         }
         return OK;
-ERROR:
-        return FAIL;
 }
 
 int detect_aligned(struct msa* msa)
@@ -356,6 +780,7 @@ int detect_aligned(struct msa* msa)
         int min_len;
         int max_len;
         int i;
+        long int n;
         int gaps = 0;
         /* assume that sequences are not aligned */
         msa->aligned = 0;
@@ -383,7 +808,21 @@ int detect_aligned(struct msa* msa)
         if(min_len == max_len){
                 msa->aligned = 1;
         }
+        /* gap counts are only kept for aligned input */
+        if(msa->aligned){
+                n = sizeof(int) * msa->residues.used;
+                if(msa->gap_counts.used < n){
+                        RUN(arena_reserve(&msa->gap_counts, n - msa->gap_counts.used));
+                        memset(msa->gap_counts.data + msa->gap_counts.used, 0, n - msa->gap_counts.used);
+                        msa->gap_counts.used = n;
+                }
+        }else{
+                free_arena(&msa->gap_counts);
+        }
+        RUN(set_msa_seq_views(msa));
         return OK;
+ERROR:
+        return FAIL;
 }
 
 
@@ -395,6 +834,9 @@ int dealign_msa(struct msa* msa)
 
         for(i = 0; i < msa->numseq;i++){
                 seq = msa->sequences[i];
+                if(!seq->gaps){
+                        continue;
+                }
                 for(j = 0; j <=  seq->len;j++){
                         seq->gaps[j] = 0;
                 }
@@ -502,7 +944,7 @@ int write_msa_fasta(struct msa* msa,char* outfile)
                 f = 0;
                 for(j = 0;j < msa->sequences[i]->len;j++){
 
-                        for(c = 0;c < msa->sequences[i]->gaps[j];c++){
+                        for(c = 0;c < (msa->sequences[i]->gaps ? msa->sequences[i]->gaps[j] : 0);c++){
                                 fprintf(f_ptr,"-");
                                 f++;
                                 if(f == 60){
@@ -517,7 +959,7 @@ int write_msa_fasta(struct msa* msa,char* outfile)
                                         f = 0;
                                 }
                 }
-                for(c = 0;c < msa->sequences[i]->gaps[ msa->sequences[i]->len];c++){
+                for(c = 0;c < (msa->sequences[i]->gaps ? msa->sequences[i]->gaps[ msa->sequences[i]->len] : 0);c++){
                         fprintf(f_ptr,"-");
                         f++;
                         if(f == 60){
@@ -931,13 +1373,16 @@ ERROR:
 struct msa* read_clu(char* infile, struct msa* msa)
 {
         //struct msa* msa = NULL;
-        struct msa_seq* seq_ptr = NULL;
+        struct seq_stage* stages = NULL;
+        struct seq_stage* st = NULL;
         FILE* f_ptr = NULL;
         char line[BUFFER_LEN];
         int line_len;
         int i,j;
         char* p;
         int active_seq = 0;
+        int num_stages = 0;
+        int alloc_stages = 0;
 
         /* sanity checks  */
         if(!my_file_exists(infile)){
@@ -966,13 +1411,13 @@ struct msa* read_clu(char* infile, struct msa* msa)
                         active_seq = 0;
                 }else{
                         if(!isspace(line[0])){
-                                if(msa->alloc_numseq == active_seq){
-                                        RUN(resize_msa(msa));
+                                if(alloc_stages == active_seq){
+                                        RUN(resize_stages(&stages, &alloc_stages, active_seq + 1));
                                 }
-                                seq_ptr = msa->sequences[active_seq];
-                                //p = strstr(line,seq_ptr->name);
+                                st = stages + active_seq;
+                                //p = strstr(line,st->name);
                                 //if(p){
-                                //LOG_MSG("Found bitsof seq %s", seq_ptr->name);
+                                //LOG_MSG("Found bitsof seq %s", st->name);
                                 p = line;
                                 j = 0;
                                 for(i = 0;i < line_len;i++){
@@ -980,35 +1425,33 @@ struct msa* read_clu(char* infile, struct msa* msa)
                                                 j = i;
                                                 break;
                                         }
-                                        seq_ptr->name[i] = p[i];
+                                        st->name[i] = p[i];
                                 }
-                                seq_ptr->name[j] =0;
+                                st->name[j] =0;
                                 for(i = j;i < line_len;i++){
                                         msa->letter_freq[(int)p[i]]++;
                                         if(isalpha((int)p[i])){
-                                                if(seq_ptr->alloc_len == seq_ptr->len){
-                                                        resize_msa_seq(seq_ptr);
-                                                }
-                                                seq_ptr->seq[seq_ptr->len] = p[i];
-                                                seq_ptr->len++;
+                                                RUN(stage_residue(st, p[i]));
                                         }
                                         if(ispunct((int)p[i])){
-                                                seq_ptr->gaps[seq_ptr->len]++;
+                                                RUN(stage_gap(st));
                                         }
                                 }
                                 active_seq++;
-                                msa->numseq = MACRO_MAX(msa->numseq, active_seq);
+                                num_stages = MACRO_MAX(num_stages, active_seq);
 
                         }
 
                 }
                 //fprintf(stdout,"%d \"%s\"\n",line_len,line);
         }
-        RUN(null_terminate_sequences(msa));
+        RUN(commit_stages(msa, stages, num_stages));
+        free_stages(stages, alloc_stages);
 
         fclose(f_ptr);
         return msa;
 ERROR:
+        free_stages(stages, alloc_stages);
         free_msa(msa);
         return NULL;
 }
@@ -1018,13 +1461,16 @@ ERROR:
 struct msa* read_msf(char* infile,struct msa* msa)
 {
         //struct msa* msa = NULL;
-        struct msa_seq* seq_ptr = NULL;
+        struct seq_stage* stages = NULL;
+        struct seq_stage* st = NULL;
         FILE* f_ptr = NULL;
         char line[BUFFER_LEN];
         int line_len;
         int i,j;
         char* p;
         int active_seq = 0;
+        int num_stages = 0;
+        int alloc_stages = 0;
 
         /* sanity checks  */
         if(!my_file_exists(infile)){
@@ -1049,25 +1495,24 @@ struct msa* read_msf(char* infile,struct msa* msa)
                 /* look for name  */
                 p = strstr(line,"Name:");
                 if(p && strstr(line,"Len:")){
-                        if(msa->alloc_numseq == msa->numseq){
-                                RUN(resize_msa(msa));
+                        if(alloc_stages == num_stages){
+                                RUN(resize_stages(&stages, &alloc_stages, num_stages + 1));
                         }
 
                         p+= 5;  /* length of name: */
                         while( isspace((int)*p)){
                                 p++;
                         }
-                        seq_ptr = msa->sequences[active_seq];
+                        st = stages + active_seq;
 
                         for(i = 0;i < line_len;i++){
                                 if(isspace((int)p[i])){
-                                        seq_ptr->name[i] = 0;
+                                        st->name[i] = 0;
                                         break;
                                 }
-                                seq_ptr->name[i] = p[i];
+                                st->name[i] = p[i];
                         }
-                        seq_ptr->seq[0] = 0;
-                        msa->numseq++;
+                        num_stages++;
                         active_seq++;
                         //LOG_MSG("Got a name %s",p);
                 }
@@ -1081,24 +1526,21 @@ struct msa* read_msf(char* infile,struct msa* msa)
                         active_seq = 0;
                 }else{
                         if(!isspace(line[0])){
-                                seq_ptr = msa->sequences[active_seq];
-                                //p = strstr(line,seq_ptr->name);
+                                ASSERT(active_seq < num_stages, "More sequences than names in %s.", infile);
+                                st = stages + active_seq;
+                                //p = strstr(line,st->name);
                                 //if(p){
-                                //LOG_MSG("Found bitsof seq %s", seq_ptr->name);
+                                //LOG_MSG("Found bitsof seq %s", st->name);
                                 p = line;
-                                j = strnlen(seq_ptr->name, MSA_NAME_LEN);
+                                j = strnlen(st->name, MSA_NAME_LEN);
                                 p += j;
                                 for(i = 0;i < line_len-j;i++){
                                         msa->letter_freq[(int)p[i]]++;
                                         if(isalpha((int)p[i])){
-                                                if(seq_ptr->alloc_len == seq_ptr->len){
-                                                        resize_msa_seq(seq_ptr);
-                                                }
-                                                seq_ptr->seq[seq_ptr->len] = p[i];
-                                                seq_ptr->len++;
+                                                RUN(stage_residue(st, p[i]));
                                         }
                                         if(ispunct((int)p[i])){
-                                                seq_ptr->gaps[seq_ptr->len]++;
+                                                RUN(stage_gap(st));
                                         }
                                 }
 
@@ -1109,23 +1551,31 @@ struct msa* read_msf(char* infile,struct msa* msa)
                 }
                 //fprintf(stdout,"%d \"%s\"\n",line_len,line);
         }
-        RUN(null_terminate_sequences(msa));
+        RUN(commit_stages(msa, stages, num_stages));
+        free_stages(stages, alloc_stages);
 
         fclose(f_ptr);
         return msa;
 ERROR:
+        free_stages(stages, alloc_stages);
         free_msa(msa);
         return NULL;
 }
 
+/* Reads fasta or, if the input starts with '@', fastq. Regular files are
+   mapped and parsed in place; BGZF files are inflated in parallel from
+   the mapping. Everything else (gzip, pipes, or systems without mmap) is
+   streamed; zlib passes uncompressed input through. */
 struct msa* read_fasta(char* infile,struct msa* msa)
 {
-        //struct msa* msa = NULL;
-        struct msa_seq* seq_ptr = NULL;
         FILE* f_ptr = NULL;
-        char line[BUFFER_LEN];
-        int line_len;
-        int i;
+#ifdef RWALIGN_MMAP
+        struct fasta_carry c = {NULL, 0, 0, 0, 0, 0, 0, 0};
+        struct stat st;
+        uint8_t* map = NULL;
+        int status;
+        int fd = -1;
+#endif
 
         /* sanity checks  */
         if(!my_file_exists(infile)){
@@ -1135,89 +1585,1105 @@ struct msa* read_fasta(char* infile,struct msa* msa)
                 msa = alloc_msa();
         }
 
-        RUNP(f_ptr = fopen(infile, "r"));
-
-
-        while(fgets(line, BUFFER_LEN, f_ptr)){
-                line_len = strnlen(line, BUFFER_LEN);
-                if(line[0] == '>'){
-                        /* alloc seq if buffer is full */
-                        if(msa->alloc_numseq == msa->numseq){
-                                RUN(resize_msa(msa));
+#ifdef RWALIGN_MMAP
+        if((fd = open(infile, O_RDONLY)) != -1){
+                if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+                        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if(map == MAP_FAILED){
+                                map = NULL;
                         }
-
-                        line[line_len-1] = 0;
-                        for(i =0 ; i < line_len;i++){
-                                if(isspace(line[i])){
-                                        line[i] = 0;
-
+                }
+                close(fd);
+                if(map && st.st_size > 1 && map[0] == 0x1f && map[1] == 0x8b){
+#ifdef RWALIGN_ZLIB
+                        if(st.st_size > 16 && (map[3] & 4) && map[12] == 'B' && map[13] == 'C'){
+                                status = read_fasta_bgzf(msa, map, st.st_size);
+                                munmap(map, st.st_size);
+                                if(status != OK){
+                                        ERROR_MSG("Failed to read %s.", infile);
                                 }
-
+                                return msa;
                         }
-
-                        seq_ptr = msa->sequences[msa->numseq];
-
-                        if(line_len >= seq_ptr->name_len){
-                                while(line_len >= seq_ptr->name_len){
-                                        seq_ptr->name_len = seq_ptr->name_len << 1;
-                                }
-                                MREALLOC(seq_ptr->name, sizeof(char) * seq_ptr->name_len);
+#endif
+                        munmap(map, st.st_size);
+                        map = NULL;
+                }
+                if(map){
+                        madvise(map, st.st_size, MADV_SEQUENTIAL);
+                        if(msa->lazy_names && msa->numseq == 0 && !msa->name_src){
+                                /* names are read back from here */
+                                MMALLOC(msa->name_src, sizeof(char*));
+                                msa->name_src[0] = NULL;
+                                msa->num_name_src = 1;
+                                MMALLOC(msa->name_src[0], sizeof(char) * (strlen(infile) + 1));
+                                strcpy(msa->name_src[0], infile);
+                                c.lazy = 1;
                         }
-
-                        snprintf(seq_ptr->name , seq_ptr->name_len  ,"%s",line+1);
-                        msa->numseq++;
-
-                }else{
-
-                        for(i = 0;i < line_len;i++){
-                                msa->letter_freq[(int)line[i]]++;
-                                if(isalpha((int)line[i])){
-
-                                        if(seq_ptr->alloc_len == seq_ptr->len){
-                                                resize_msa_seq(seq_ptr);
-                                        }
-
-                                        seq_ptr->seq[seq_ptr->len] = line[i];
-                                        seq_ptr->len++;
-                                }
-                                if(ispunct((int)line[i])){
-                                        seq_ptr->gaps[seq_ptr->len]++;
-                                }
+                        status = feed_fasta(msa, &c, (char*) map, st.st_size, 1);
+                        munmap(map, st.st_size);
+                        if(c.buf){
+                                MFREE(c.buf);
+                        }
+                        if(status != OK){
+                                ERROR_MSG("Failed to parse %s.", infile);
                         }
+                        return msa;
                 }
         }
-        RUN(null_terminate_sequences(msa));
+#endif
+        if(msa->lazy_names){
+                WARNING_MSG("The names in %s are kept in memory: only uncompressed files can be read back.", infile);
+        }
+#ifdef RWALIGN_ZLIB
+        RUN(read_fasta_gz(msa, infile));
+#else
+        RUNP(f_ptr = fopen(infile, "r"));
+        RUN(read_fasta_stream(f_ptr, msa));
         fclose(f_ptr);
+#endif
         return msa;
 ERROR:
+        if(f_ptr){
+                fclose(f_ptr);
+        }
         free_msa(msa);
         return NULL;
 }
 
-
-int null_terminate_sequences(struct msa* msa)
+/* Scans complete fasta lines held in memory. Lines are found with memchr
+   and each run of residues is appended with a single copy; the letter
+   counts match those of the line reader, newlines included. The last
+   record is left open so the next block can continue it. */
+int parse_fasta_buffer(struct msa* msa, const char* buf, size_t size)
 {
-        int i;
-        struct msa_seq* seq_ptr = NULL;
-        /* 0 terminate sequences  */
-        for(i = 0; i < msa->numseq;i++){
-                seq_ptr = msa->sequences[i];
-                if(seq_ptr->alloc_len == seq_ptr->len){
-                        resize_msa_seq(seq_ptr);
-                }
-                seq_ptr->seq[seq_ptr->len] = 0;
+        struct alphabet* a = NULL;
+        uint8_t type[256];
+        const char* end = buf + size;
+        const char* eol = NULL;
+        const char* p = buf;
+        const char* q = NULL;
+
+        set_char_types(type);
+        if(msa->encoded != -1){
+                RUNP(a = create_alphabet(msa->encoded));
+        }
 
+        while(p < end){
+                eol = memchr(p, '\n', end - p);
+                if(!eol){
+                        eol = end;
+                }
+                if(*p == '>'){
+                        for(q = p + 1; q < eol;q++){
+                                if(isspace((int) *q)){
+                                        break;
+                                }
+                        }
+                        RUN(add_msa_seq(msa, p + 1, (int)(q - p - 1)));
+                }else{
+                        RUN(add_sequence_line(msa, type, a, p, eol));
+                        if(eol != end){
+                                msa->letter_freq[(int) '\n']++;
+                        }
+                }
+                p = eol + 1;
+        }
+        if(a){
+                MFREE(a);
         }
         return OK;
+ERROR:
+        if(a){
+                MFREE(a);
+        }
+        return FAIL;
 }
 
-int make_linear_sequence(struct msa_seq* seq, char* linear_seq)
+/* Parses complete four line fastq records (Phred+33). Reads failing
+   msa->filter are dropped before a record is made for them; each read
+   kept counts once. */
+int parse_fastq_buffer(struct msa* msa, const char* buf, size_t size)
 {
-        int c,j,f;
-        f = 0;
-        for(j = 0;j < seq->len;j++){
-                for(c = 0;c < seq->gaps[j];c++){
-                        linear_seq[f] = '-';
+        struct alphabet* a = NULL;
+        uint8_t type[256];
+        double ee[94];
+        const char* end = buf + size;
+        const char* line[4];
+        const char* eol[4];
+        const char* p = buf;
+        const char* q = NULL;
+        int len;
+        int i;
+
+        set_char_types(type);
+        for(i = 0; i < 94;i++){
+                ee[i] = pow(10.0, -(double) i / 10.0);
+        }
+        if(msa->encoded != -1){
+                RUNP(a = create_alphabet(msa->encoded));
+        }
+
+        while(p < end){
+                /* blank lines after the last record */
+                if(*p == '\n' || *p == '\r'){
+                        p++;
+                        continue;
+                }
+                for(i = 0; i < 4;i++){
+                        if(p >= end){
+                                ERROR_MSG("Truncated fastq record: %.*s", (int) MACRO_MIN(eol[0] - line[0], 80), line[0]);
+                        }
+                        line[i] = p;
+                        q = memchr(p, '\n', end - p);
+                        if(!q){
+                                q = end;
+                        }
+                        eol[i] = q;
+                        if(q > p && q[-1] == '\r'){
+                                eol[i] = q - 1;
+                        }
+                        p = q < end ? q + 1 : end;
+                }
+                if(*line[0] != '@' || *line[2] != '+'){
+                        ERROR_MSG("Malformed fastq record: %.*s", (int) MACRO_MIN(eol[0] - line[0], 80), line[0]);
+                }
+                len = eol[1] - line[1];
+                if(eol[3] - line[3] != len){
+                        ERROR_MSG("Sequence and quality differ in length: %.*s", (int) MACRO_MIN(eol[0] - line[0], 80), line[0]);
+                }
+                msa->filter.num_reads++;
+                if(!keep_read(&msa->filter, ee, line[3], len)){
+                        continue;
+                }
+                for(q = line[0] + 1; q < eol[0];q++){
+                        if(isspace((int) *q)){
+                                break;
+                        }
+                }
+                RUN(add_msa_seq(msa, line[0] + 1, (int)(q - line[0] - 1)));
+                msa->seq_store[msa->numseq-1].count = 1;
+                RUN(add_sequence_line(msa, type, a, line[1], eol[1]));
+                msa->letter_freq[(int) '\n']++;
+        }
+        if(a){
+                MFREE(a);
+        }
+        return OK;
+ERROR:
+        if(a){
+                MFREE(a);
+        }
+        return FAIL;
+}
+
+int parse_records(struct msa* msa, const char* buf, size_t size, int format)
+{
+        if(format == FORMAT_FQ){
+                RUN(parse_fastq_buffer(msa, buf, size));
+        }else{
+                RUN(parse_fasta_buffer(msa, buf, size));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void set_char_types(uint8_t* type)
+{
+        int c;
+
+        for(c = 0; c < 256;c++){
+                type[c] = 0;
+                if(isalpha(c)){
+                        type[c] = 1;
+                }else if(ispunct(c)){
+                        type[c] = 2;
+                }
+        }
+}
+
+/* Appends the residues and gaps of one sequence line to the last record. */
+int add_sequence_line(struct msa* msa, const uint8_t* type, struct alphabet* a, const char* p, const char* eol)
+{
+        const char* run = p;
+        const char* q = NULL;
+        int c;
+
+        for(q = p; q < eol;q++){
+                c = (uint8_t) *q;
+                if(c < 128){
+                        msa->letter_freq[c]++;
+                }
+                if(type[c] != 1){
+                        if(q > run){
+                                RUN(add_msa_residues(msa, run, (int)(q - run)));
+                                RUN(encode_last_residues(msa, a, (int)(q - run)));
+                        }
+                        if(type[c] == 2){
+                                RUN(add_msa_gaps(msa, 1));
+                        }
+                        run = q + 1;
+                }
+        }
+        if(q > run){
+                RUN(add_msa_residues(msa, run, (int)(q - run)));
+                RUN(encode_last_residues(msa, a, (int)(q - run)));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int keep_read(struct seq_filter* f, const double* ee, const char* qual, int len)
+{
+        double sum = 0.0;
+        double e = 0.0;
+        int q;
+        int i;
+
+        if(f->min_len && len < f->min_len){
+                return 0;
+        }
+        if(f->max_len && len > f->max_len){
+                return 0;
+        }
+        if(f->min_qual > 0.0 || f->max_ee >= 0.0){
+                for(i = 0; i < len;i++){
+                        q = MACRO_MIN(MACRO_MAX((uint8_t) qual[i] - 33, 0), 93);
+                        sum += q;
+                        e += ee[q];
+                }
+                if(f->min_qual > 0.0 && sum < f->min_qual * len){
+                        return 0;
+                }
+                if(f->max_ee >= 0.0 && e > f->max_ee){
+                        return 0;
+                }
+        }
+        f->num_kept++;
+        return 1;
+}
+
+/* Guesses the alphabet from the letters of the first records; type is
+   left alone if there are too few letters to tell. */
+int sniff_alphabet(const char* buf, size_t size, int format, int* type)
+{
+        int freq[128];
+        const char* end = buf + size;
+        const char* p = buf;
+        const char* eol = NULL;
+        int n = 0;
+        int c;
+        int i;
+
+        for(c = 0; c < 128;c++){
+                freq[c] = 0;
+        }
+        while(p < end && n < FASTA_SNIFF_RECORDS){
+                if(format == FORMAT_FQ){
+                        /* records are framed as in parse_fastq_buffer:
+                           blank lines between them, then four lines of
+                           which only the second holds residues */
+                        if(*p == '\n' || *p == '\r'){
+                                p++;
+                                continue;
+                        }
+                        for(i = 0; i < 4 && p < end;i++){
+                                eol = memchr(p, '\n', end - p);
+                                if(!eol){
+                                        eol = end;
+                                }
+                                if(i == 1){
+                                        sniff_line(freq, p, eol);
+                                }
+                                p = eol + 1;
+                        }
+                        n++;
+                        continue;
+                }
+                eol = memchr(p, '\n', end - p);
+                if(!eol){
+                        eol = end;
+                }
+                if(*p == '>'){
+                        n++;
+                }else{
+                        sniff_line(freq, p, eol);
+                }
+                p = eol + 1;
+        }
+        return guess_alphabet(freq, type);
+}
+
+void sniff_line(int* freq, const char* p, const char* eol)
+{
+        int c;
+
+        if(eol > p && eol[-1] == '\r'){
+                eol--;
+        }
+        for(; p < eol;p++){
+                c = (uint8_t) *p;
+                if(c < 128){
+                        freq[c]++;
+                }
+        }
+}
+
+/* Encodes the last n residues added; on the first character outside the
+   alphabet encoding stops and the whole input is converted later. */
+int encode_last_residues(struct msa* msa, struct alphabet* a, int n)
+{
+        long int o;
+
+        if(!a || msa->encoded == -1){
+                return OK;
+        }
+        o = msa->residues.used - n;
+        if(msa->internal.alloc < msa->residues.used){
+                MREALLOC(msa->internal.data, sizeof(uint8_t) * msa->residues.alloc);
+                msa->internal.alloc = msa->residues.alloc;
+        }
+        if(encode_residues(a, msa->residues.data + o, (uint8_t*) msa->internal.data + o, n)){
+                msa->encoded = -1;
+        }
+        msa->internal.used = msa->residues.used;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Splits complete records held in memory into one byte range per
+   thread, each starting at a record. The first range is parsed straight
+   into msa, the others into private stores that are appended in order,
+   so records and letter counts match the serial parse. */
+int parse_records_parallel(struct msa* msa, const char* buf, size_t size, int format)
+{
+        struct msa** part = NULL;
+        size_t* start = NULL;
+        int status;
+        int n;
+        int i;
+
+        n = 1;
+#ifdef HAVE_OPENMP
+        /* files read side by side already use one thread each */
+        if(!omp_in_parallel()){
+                n = omp_get_max_threads();
+        }
+#endif
+        if(size / FASTA_MIN_CHUNK < (size_t) n){
+                n = size / FASTA_MIN_CHUNK;
+        }
+        if(n <= 1){
+                RUN(parse_records(msa, buf, size, format));
+                return OK;
+        }
+
+        MMALLOC(start, sizeof(size_t) * (n+1));
+        MMALLOC(part, sizeof(struct msa*) * n);
+        for(i = 0; i < n;i++){
+                part[i] = NULL;
+        }
+        start[0] = 0;
+        start[n] = size;
+        for(i = 1; i < n;i++){
+                start[i] = next_record(buf, size, MACRO_MAX(size / n * i, start[i-1]), format);
+        }
+
+        part[0] = msa;
+        for(i = 1; i < n;i++){
+                RUNP(part[i] = alloc_msa());
+                part[i]->encoded = msa->encoded;
+                part[i]->filter = msa->filter;
+                part[i]->filter.num_reads = 0;
+                part[i]->filter.num_kept = 0;
+                part[i]->src_buf = msa->src_buf;
+                part[i]->src_pos = msa->src_pos;
+        }
+        status = OK;
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for(i = 0; i < n;i++){
+                if(parse_records(part[i], buf + start[i], start[i+1] - start[i], format) != OK){
+#ifdef HAVE_OPENMP
+#pragma omp atomic write
+#endif
+                        status = FAIL;
+                }
+        }
+        if(status != OK){
+                ERROR_MSG("Parsing failed.");
+        }
+        for(i = 1; i < n;i++){
+                RUN(append_msa_store(msa, part[i]));
+                free_msa(part[i]);
+                part[i] = NULL;
+        }
+        MFREE(part);
+        MFREE(start);
+        return OK;
+ERROR:
+        if(part){
+                for(i = 1; i < n;i++){
+                        free_msa(part[i]);
+                }
+                MFREE(part);
+        }
+        if(start){
+                MFREE(start);
+        }
+        return FAIL;
+}
+
+/* First record start at or after pos: a '>' (fasta) or '@' (fastq) at the
+   beginning of a line. Quality lines can start with '@' too, so a fastq
+   header also needs a '+' line two lines further on. */
+size_t next_record(const char* buf, size_t size, size_t pos, int format)
+{
+        const char* p = NULL;
+        const char* q = NULL;
+
+        while(pos < size){
+                p = memchr(buf + pos, format == FORMAT_FQ ? '@' : '>', size - pos);
+                if(!p){
+                        return size;
+                }
+                pos = p - buf;
+                if(pos == 0 || buf[pos-1] == '\n'){
+                        if(format != FORMAT_FQ){
+                                return pos;
+                        }
+                        q = after_newlines(p, size - pos, 2);
+                        if(!q || q == buf + size){
+                                return size;
+                        }
+                        if(*q == '+'){
+                                return pos;
+                        }
+                }
+                pos++;
+        }
+        return size;
+}
+
+/* Length of the prefix of buf holding only complete lines (fasta) or
+   four line records (fastq). */
+size_t complete_records(const char* buf, size_t size, int format)
+{
+        const char* end = buf + size;
+        const char* p = buf;
+        const char* q = NULL;
+        size_t len = 0;
+        int n = 0;
+
+        if(format != FORMAT_FQ){
+                for(q = end; q > buf;q--){
+                        if(q[-1] == '\n'){
+                                return q - buf;
+                        }
+                }
+                return 0;
+        }
+        while(p < end && (q = memchr(p, '\n', end - p))){
+                p = q + 1;
+                if(!(++n & 3)){
+                        len = p - buf;
+                }
+        }
+        return len;
+}
+
+/* Pointer just past the k-th newline in buf; NULL if there are fewer. */
+const char* after_newlines(const char* buf, size_t n, int k)
+{
+        const char* end = buf + n;
+        const char* p = buf;
+
+        while(k--){
+                if(p >= end || (p = memchr(p, '\n', end - p)) == NULL){
+                        return NULL;
+                }
+                p++;
+        }
+        return p;
+}
+
+/* Parses the complete lines (fastq: records) of a block of text; the
+   incomplete tail is kept in c and completed by the next block. The
+   first block decides between fasta and fastq, the last call closes the
+   final record. */
+int feed_fasta(struct msa* msa, struct fasta_carry* c, const char* buf, size_t n, int last)
+{
+        const char* p = NULL;
+        const char* q = NULL;
+        size_t i;
+        int k;
+
+        if(!c->started && n){
+                c->started = 1;
+                c->type = buf[0] == '@' ? FORMAT_FQ : FORMAT_FA;
+                if(c->type == FORMAT_FQ){
+                        msa->have_counts = 1;
+                }
+                if(msa->numseq == 0){
+                        sniff_alphabet(buf, n, c->type, &msa->encoded);
+                }
+        }
+        if(n){
+                p = buf;
+                if(c->len){
+                        k = 1;
+                        if(c->type == FORMAT_FQ){
+                                for(i = 0; i < c->len;i++){
+                                        k -= c->buf[i] == '\n';
+                                }
+                                k += 3;
+                        }
+                        q = after_newlines(buf, n, k);
+                        if(!q){
+                                q = buf + n;
+                        }
+                        RUN(carry_append(c, buf, q - buf));
+                        p = q;
+                        if(k && c->buf[c->len-1] == '\n'){
+                                if(c->lazy){
+                                        msa->src_buf = c->buf;
+                                        msa->src_pos = c->start;
+                                }
+                                RUN(parse_records(msa, c->buf, c->len, c->type));
+                                c->len = 0;
+                        }
+                }
+                q = p + complete_records(p, buf + n - p, c->type);
+                if(q > p){
+                        if(c->lazy){
+                                msa->src_buf = buf;
+                                msa->src_pos = c->pos;
+                        }
+                        RUN(parse_records_parallel(msa, p, q - p, c->type));
+                }
+                if(!c->len){
+                        c->start = c->pos + (q - buf);
+                }
+                RUN(carry_append(c, q, buf + n - q));
+                c->pos += n;
+        }
+        if(last){
+                if(c->len){
+                        if(c->lazy){
+                                msa->src_buf = c->buf;
+                                msa->src_pos = c->start;
+                        }
+                        RUN(parse_records(msa, c->buf, c->len, c->type));
+                        c->len = 0;
+                }
+                RUN(close_msa_seq(msa));
+        }
+        msa->src_buf = NULL;
+        return OK;
+ERROR:
+        msa->src_buf = NULL;
+        return FAIL;
+}
+
+int carry_append(struct fasta_carry* c, const char* buf, size_t n)
+{
+        if(!n){
+                return OK;
+        }
+        if(c->len + n > c->alloc){
+                c->alloc = MACRO_MAX(c->alloc << 1, c->len + n);
+                MREALLOC(c->buf, sizeof(char) * c->alloc);
+        }
+        memcpy(c->buf + c->len, buf, n);
+        c->len += n;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+#ifdef RWALIGN_ZLIB
+/* gzip (or plain) input is read by a separate thread into a small ring
+   of buffers so decompression overlaps with parsing. */
+int read_fasta_gz(struct msa* msa, char* infile)
+{
+        struct fasta_carry c = {NULL, 0, 0, 0, 0, 0, 0, 0};
+        gzFile f = NULL;
+#ifdef RWALIGN_GZ_THREAD
+        struct gz_queue q;
+        pthread_t thread;
+        int running = 0;
+        int slot;
+        int i;
+
+        for(i = 0; i < GZ_QUEUE_LEN;i++){
+                q.buf[i] = NULL;
+        }
+#else
+        char* buf = NULL;
+        int n;
+#endif
+
+        if((f = gzopen(infile, "rb")) == NULL){
+                ERROR_MSG("Could not open %s.", infile);
+        }
+        gzbuffer(f, 1 << 17);
+#ifdef RWALIGN_GZ_THREAD
+        q.f = f;
+        q.head = 0;
+        q.num = 0;
+        q.done = 0;
+        q.stop = 0;
+        for(i = 0; i < GZ_QUEUE_LEN;i++){
+                MMALLOC(q.buf[i], sizeof(char) * GZ_BLOCK);
+        }
+        pthread_mutex_init(&q.lock, NULL);
+        pthread_cond_init(&q.cond, NULL);
+        if(pthread_create(&thread, NULL, gz_producer, &q)){
+                pthread_mutex_destroy(&q.lock);
+                pthread_cond_destroy(&q.cond);
+                ERROR_MSG("Could not start the decompression thread.");
+        }
+        running = 1;
+        while(1){
+                pthread_mutex_lock(&q.lock);
+                while(!q.num && !q.done){
+                        pthread_cond_wait(&q.cond, &q.lock);
+                }
+                if(!q.num){
+                        pthread_mutex_unlock(&q.lock);
+                        break;
+                }
+                slot = q.head;
+                pthread_mutex_unlock(&q.lock);
+
+                RUN(feed_fasta(msa, &c, q.buf[slot], q.len[slot], 0));
+
+                pthread_mutex_lock(&q.lock);
+                q.head = (q.head + 1) % GZ_QUEUE_LEN;
+                q.num--;
+                pthread_cond_broadcast(&q.cond);
+                pthread_mutex_unlock(&q.lock);
+        }
+        pthread_join(thread, NULL);
+        running = 0;
+        pthread_mutex_destroy(&q.lock);
+        pthread_cond_destroy(&q.cond);
+        if(q.done < 0){
+                ERROR_MSG("Could not decompress %s.", infile);
+        }
+        for(i = 0; i < GZ_QUEUE_LEN;i++){
+                MFREE(q.buf[i]);
+        }
+#else
+        MMALLOC(buf, sizeof(char) * GZ_BLOCK);
+        while((n = gzread(f, buf, GZ_BLOCK)) > 0){
+                RUN(feed_fasta(msa, &c, buf, n, 0));
+        }
+        if(n < 0){
+                ERROR_MSG("Could not decompress %s.", infile);
+        }
+        MFREE(buf);
+#endif
+        RUN(feed_fasta(msa, &c, NULL, 0, 1));
+        gzclose(f);
+        if(c.buf){
+                MFREE(c.buf);
+        }
+        return OK;
+ERROR:
+#ifdef RWALIGN_GZ_THREAD
+        if(running){
+                pthread_mutex_lock(&q.lock);
+                q.stop = 1;
+                pthread_cond_broadcast(&q.cond);
+                pthread_mutex_unlock(&q.lock);
+                pthread_join(thread, NULL);
+                pthread_mutex_destroy(&q.lock);
+                pthread_cond_destroy(&q.cond);
+        }
+        for(i = 0; i < GZ_QUEUE_LEN;i++){
+                if(q.buf[i]){
+                        MFREE(q.buf[i]);
+                }
+        }
+#else
+        if(buf){
+                MFREE(buf);
+        }
+#endif
+        if(f){
+                gzclose(f);
+        }
+        if(c.buf){
+                MFREE(c.buf);
+        }
+        return FAIL;
+}
+
+#ifdef RWALIGN_GZ_THREAD
+void* gz_producer(void* arg)
+{
+        struct gz_queue* q = (struct gz_queue*) arg;
+        int slot = 0;
+        int n;
+
+        while(1){
+                pthread_mutex_lock(&q->lock);
+                while(q->num == GZ_QUEUE_LEN && !q->stop){
+                        pthread_cond_wait(&q->cond, &q->lock);
+                }
+                if(q->stop){
+                        pthread_mutex_unlock(&q->lock);
+                        break;
+                }
+                pthread_mutex_unlock(&q->lock);
+
+                n = gzread(q->f, q->buf[slot], GZ_BLOCK);
+
+                pthread_mutex_lock(&q->lock);
+                if(n <= 0){
+                        q->done = n < 0 ? -1 : 1;
+                        pthread_cond_broadcast(&q->cond);
+                        pthread_mutex_unlock(&q->lock);
+                        break;
+                }
+                q->len[slot] = n;
+                q->num++;
+                pthread_cond_broadcast(&q->cond);
+                pthread_mutex_unlock(&q->lock);
+                slot = (slot + 1) % GZ_QUEUE_LEN;
+        }
+        return NULL;
+}
+#endif
+
+#ifdef RWALIGN_MMAP
+/* BGZF files are a series of independent gzip members of at most 64kb
+   whose headers give the compressed and trailers the decompressed size.
+   Windows of blocks are inflated in parallel straight to their place in
+   one of two buffers; with threads the next window is inflated while
+   the current one is parsed. */
+static int read_fasta_bgzf(struct msa* msa, const uint8_t* map, size_t size)
+{
+        struct fasta_carry c = {NULL, 0, 0, 0, 0, 0, 0, 0};
+        struct bgzf_input bi;
+#ifdef RWALIGN_GZ_THREAD
+        pthread_t thread;
+        int running = 0;
+        int ready;
+#endif
+        long int max_total = 0;
+        long int total;
+        size_t pos;
+        size_t t;
+        int xlen;
+        int alloc = 0;
+        int num = 0;
+        int b,e,j,w;
+
+        bi.map = map;
+        bi.off = NULL;
+        bi.bsize = NULL;
+        bi.isize = NULL;
+        bi.out = NULL;
+        bi.win = NULL;
+        bi.num_win = 0;
+        bi.buf[0] = NULL;
+        bi.buf[1] = NULL;
+
+        pos = 0;
+        while(pos < size){
+                if(size - pos < 26 || map[pos] != 0x1f || map[pos+1] != 0x8b || map[pos+2] != 8 || !(map[pos+3] & 4)){
+                        ERROR_MSG("Not a BGZF block at offset %ld.", (long int) pos);
+                }
+                if(num == alloc){
+                        alloc = MACRO_MAX(alloc << 1, 1024);
+                        MREALLOC(bi.off, sizeof(long int) * alloc);
+                        MREALLOC(bi.bsize, sizeof(int) * alloc);
+                        MREALLOC(bi.isize, sizeof(uint32_t) * alloc);
+                        MREALLOC(bi.out, sizeof(long int) * alloc);
+                        MREALLOC(bi.win, sizeof(int) * (alloc+1));
+                }
+                xlen = map[pos+10] | (map[pos+11] << 8);
+                bi.bsize[num] = 0;
+                for(j = 0; j + 4 <= xlen && pos + 12 + j + 6 <= size;){
+                        if(map[pos+12+j] == 'B' && map[pos+13+j] == 'C'){
+                                bi.bsize[num] = (map[pos+16+j] | (map[pos+17+j] << 8)) + 1;
+                                break;
+                        }
+                        j += 4 + (map[pos+14+j] | (map[pos+15+j] << 8));
+                }
+                if(bi.bsize[num] < 12 + xlen + 8 || pos + bi.bsize[num] > size){
+                        ERROR_MSG("Corrupt BGZF block at offset %ld.", (long int) pos);
+                }
+                bi.off[num] = pos;
+                t = pos + bi.bsize[num] - 4;
+                bi.isize[num] = (uint32_t) map[t] | ((uint32_t) map[t+1] << 8) | ((uint32_t) map[t+2] << 16) | ((uint32_t) map[t+3] << 24);
+                pos += bi.bsize[num];
+                num++;
+        }
+
+        /* windows of whole blocks and each block's place in its window */
+        b = 0;
+        while(b < num){
+                total = 0;
+                for(e = b; e < num && total + (long int) bi.isize[e] <= BGZF_WINDOW;e++){
+                        bi.out[e] = total;
+                        total += bi.isize[e];
+                }
+                if(e == b){
+                        ERROR_MSG("BGZF block %d is too large.", b);
+                }
+                bi.win[bi.num_win] = b;
+                bi.num_win++;
+                max_total = MACRO_MAX(max_total, total);
+                b = e;
+        }
+        bi.win[bi.num_win] = num;
+        MMALLOC(bi.buf[0], sizeof(char) * max_total);
+        MMALLOC(bi.buf[1], sizeof(char) * max_total);
+
+#ifdef RWALIGN_GZ_THREAD
+        bi.num_done = 0;
+        bi.num_used = 0;
+        bi.status = 0;
+        bi.stop = 0;
+        pthread_mutex_init(&bi.lock, NULL);
+        pthread_cond_init(&bi.cond, NULL);
+        if(pthread_create(&thread, NULL, bgzf_producer, &bi)){
+                pthread_mutex_destroy(&bi.lock);
+                pthread_cond_destroy(&bi.cond);
+                ERROR_MSG("Could not start the decompression thread.");
+        }
+        running = 1;
+        for(w = 0; w < bi.num_win;w++){
+                pthread_mutex_lock(&bi.lock);
+                while(bi.num_done <= w && !bi.status){
+                        pthread_cond_wait(&bi.cond, &bi.lock);
+                }
+                ready = bi.num_done > w;
+                pthread_mutex_unlock(&bi.lock);
+                if(!ready){
+                        ERROR_MSG("Corrupt BGZF block.");
+                }
+
+                RUN(feed_fasta(msa, &c, bi.buf[w & 1], bi.len[w & 1], 0));
+
+                pthread_mutex_lock(&bi.lock);
+                bi.num_used++;
+                pthread_cond_broadcast(&bi.cond);
+                pthread_mutex_unlock(&bi.lock);
+        }
+        pthread_join(thread, NULL);
+        running = 0;
+        pthread_mutex_destroy(&bi.lock);
+        pthread_cond_destroy(&bi.cond);
+#else
+        for(w = 0; w < bi.num_win;w++){
+                if(inflate_bgzf_window(&bi, w) != OK){
+                        ERROR_MSG("Corrupt BGZF block.");
+                }
+                RUN(feed_fasta(msa, &c, bi.buf[w & 1], bi.len[w & 1], 0));
+        }
+#endif
+        RUN(feed_fasta(msa, &c, NULL, 0, 1));
+
+        MFREE(bi.off);
+        MFREE(bi.bsize);
+        MFREE(bi.isize);
+        MFREE(bi.out);
+        MFREE(bi.win);
+        if(bi.buf[0]){
+                MFREE(bi.buf[0]);
+        }
+        if(bi.buf[1]){
+                MFREE(bi.buf[1]);
+        }
+        if(c.buf){
+                MFREE(c.buf);
+        }
+        return OK;
+ERROR:
+#ifdef RWALIGN_GZ_THREAD
+        if(running){
+                pthread_mutex_lock(&bi.lock);
+                bi.stop = 1;
+                pthread_cond_broadcast(&bi.cond);
+                pthread_mutex_unlock(&bi.lock);
+                pthread_join(thread, NULL);
+                pthread_mutex_destroy(&bi.lock);
+                pthread_cond_destroy(&bi.cond);
+        }
+#endif
+        if(bi.off){
+                MFREE(bi.off);
+        }
+        if(bi.bsize){
+                MFREE(bi.bsize);
+        }
+        if(bi.isize){
+                MFREE(bi.isize);
+        }
+        if(bi.out){
+                MFREE(bi.out);
+        }
+        if(bi.win){
+                MFREE(bi.win);
+        }
+        if(bi.buf[0]){
+                MFREE(bi.buf[0]);
+        }
+        if(bi.buf[1]){
+                MFREE(bi.buf[1]);
+        }
+        if(c.buf){
+                MFREE(c.buf);
+        }
+        return FAIL;
+}
+
+/* inflates the blocks of window w in parallel into buffer w & 1 */
+static int inflate_bgzf_window(struct bgzf_input* bi, int w)
+{
+        char* out = bi->buf[w & 1];
+        int b = bi->win[w];
+        int e = bi->win[w+1];
+        int status = OK;
+        int i;
+
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for(i = b; i < e;i++){
+                if(inflate_bgzf_block(bi->map + bi->off[i], bi->bsize[i], out + bi->out[i], bi->isize[i]) != OK){
+#ifdef HAVE_OPENMP
+#pragma omp atomic write
+#endif
+                        status = FAIL;
+                }
+        }
+        bi->len[w & 1] = bi->out[e-1] + bi->isize[e-1];
+        return status;
+}
+
+#ifdef RWALIGN_GZ_THREAD
+/* inflates window after window, at most one ahead of the parser */
+void* bgzf_producer(void* arg)
+{
+        struct bgzf_input* bi = (struct bgzf_input*) arg;
+        int w;
+
+        for(w = 0; w < bi->num_win;w++){
+                pthread_mutex_lock(&bi->lock);
+                while(w - bi->num_used >= 2 && !bi->stop){
+                        pthread_cond_wait(&bi->cond, &bi->lock);
+                }
+                if(bi->stop){
+                        pthread_mutex_unlock(&bi->lock);
+                        break;
+                }
+                pthread_mutex_unlock(&bi->lock);
+
+                if(inflate_bgzf_window(bi, w) != OK){
+                        pthread_mutex_lock(&bi->lock);
+                        bi->status = -1;
+                        pthread_cond_broadcast(&bi->cond);
+                        pthread_mutex_unlock(&bi->lock);
+                        break;
+                }
+
+                pthread_mutex_lock(&bi->lock);
+                bi->num_done++;
+                pthread_cond_broadcast(&bi->cond);
+                pthread_mutex_unlock(&bi->lock);
+        }
+        return NULL;
+}
+#endif
+
+/* raw inflate of one block; the CRC in the trailer is checked */
+static int inflate_bgzf_block(const uint8_t* block, int bsize, char* out, uint32_t isize)
+{
+        z_stream z;
+        uint32_t crc;
+        int hdr;
+        int ret;
+
+        if(!isize){
+                return OK;
+        }
+        hdr = 12 + (block[10] | (block[11] << 8));
+        memset(&z, 0, sizeof(z_stream));
+        if(inflateInit2(&z, -15) != Z_OK){
+                return FAIL;
+        }
+        z.next_in = (Bytef*) (block + hdr);
+        z.avail_in = bsize - hdr - 8;
+        z.next_out = (Bytef*) out;
+        z.avail_out = isize;
+        ret = inflate(&z, Z_FINISH);
+        inflateEnd(&z);
+        if(ret != Z_STREAM_END || z.total_out != isize){
+                return FAIL;
+        }
+        crc = (uint32_t) block[bsize-8] | ((uint32_t) block[bsize-7] << 8) | ((uint32_t) block[bsize-6] << 16) | ((uint32_t) block[bsize-5] << 24);
+        if(crc32(0L, (Bytef*) out, isize) != crc){
+                return FAIL;
+        }
+        return OK;
+}
+#endif
+#endif
+
+#ifndef RWALIGN_ZLIB
+int read_fasta_stream(FILE* f_ptr, struct msa* msa)
+{
+        char line[BUFFER_LEN];
+        int line_len;
+        int i;
+
+        while(fgets(line, BUFFER_LEN, f_ptr)){
+                line_len = strnlen(line, BUFFER_LEN);
+                if(line[0] == '>'){
+                        line[line_len-1] = 0;
+                        for(i =0 ; i < line_len;i++){
+                                if(isspace(line[i])){
+                                        line[i] = 0;
+
+                                }
+
+                        }
+                        RUN(add_msa_seq(msa, line+1, strlen(line+1)));
+                }else{
+
+                        for(i = 0;i < line_len;i++){
+                                msa->letter_freq[(int)line[i]]++;
+                                if(isalpha((int)line[i])){
+                                        RUN(add_msa_residue(msa, line[i]));
+                                }
+                                if(ispunct((int)line[i])){
+                                        RUN(add_msa_gaps(msa, 1));
+                                }
+                        }
+                }
+        }
+        RUN(close_msa_seq(msa));
+        return OK;
+ERROR:
+        return FAIL;
+}
+#endif
+
+int make_linear_sequence(struct msa_seq* seq, char* linear_seq)
+{
+        int c,j,f;
+        f = 0;
+        for(j = 0;j < seq->len;j++){
+                for(c = 0;c < seq->gaps[j];c++){
+                        linear_seq[f] = '-';
                         f++;
 
                 }
@@ -1241,20 +2707,50 @@ struct msa* alloc_msa(void)
         int i;
         MMALLOC(msa, sizeof(struct msa));
         msa->sequences = NULL;
-        msa->alloc_numseq = 512;
+        msa->seq_store = NULL;
+        msa->name_off = NULL;
+        msa->seq_off = NULL;
+        msa->names.data = NULL;
+        msa->residues.data = NULL;
+        msa->internal.data = NULL;
+        msa->gap_counts.data = NULL;
+        free_arena(&msa->names);
+        free_arena(&msa->residues);
+        free_arena(&msa->internal);
+        free_arena(&msa->gap_counts);
+        msa->alloc_numseq = MSA_INIT_NUMSEQ;
         msa->numseq = 0;
+        msa->num_profiles = 0;
         msa->L = 0;
         msa->aligned = 0;
+        msa->encoded = -1;
+        msa->num_unique = 0;
+        msa->have_counts = 0;
+        msa->filter.min_qual = 0.0;
+        msa->filter.max_ee = -1.0;
+        msa->filter.min_len = 0;
+        msa->filter.max_len = 0;
+        msa->filter.num_reads = 0;
+        msa->filter.num_kept = 0;
+        msa->sample_names = NULL;
+        msa->num_samples = 1;
+        msa->abund_store = NULL;
+        msa->lazy_names = 0;
+        msa->name_src = NULL;
+        msa->num_name_src = 0;
+        msa->src_buf = NULL;
+        msa->src_pos = 0;
+        msa->map = NULL;
+        msa->map_size = 0;
         msa->plen = NULL;
         msa->sip = NULL;
         msa->nsip = NULL;
 
         MMALLOC(msa->sequences, sizeof(struct msa_seq*) * msa->alloc_numseq);
+        MMALLOC(msa->seq_store, sizeof(struct msa_seq) * msa->alloc_numseq);
+        MMALLOC(msa->name_off, sizeof(long int) * msa->alloc_numseq);
+        MMALLOC(msa->seq_off, sizeof(long int) * msa->alloc_numseq);
 
-        for(i = 0; i < msa->alloc_numseq;i++){
-                msa->sequences[i] = NULL;
-                RUNP(msa->sequences[i] = alloc_msa_seq());
-        }
         for(i = 0; i < 128; i++){
                 msa->letter_freq[i] = 0;
         }
@@ -1266,18 +2762,12 @@ ERROR:
 
 int resize_msa(struct msa* msa)
 {
-        int i;
-        int old_size;
-
-        old_size = msa->alloc_numseq;
-        msa->alloc_numseq = msa->alloc_numseq + 512;
+        msa->alloc_numseq = msa->alloc_numseq << 1;
 
         MREALLOC(msa->sequences, sizeof(struct msa_seq*) * msa->alloc_numseq);
-
-        for(i = old_size; i < msa->alloc_numseq;i++){
-                msa->sequences[i] = NULL;
-                RUNP(msa->sequences[i] = alloc_msa_seq());
-        }
+        MREALLOC(msa->seq_store, sizeof(struct msa_seq) * msa->alloc_numseq);
+        MREALLOC(msa->name_off, sizeof(long int) * msa->alloc_numseq);
+        MREALLOC(msa->seq_off, sizeof(long int) * msa->alloc_numseq);
         return OK;
 ERROR:
         return FAIL;
@@ -1287,83 +2777,567 @@ void free_msa(struct msa* msa)
 {
         int i;
         if(msa){
-                for(i = 0; i < msa->alloc_numseq;i++){
-                        free_msa_seq(msa->sequences[i]);
-                }
-
                 for (i = msa->num_profiles;i--;){
                         if(msa->sip[i]){
                                 MFREE(msa->sip[i]);
                         }
                 }
-                MFREE(msa->plen);
-                MFREE(msa->sip);
-                MFREE(msa->nsip);
-
-                MFREE(msa->sequences);
+                if(msa->plen){
+                        MFREE(msa->plen);
+                }
+                if(msa->sip){
+                        MFREE(msa->sip);
+                }
+                if(msa->nsip){
+                        MFREE(msa->nsip);
+                }
+                free_arena(&msa->names);
+                free_arena(&msa->residues);
+                free_arena(&msa->internal);
+                free_arena(&msa->gap_counts);
+                free_snb_map(msa);
+                if(msa->sample_names){
+                        for(i = 0; i < msa->num_samples;i++){
+                                if(msa->sample_names[i]){
+                                        MFREE(msa->sample_names[i]);
+                                }
+                        }
+                        MFREE(msa->sample_names);
+                }
+                if(msa->abund_store){
+                        MFREE(msa->abund_store);
+                }
+                if(msa->name_src){
+                        for(i = 0; i < msa->num_name_src;i++){
+                                if(msa->name_src[i]){
+                                        MFREE(msa->name_src[i]);
+                                }
+                        }
+                        MFREE(msa->name_src);
+                }
+                if(msa->name_off){
+                        MFREE(msa->name_off);
+                }
+                if(msa->seq_off){
+                        MFREE(msa->seq_off);
+                }
+                if(msa->seq_store){
+                        MFREE(msa->seq_store);
+                }
+                if(msa->sequences){
+                        MFREE(msa->sequences);
+                }
                 MFREE(msa);
         }
 }
 
+int arena_reserve(struct msa_arena* a, long int n)
+{
+        long int size;
+
+        if(a->used + n <= a->alloc){
+                return OK;
+        }
+        size = MACRO_MAX(a->alloc << 1, 65536);
+        while(size < a->used + n){
+                size = size << 1;
+        }
+        MREALLOC(a->data, sizeof(char) * size);
+        a->alloc = size;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_arena(struct msa_arena* a)
+{
+        if(a->data){
+                MFREE(a->data);
+        }
+        a->data = NULL;
+        a->used = 0;
+        a->alloc = 0;
+}
 
-struct msa_seq* alloc_msa_seq(void)
+/* Starts a new record named by the first len characters of name;
+   residues are appended to the last record. */
+int add_msa_seq(struct msa* msa, const char* name, int len)
 {
         struct msa_seq* seq = NULL;
-        int i;
-        MMALLOC(seq, sizeof(struct msa_seq));
+
+        RUN(close_msa_seq(msa));
+        if(msa->alloc_numseq == msa->numseq){
+                RUN(resize_msa(msa));
+        }
+        if(msa->src_buf){
+                /* lazy: only remember where the name is */
+                msa->name_off[msa->numseq] = -(msa->src_pos + (name - msa->src_buf) + 1);
+        }else{
+                RUN(arena_reserve(&msa->names, len + 1));
+                memcpy(msa->names.data + msa->names.used, name, len);
+                msa->names.data[msa->names.used + len] = 0;
+                msa->name_off[msa->numseq] = msa->names.used;
+                msa->names.used += len + 1;
+        }
+
+        msa->seq_off[msa->numseq] = msa->residues.used;
+        seq = msa->seq_store + msa->numseq;
         seq->name = NULL;
         seq->seq = NULL;
         seq->s = NULL;
         seq->gaps = NULL;
+        seq->dup = NULL;
+        seq->abund = NULL;
+        seq->num_abund = 0;
+        seq->sample = 0;
         seq->len = 0;
-        seq->alloc_len = 512;
+        seq->name_len = len + 1;
         seq->count = 0;
-        seq->name_len = MSA_NAME_LEN;
         seq->cluster = 0;
-        MMALLOC(seq->name, sizeof(char)* seq->name_len);
+        msa->numseq++;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int add_msa_residue(struct msa* msa, char c)
+{
+        ASSERT(msa->numseq > 0, "Sequence data before the first header.");
+        msa->encoded = -1;
+        RUN(arena_reserve(&msa->residues, 1));
+        msa->residues.data[msa->residues.used] = c;
+        msa->residues.used++;
+        msa->seq_store[msa->numseq-1].len++;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int add_msa_residues(struct msa* msa, const char* p, int n)
+{
+        ASSERT(msa->numseq > 0, "Sequence data before the first header.");
+        RUN(arena_reserve(&msa->residues, n));
+        memcpy(msa->residues.data + msa->residues.used, p, n);
+        msa->residues.used += n;
+        msa->seq_store[msa->numseq-1].len += n;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* adds n gaps before the next residue of the last record */
+int add_msa_gaps(struct msa* msa, int n)
+{
+        long int need;
+
+        ASSERT(msa->numseq > 0, "Sequence data before the first header.");
+        need = sizeof(int) * (msa->residues.used + 1);
+        if(msa->gap_counts.used < need){
+                RUN(arena_reserve(&msa->gap_counts, need - msa->gap_counts.used));
+                memset(msa->gap_counts.data + msa->gap_counts.used, 0, need - msa->gap_counts.used);
+                msa->gap_counts.used = need;
+        }
+        ((int*) msa->gap_counts.data)[msa->residues.used] += n;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* 0 terminates the last record if it is still open */
+int close_msa_seq(struct msa* msa)
+{
+        int i;
+
+        if(!msa->numseq){
+                return OK;
+        }
+        i = msa->numseq - 1;
+        if(msa->seq_off[i] + msa->seq_store[i].len == msa->residues.used){
+                RUN(arena_reserve(&msa->residues, 1));
+                msa->residues.data[msa->residues.used] = 0;
+                msa->residues.used++;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Appends the records of part to msa, shifting their arena offsets.
+   The last record of part stays open, so it can be continued. */
+int append_msa_store(struct msa* msa, struct msa* part)
+{
+        long int name_base;
+        long int res_base;
+        long int n;
+        int i;
+
+        RUN(close_msa_seq(msa));
+        while(msa->alloc_numseq < msa->numseq + part->numseq){
+                RUN(resize_msa(msa));
+        }
+        name_base = msa->names.used;
+        res_base = msa->residues.used;
+        if(!res_base){
+                msa->encoded = part->encoded;
+        }
+
+        RUN(arena_reserve(&msa->names, part->names.used));
+        memcpy(msa->names.data + name_base, part->names.data, part->names.used);
+        msa->names.used += part->names.used;
+
+        RUN(arena_reserve(&msa->residues, part->residues.used));
+        memcpy(msa->residues.data + res_base, part->residues.data, part->residues.used);
+        msa->residues.used += part->residues.used;
+
+        if(msa->encoded != -1 && part->encoded == msa->encoded){
+                if(msa->internal.alloc < res_base + part->internal.used){
+                        MREALLOC(msa->internal.data, sizeof(uint8_t) * msa->residues.alloc);
+                        msa->internal.alloc = msa->residues.alloc;
+                }
+                memcpy(msa->internal.data + res_base, part->internal.data, part->internal.used);
+                msa->internal.used = res_base + part->internal.used;
+        }else{
+                msa->encoded = -1;
+        }
+
+        if(part->gap_counts.used){
+                n = sizeof(int) * res_base + part->gap_counts.used;
+                RUN(arena_reserve(&msa->gap_counts, n - msa->gap_counts.used));
+                memset(msa->gap_counts.data + msa->gap_counts.used, 0, sizeof(int) * res_base - msa->gap_counts.used);
+                memcpy(msa->gap_counts.data + sizeof(int) * res_base, part->gap_counts.data, part->gap_counts.used);
+                msa->gap_counts.used = n;
+        }
+
+        for(i = 0; i < part->numseq;i++){
+                msa->seq_store[msa->numseq] = part->seq_store[i];
+                msa->name_off[msa->numseq] = part->name_off[i] < 0 ? part->name_off[i] : part->name_off[i] + name_base;
+                msa->seq_off[msa->numseq] = part->seq_off[i] + res_base;
+                msa->numseq++;
+        }
+        for(i = 0; i < 128;i++){
+                msa->letter_freq[i] += part->letter_freq[i];
+        }
+        msa->filter.num_reads += part->filter.num_reads;
+        msa->filter.num_kept += part->filter.num_kept;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Called once a file is read: sizes the internal and gap arenas to
+   match the residues and points the records into the arenas. */
+int finish_msa_store(struct msa* msa)
+{
+        long int n;
+
+        RUN(close_msa_seq(msa));
+        if(msa->internal.alloc < msa->residues.used){
+                MREALLOC(msa->internal.data, sizeof(uint8_t) * msa->residues.used);
+                msa->internal.alloc = msa->residues.used;
+        }
+        msa->internal.used = msa->residues.used;
+        if(msa->gap_counts.data){
+                n = sizeof(int) * msa->residues.used;
+                if(msa->gap_counts.used < n){
+                        RUN(arena_reserve(&msa->gap_counts, n - msa->gap_counts.used));
+                        memset(msa->gap_counts.data + msa->gap_counts.used, 0, n - msa->gap_counts.used);
+                        msa->gap_counts.used = n;
+                }
+        }
+        RUN(set_msa_seq_views(msa));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int set_msa_seq_views(struct msa* msa)
+{
+        struct msa_seq* seq = NULL;
+        int i;
+
+        for(i = 0; i < msa->numseq;i++){
+                seq = msa->seq_store + i;
+                seq->name = NULL;
+                if(msa->name_off[i] >= 0){
+                        seq->name = msa->names.data + msa->name_off[i];
+                }
+                seq->seq = msa->residues.data + msa->seq_off[i];
+                seq->s = (uint8_t*) msa->internal.data + msa->seq_off[i];
+                seq->gaps = NULL;
+                if(msa->gap_counts.data){
+                        seq->gaps = (int*) msa->gap_counts.data + msa->seq_off[i];
+                }
+                msa->sequences[i] = seq;
+        }
+        return OK;
+}
+
+struct name_reader* open_name_reader(struct msa* msa)
+{
+        struct name_reader* nr = NULL;
+        int i;
 
-        MMALLOC(seq->seq, sizeof(char) * seq->alloc_len);
-        MMALLOC(seq->s, sizeof(uint8_t) * seq->alloc_len);
-        MMALLOC(seq->gaps, sizeof(int) * (seq->alloc_len+1));
-        for(i =0;i < seq->alloc_len+1;i++){
-                seq->gaps[i] = 0;
+        MMALLOC(nr, sizeof(struct name_reader));
+        nr->fd = NULL;
+        nr->buf = NULL;
+        nr->span = NULL;
+        nr->pos = NULL;
+        nr->num_fd = msa->num_name_src;
+        nr->alloc = 0;
+        nr->alloc_span = 0;
+        nr->alloc_pos = 0;
+        if(nr->num_fd){
+                MMALLOC(nr->fd, sizeof(int) * nr->num_fd);
+                for(i = 0; i < nr->num_fd;i++){
+                        nr->fd[i] = -1;
+                }
         }
-        return seq;
+        return nr;
 ERROR:
-        free_msa_seq(seq);
+        close_name_reader(nr);
         return NULL;
 }
 
+/* Names are read in file order; names close to each other are read
+   with one pread of the span covering them. */
+int load_msa_names(struct name_reader* nr, struct msa* msa, struct msa_seq** seq, int n)
+{
+        struct name_pos* np = NULL;
+        long int used;
+        long int from;
+        long int to;
+        long int o;
+        int num;
+        int f;
+        int i,j,c;
+
+        if(!msa->name_src){
+                return OK;
+        }
+        if(n > nr->alloc_pos){
+                nr->alloc_pos = n;
+                MREALLOC(nr->pos, sizeof(struct name_pos) * nr->alloc_pos);
+        }
+        np = nr->pos;
+        num = 0;
+        used = 0;
+        for(i = 0; i < n;i++){
+                o = msa->name_off[seq[i] - msa->seq_store];
+                if(o < 0){
+                        np[num].off = -o - 1;
+                        np[num].file = seq[i]->sample;
+                        np[num].len = seq[i]->name_len - 1;
+                        np[num].id = i;
+                        used += seq[i]->name_len;
+                        num++;
+                }
+        }
+        if(!num){
+                return OK;
+        }
+        if(used > nr->alloc){
+                nr->alloc = used;
+                MREALLOC(nr->buf, sizeof(char) * nr->alloc);
+        }
+        qsort(np, num, sizeof(struct name_pos), compare_name_pos);
+
+        used = 0;
+        for(i = 0; i < num;i = j){
+                f = np[i].file;
+                from = np[i].off;
+                to = from + np[i].len;
+                for(j = i + 1; j < num;j++){
+                        if(np[j].file != f || np[j].off - to > NAME_READ_GAP || np[j].off + np[j].len - from > NAME_READ_SPAN){
+                                break;
+                        }
+                        to = MACRO_MAX(to, np[j].off + np[j].len);
+                }
+                if(to - from > nr->alloc_span){
+                        nr->alloc_span = to - from;
+                        MREALLOC(nr->span, sizeof(char) * nr->alloc_span);
+                }
+#ifdef RWALIGN_MMAP
+                if(nr->fd[f] == -1){
+                        if((nr->fd[f] = open(msa->name_src[f], O_RDONLY)) == -1){
+                                ERROR_MSG("Could not open %s to read the names back.", msa->name_src[f]);
+                        }
+                }
+                for(o = 0; o < to - from;o += c){
+                        c = pread(nr->fd[f], nr->span + o, to - from - o, from + o);
+                        if(c <= 0){
+                                ERROR_MSG("Could not read the names back from %s.", msa->name_src[f]);
+                        }
+                }
+#else
+                ERROR_MSG("Names can not be read back from %s.", msa->name_src[f]);
+#endif
+                for(c = i; c < j;c++){
+                        memcpy(nr->buf + used, nr->span + (np[c].off - from), np[c].len);
+                        nr->buf[used + np[c].len] = 0;
+                        seq[np[c].id]->name = nr->buf + used;
+                        used += np[c].len + 1;
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void unload_msa_names(struct msa* msa, struct msa_seq** seq, int n)
+{
+        int i;
+
+        for(i = 0; i < n;i++){
+                if(msa->name_off[seq[i] - msa->seq_store] < 0){
+                        seq[i]->name = NULL;
+                }
+        }
+}
 
-int resize_msa_seq(struct msa_seq* seq)
+void close_name_reader(struct name_reader* nr)
 {
-        int old_len;
         int i;
-        old_len = seq->alloc_len;
-        seq->alloc_len = seq->alloc_len + 512;
 
-        MREALLOC(seq->seq, sizeof(char) * seq->alloc_len);
-        MREALLOC(seq->s, sizeof(uint8_t) * seq->alloc_len);
-        MREALLOC(seq->gaps, sizeof(int) * (seq->alloc_len+1));
+        if(nr){
+                if(nr->fd){
+                        for(i = 0; i < nr->num_fd;i++){
+#ifdef RWALIGN_MMAP
+                                if(nr->fd[i] != -1){
+                                        close(nr->fd[i]);
+                                }
+#endif
+                        }
+                        MFREE(nr->fd);
+                }
+                if(nr->buf){
+                        MFREE(nr->buf);
+                }
+                if(nr->span){
+                        MFREE(nr->span);
+                }
+                if(nr->pos){
+                        MFREE(nr->pos);
+                }
+                MFREE(nr);
+        }
+}
+
+int compare_name_pos(const void *a, const void *b)
+{
+        const struct name_pos* pa = (const struct name_pos*) a;
+        const struct name_pos* pb = (const struct name_pos*) b;
+
+        if(pa->file != pb->file){
+                return pa->file - pb->file;
+        }
+        if(pa->off != pb->off){
+                return pa->off < pb->off ? -1 : 1;
+        }
+        return 0;
+}
+
+int stage_residue(struct seq_stage* st, char c)
+{
+        int old;
+        int i;
+        if(st->alloc_len == st->len){
+                old = st->gaps ? st->alloc_len + 1 : 0;
+                st->alloc_len = MACRO_MAX(st->alloc_len << 1, 256);
+                MREALLOC(st->seq, sizeof(char) * st->alloc_len);
+                MREALLOC(st->gaps, sizeof(int) * (st->alloc_len + 1));
+                for(i = old; i < st->alloc_len + 1;i++){
+                        st->gaps[i] = 0;
+                }
+        }
+        st->seq[st->len] = c;
+        st->len++;
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-        for(i = old_len;i < seq->alloc_len+1;i++){
-                seq->gaps[i] = 0;
+int stage_gap(struct seq_stage* st)
+{
+        if(!st->gaps){
+                MMALLOC(st->gaps, sizeof(int) * (st->alloc_len + 1));
+                memset(st->gaps, 0, sizeof(int) * (st->alloc_len + 1));
         }
+        st->gaps[st->len]++;
+        st->num_gaps++;
+        return OK;
+ERROR:
+        return FAIL;
+}
 
+int resize_stages(struct seq_stage** stages, int* alloc, int n)
+{
+        struct seq_stage* st = NULL;
+        int old;
+        int i;
+
+        old = *alloc;
+        if(n <= old){
+                return OK;
+        }
+        *alloc = MACRO_MAX(old << 1, n);
+        st = *stages;
+        MREALLOC(st, sizeof(struct seq_stage) * *alloc);
+        *stages = st;
+        for(i = old; i < *alloc;i++){
+                st[i].name = NULL;
+                st[i].seq = NULL;
+                st[i].gaps = NULL;
+                st[i].len = 0;
+                st[i].alloc_len = 0;
+                st[i].num_gaps = 0;
+                MMALLOC(st[i].name, sizeof(char) * MSA_NAME_LEN);
+                st[i].name[0] = 0;
+        }
         return OK;
 ERROR:
         return FAIL;
 }
 
-void free_msa_seq(struct msa_seq* seq)
+int commit_stages(struct msa* msa, struct seq_stage* stages, int n)
 {
-        if(seq){
+        struct seq_stage* st = NULL;
+        int i,j;
+
+        for(i = 0; i < n;i++){
+                st = stages + i;
+                RUN(add_msa_seq(msa, st->name, strlen(st->name)));
+                for(j = 0; j < st->len;j++){
+                        if(st->num_gaps && st->gaps[j]){
+                                RUN(add_msa_gaps(msa, st->gaps[j]));
+                        }
+                        RUN(add_msa_residue(msa, st->seq[j]));
+                }
+                if(st->num_gaps && st->gaps[st->len]){
+                        RUN(add_msa_gaps(msa, st->gaps[st->len]));
+                }
+        }
+        RUN(close_msa_seq(msa));
+        return OK;
+ERROR:
+        return FAIL;
+}
 
-                MFREE(seq->name);
-                MFREE(seq->seq);
-                MFREE(seq->s);
-                MFREE(seq->gaps);
-                MFREE(seq);
+void free_stages(struct seq_stage* stages, int alloc)
+{
+        int i;
+        if(stages){
+                for(i = 0; i < alloc;i++){
+                        if(stages[i].name){
+                                MFREE(stages[i].name);
+                        }
+                        if(stages[i].seq){
+                                MFREE(stages[i].seq);
+                        }
+                        if(stages[i].gaps){
+                                MFREE(stages[i].gaps);
+                        }
+                }
+                MFREE(stages);
         }
 }
 
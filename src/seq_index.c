@@ -0,0 +1,848 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "seq_index.h"
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#ifdef SEQ_INDEX_TEST
+#include "rng.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+static int build_qgram_index(struct seq_index* si, int k);
+static int length_candidates(struct seq_index* si, int len, int k, int* out, int* num_out);
+static int qgram_candidates(struct seq_index* si, const uint8_t* s, int len, int k, int* out, int* num_out);
+static inline int qgram_code(const uint8_t* s, int q);
+
+static int build_deletion_index(struct seq_index* si, int k);
+static int deletion_candidates(struct seq_index* si, const uint8_t* s, int len, int k, int* out, int* num_out);
+static long int num_deletion_variants(int len, int k);
+static int deletion_variants(const uint8_t* s, int len, int start, int k, uint8_t* buf, int stride, uint64_t* keys, int n);
+static inline uint64_t variant_hash(const uint8_t* s, int len);
+static double memory_budget(void);
+
+static int compare_int(const void *a, const void *b);
+static int compare_key(const void *a, const void *b);
+
+#ifdef SEQ_INDEX_TEST
+#define TEST_NUMSEQ 600
+#define TEST_MAX_LEN 48
+
+static int check_index(struct msa* msa, int k, int type);
+static int ref_global(const uint8_t* a, int n, const uint8_t* b, int m);
+static int mutate(const uint8_t* s, int len, uint8_t* out, int edits, struct rng_state* rng);
+
+/* Families of sequences a few edits apart, plus short ones that are
+   below the q-gram limit. Every index has to report each live sequence
+   within k edits of a seed, live sequences only, in increasing index
+   order; the length buckets exactly the live sequences within k in
+   length. Seeds are taken and their hits removed as in the greedy
+   clustering. */
+int main(int argc, char *argv[])
+{
+        struct msa* msa = NULL;
+        struct rng_state* rng = NULL;
+        uint8_t* res = NULL;
+        int types[3] = {SEQNET_INDEX_LENGTH, SEQNET_INDEX_QGRAM, SEQNET_INDEX_DELETION};
+        int base;
+        int len;
+        int i,j,k;
+
+        RUNP(rng = init_rng(42));
+        RUNP(msa = alloc_msa());
+        while(msa->alloc_numseq < TEST_NUMSEQ){
+                RUN(resize_msa(msa));
+        }
+        MMALLOC(res, sizeof(uint8_t) * TEST_NUMSEQ * TEST_MAX_LEN);
+        base = 0;
+        for(i = 0; i < TEST_NUMSEQ;i++){
+                if(!(i % 12)){
+                        base = i;
+                        len = tl_random_int(rng, 4) ? 24 + tl_random_int(rng, 12) : 6 + tl_random_int(rng, 8);
+                        for(j = 0; j < len;j++){
+                                res[i * TEST_MAX_LEN + j] = tl_random_int(rng, 4);
+                        }
+                }else{
+                        len = mutate(res + base * TEST_MAX_LEN, msa->seq_store[base].len, res + i * TEST_MAX_LEN, tl_random_int(rng, 5), rng);
+                }
+                msa->seq_store[i].s = res + i * TEST_MAX_LEN;
+                msa->seq_store[i].len = len;
+                msa->sequences[i] = msa->seq_store + i;
+        }
+        msa->numseq = TEST_NUMSEQ;
+
+        for(i = 0; i < 3;i++){
+                for(k = 0; k <= 3;k++){
+                        RUN(check_index(msa, k, types[i]));
+                }
+        }
+        msa->numseq = 0;
+        free_msa(msa);
+        MFREE(res);
+        MFREE(rng);
+        return EXIT_SUCCESS;
+ERROR:
+        return EXIT_FAILURE;
+}
+
+int check_index(struct msa* msa, int k, int type)
+{
+        struct seq_index* si = NULL;
+        int* out = NULL;
+        int* hit = NULL;
+        int* live = NULL;
+        int num_out;
+        int num_seeds;
+        int seed;
+        int d;
+        int i,j;
+
+        RUNP(si = build_seq_index(msa, k, type));
+        MMALLOC(out, sizeof(int) * msa->numseq);
+        MMALLOC(hit, sizeof(int) * msa->numseq);
+        MMALLOC(live, sizeof(int) * msa->numseq);
+        for(i = 0; i < msa->numseq;i++){
+                live[i] = 1;
+        }
+        num_seeds = 0;
+        for(seed = 0; seed < msa->numseq;seed++){
+                if(!live[seed]){
+                        continue;
+                }
+                RUN(seq_index_candidates(si, msa->sequences[seed]->s, msa->sequences[seed]->len, k, out, &num_out));
+                for(i = 0; i < msa->numseq;i++){
+                        hit[i] = 0;
+                }
+                for(j = 0; j < num_out;j++){
+                        i = out[j];
+                        ASSERT(i >= 0 && i < msa->numseq && live[i], "Index %d k %d: candidate %d is not live.", type, k, i);
+                        ASSERT(!j || out[j-1] < i, "Index %d k %d: candidates out of order.", type, k);
+                        hit[i] = 1;
+                }
+                for(i = 0; i < msa->numseq;i++){
+                        if(!live[i]){
+                                continue;
+                        }
+                        if(type == SEQNET_INDEX_LENGTH){
+                                ASSERT(hit[i] == (abs(msa->sequences[i]->len - msa->sequences[seed]->len) <= k), "Length index k %d: sequence %d wrongly %s.", k, i, hit[i] ? "reported" : "missed");
+                        }
+                        d = ref_global(msa->sequences[seed]->s, msa->sequences[seed]->len, msa->sequences[i]->s, msa->sequences[i]->len);
+                        ASSERT(d > k || hit[i], "Index %d k %d: seed %d missed %d at distance %d.", type, k, seed, i, d);
+                        /* the cluster leaves the index */
+                        if(d <= k){
+                                live[i] = 0;
+                                RUN(seq_index_remove(si, i));
+                        }
+                }
+                ASSERT(!live[seed], "Seed %d not in its own cluster.", seed);
+                num_seeds++;
+        }
+        ASSERT(si->live == 0, "%d sequences left in the index.", si->live);
+        LOG_MSG("Index %d (type %d), k %d: %d seeds OK.", si->type, type, k, num_seeds);
+        free_seq_index(si);
+        MFREE(out);
+        MFREE(hit);
+        MFREE(live);
+        return OK;
+ERROR:
+        free_seq_index(si);
+        if(out){
+                MFREE(out);
+        }
+        if(hit){
+                MFREE(hit);
+        }
+        if(live){
+                MFREE(live);
+        }
+        return FAIL;
+}
+
+/* global edit distance by dynamic programming */
+int ref_global(const uint8_t* a, int n, const uint8_t* b, int m)
+{
+        int prev[TEST_MAX_LEN + 1];
+        int cur[TEST_MAX_LEN + 1];
+        int i,j;
+
+        for(j = 0; j <= m;j++){
+                prev[j] = j;
+        }
+        for(i = 1; i <= n;i++){
+                cur[0] = i;
+                for(j = 1; j <= m;j++){
+                        cur[j] = prev[j-1] + (a[i-1] != b[j-1]);
+                        cur[j] = MACRO_MIN(cur[j], prev[j] + 1);
+                        cur[j] = MACRO_MIN(cur[j], cur[j-1] + 1);
+                }
+                for(j = 0; j <= m;j++){
+                        prev[j] = cur[j];
+                }
+        }
+        return prev[m];
+}
+
+/* random substitutions, insertions and deletions; returns the length */
+int mutate(const uint8_t* s, int len, uint8_t* out, int edits, struct rng_state* rng)
+{
+        int p;
+        int e;
+
+        memcpy(out, s, len);
+        for(e = 0; e < edits;e++){
+                p = tl_random_int(rng, len);
+                switch(tl_random_int(rng, 3)){
+                case 0:
+                        out[p] = tl_random_int(rng, 4);
+                        break;
+                case 1:
+                        if(len < TEST_MAX_LEN){
+                                memmove(out + p + 1, out + p, len - p);
+                                out[p] = tl_random_int(rng, 4);
+                                len++;
+                        }
+                        break;
+                default:
+                        if(len > 2){
+                                memmove(out + p, out + p + 1, len - p - 1);
+                                len--;
+                        }
+                        break;
+                }
+        }
+        return len;
+}
+#endif
+
+struct seq_index* build_seq_index(struct msa* msa, int k, int type)
+{
+        struct seq_index* si = NULL;
+        int i;
+        int l;
+
+        MMALLOC(si, sizeof(struct seq_index));
+        si->bucket = NULL;
+        si->num = NULL;
+        si->pos = NULL;
+        si->len = NULL;
+        si->s = NULL;
+        si->q_offset = NULL;
+        si->q_num = NULL;
+        si->q_list = NULL;
+        si->del = NULL;
+        si->del_buf = NULL;
+        si->del_var = NULL;
+        si->num_del = 0;
+        si->mark = NULL;
+        si->stamp = 0;
+        si->q = 0;
+        si->type = SEQNET_INDEX_LENGTH;
+        si->k = k;
+        si->numseq = msa->numseq;
+        si->live = msa->numseq;
+        si->max_len = 0;
+
+        for(i = 0; i < msa->numseq;i++){
+                si->max_len = MACRO_MAX(si->max_len, msa->sequences[i]->len);
+        }
+
+        MMALLOC(si->pos, sizeof(int) * si->numseq);
+        MMALLOC(si->len, sizeof(int) * si->numseq);
+        MMALLOC(si->s, sizeof(uint8_t*) * si->numseq);
+        MMALLOC(si->num, sizeof(int) * (si->max_len + 1));
+        MMALLOC(si->bucket, sizeof(int*) * (si->max_len + 1));
+        for(l = 0; l <= si->max_len;l++){
+                si->bucket[l] = NULL;
+                si->num[l] = 0;
+        }
+        for(i = 0; i < msa->numseq;i++){
+                si->len[i] = msa->sequences[i]->len;
+                si->s[i] = msa->sequences[i]->s;
+                si->num[si->len[i]]++;
+        }
+        for(l = 0; l <= si->max_len;l++){
+                if(si->num[l]){
+                        MMALLOC(si->bucket[l], sizeof(int) * si->num[l]);
+                }
+                si->num[l] = 0;
+        }
+        for(i = 0; i < msa->numseq;i++){
+                l = si->len[i];
+                si->pos[i] = si->num[l];
+                si->bucket[l][si->num[l]] = i;
+                si->num[l]++;
+        }
+
+        if(si->numseq && k >= 0){
+                MMALLOC(si->mark, sizeof(int) * si->numseq);
+                for(i = 0; i < si->numseq;i++){
+                        si->mark[i] = 0;
+                }
+                if(type == SEQNET_INDEX_QGRAM){
+                        RUN(build_qgram_index(si, k));
+                }else if(type == SEQNET_INDEX_DELETION){
+                        RUN(build_deletion_index(si, k));
+                        /* too large for this threshold */
+                        if(si->type != SEQNET_INDEX_DELETION){
+                                RUN(build_qgram_index(si, k));
+                        }
+                }
+        }
+        return si;
+ERROR:
+        free_seq_index(si);
+        return NULL;
+}
+
+/* q is chosen so that the typical (median length) seed can be cut into
+   k+1 segments of at least q residues. */
+int build_qgram_index(struct seq_index* si, int k)
+{
+        int* last = NULL;
+        int num_codes;
+        int total;
+        int median;
+        int code;
+        int i,j,l;
+        int q;
+
+        median = 0;
+        total = 0;
+        for(l = 0; l <= si->max_len;l++){
+                total += si->num[l];
+                if(total * 2 >= si->numseq){
+                        median = l;
+                        break;
+                }
+        }
+        q = MACRO_MIN(SEQ_INDEX_MAX_Q, median / (k + 1));
+        if(q < 2){
+                LOG_MSG("Sequences too short for a q-gram index at %d edits; using length buckets only.", k);
+                return OK;
+        }
+        si->q = q;
+        si->type = SEQNET_INDEX_QGRAM;
+        num_codes = 1 << (5 * q);
+
+        MMALLOC(si->q_offset, sizeof(int) * (num_codes + 1));
+        MMALLOC(si->q_num, sizeof(int) * num_codes);
+        MMALLOC(last, sizeof(int) * num_codes);
+        for(i = 0; i < num_codes;i++){
+                si->q_num[i] = 0;
+                last[i] = -1;
+        }
+        /* each sequence is listed once per distinct q-gram  */
+        total = 0;
+        for(i = 0; i < si->numseq;i++){
+                for(j = 0; j + q <= si->len[i];j++){
+                        code = qgram_code(si->s[i] + j, q);
+                        if(last[code] != i){
+                                last[code] = i;
+                                si->q_num[code]++;
+                                total++;
+                        }
+                }
+        }
+        si->q_offset[0] = 0;
+        for(i = 0; i < num_codes;i++){
+                si->q_offset[i+1] = si->q_offset[i] + si->q_num[i];
+                si->q_num[i] = 0;
+                last[i] = -1;
+        }
+        MMALLOC(si->q_list, sizeof(int) * MACRO_MAX(1, total));
+        for(i = 0; i < si->numseq;i++){
+                for(j = 0; j + q <= si->len[i];j++){
+                        code = qgram_code(si->s[i] + j, q);
+                        if(last[code] != i){
+                                last[code] = i;
+                                si->q_list[si->q_offset[code] + si->q_num[code]] = i;
+                                si->q_num[code]++;
+                        }
+                }
+        }
+        MFREE(last);
+        LOG_MSG("Built %d-gram index with %d postings.", q, total);
+        return OK;
+ERROR:
+        if(last){
+                MFREE(last);
+        }
+        return FAIL;
+}
+
+int build_deletion_index(struct seq_index* si, int k)
+{
+        long int* offset = NULL;
+        int* num = NULL;
+        uint8_t* buf = NULL;
+        uint64_t* keys = NULL;
+        long int max_var;
+        long int total;
+        long int n;
+        double mb;
+        int i;
+        int c;
+        int t;
+        int nthreads = 1;
+
+        MMALLOC(offset, sizeof(long int) * (si->numseq + 1));
+        MMALLOC(num, sizeof(int) * si->numseq);
+        offset[0] = 0;
+        for(i = 0; i < si->numseq;i++){
+                offset[i+1] = offset[i] + num_deletion_variants(si->len[i], k);
+        }
+        total = offset[si->numseq];
+#ifdef HAVE_OPENMP
+        nthreads = omp_get_max_threads();
+#endif
+        /* the keys plus, per build thread and for the seed queries, the
+           variants of one sequence and one buffer per recursion level */
+        max_var = num_deletion_variants(si->max_len, k);
+        mb = (double) total * sizeof(struct seq_index_key);
+        mb += (double) (nthreads + 1) * ((double) max_var * sizeof(uint64_t) + (double) (si->max_len + 1) * (k + 1));
+        mb /= 1048576.0;
+        LOG_MSG("Deletion index: at most %ld keys (%0.1f MB).", total, mb);
+        if(total > INT32_MAX || max_var > INT32_MAX || (memory_budget() > 0.0 && mb > memory_budget())){
+                LOG_MSG("Deletion index too large for %d edits; using a q-gram index instead.", k);
+                MFREE(offset);
+                MFREE(num);
+                return OK;
+        }
+        si->type = SEQNET_INDEX_DELETION;
+        si->num_del = total;
+
+        MMALLOC(si->del, sizeof(struct seq_index_key) * MACRO_MAX(1, total));
+        MMALLOC(si->del_buf, sizeof(uint64_t) * max_var);
+        MMALLOC(si->del_var, sizeof(uint8_t) * (si->max_len + 1) * (k + 1));
+        /* per thread: one variant buffer per recursion level and the
+           keys of one sequence */
+        MMALLOC(buf, sizeof(uint8_t) * (si->max_len + 1) * (k + 1) * nthreads);
+        MMALLOC(keys, sizeof(uint64_t) * max_var * nthreads);
+
+#ifdef HAVE_OPENMP
+#pragma omp parallel for shared(si, offset, num, buf, keys, max_var, k) private(i, c, t, n) schedule(dynamic,256)
+#endif
+        for(i = 0; i < si->numseq;i++){
+                t = 0;
+#ifdef HAVE_OPENMP
+                t = omp_get_thread_num();
+#endif
+                n = deletion_variants(si->s[i], si->len[i], 0, k, buf + (long int) t * (si->max_len + 1) * (k + 1), si->max_len + 1, keys + t * max_var, 0);
+                num[i] = n;
+                for(c = 0; c < n;c++){
+                        si->del[offset[i] + c].key = keys[t * max_var + c];
+                        si->del[offset[i] + c].id = i;
+                }
+        }
+        /* close the gaps left by repeated residues */
+        n = 0;
+        for(i = 0; i < si->numseq;i++){
+                for(c = 0; c < num[i];c++){
+                        si->del[n] = si->del[offset[i] + c];
+                        n++;
+                }
+        }
+        qsort(si->del, n, sizeof(struct seq_index_key), compare_key);
+        /* a sequence can produce the same variant more than once */
+        total = n;
+        n = 0;
+        for(i = 0; i < total;i++){
+                if(n && si->del[n-1].key == si->del[i].key && si->del[n-1].id == si->del[i].id){
+                        continue;
+                }
+                si->del[n] = si->del[i];
+                n++;
+        }
+        si->num_del = n;
+        LOG_MSG("Built deletion index with %ld keys.", n);
+        MFREE(buf);
+        MFREE(keys);
+        MFREE(offset);
+        MFREE(num);
+        return OK;
+ERROR:
+        if(buf){
+                MFREE(buf);
+        }
+        if(keys){
+                MFREE(keys);
+        }
+        if(offset){
+                MFREE(offset);
+        }
+        if(num){
+                MFREE(num);
+        }
+        return FAIL;
+}
+
+int deletion_candidates(struct seq_index* si, const uint8_t* s, int len, int k, int* out, int* num_out)
+{
+        long int lo,hi,mid;
+        uint64_t key;
+        int num_keys;
+        int i,j;
+        int n;
+
+        num_keys = deletion_variants(s, len, 0, k, si->del_var, si->max_len + 1, si->del_buf, 0);
+
+        si->stamp++;
+        n = 0;
+        for(j = 0; j < num_keys;j++){
+                key = si->del_buf[j];
+                lo = 0;
+                hi = si->num_del;
+                while(lo < hi){
+                        mid = (lo + hi) / 2;
+                        if(si->del[mid].key < key){
+                                lo = mid + 1;
+                        }else{
+                                hi = mid;
+                        }
+                }
+                for(; lo < si->num_del && si->del[lo].key == key;lo++){
+                        i = si->del[lo].id;
+                        if(si->pos[i] != -1 && si->mark[i] != si->stamp && abs(si->len[i] - len) <= k){
+                                si->mark[i] = si->stamp;
+                                out[n] = i;
+                                n++;
+                        }
+                }
+        }
+        *num_out = n;
+        return OK;
+}
+
+long int num_deletion_variants(int len, int k)
+{
+        long int total = 0;
+        long int c = 1;
+        int d;
+        /* sum of binomial(len, d) for d = 0..k */
+        for(d = 0; d <= MACRO_MIN(k, len);d++){
+                total += c;
+                /* more than any index can hold; keeps c from overflowing */
+                if(total > INT32_MAX){
+                        return (long int) INT32_MAX + 1;
+                }
+                c = c * (len - d) / (d + 1);
+        }
+        return total;
+}
+
+/* Writes the hashes of s and of all variants with up to k deletions
+   at positions >= start to keys[n..]; returns the new n. Deleting
+   either of two identical neighbouring residues gives the same string,
+   so only the first of a run is deleted. buf holds k levels of stride
+   bytes. */
+int deletion_variants(const uint8_t* s, int len, int start, int k, uint8_t* buf, int stride, uint64_t* keys, int n)
+{
+        int i;
+
+        keys[n] = variant_hash(s, len);
+        n++;
+        if(!k){
+                return n;
+        }
+        for(i = start; i < len;i++){
+                if(i > start && s[i] == s[i-1]){
+                        continue;
+                }
+                memcpy(buf, s, i);
+                memcpy(buf + i, s + i + 1, len - i - 1);
+                n = deletion_variants(buf, len - 1, i, k - 1, buf + stride, stride, keys, n);
+        }
+        return n;
+}
+
+/* Half the physical memory in MB; 0 if it can not be found out. */
+double memory_budget(void)
+{
+#if defined(HAVE_UNISTD_H) && defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+        long int pages = sysconf(_SC_PHYS_PAGES);
+        long int size = sysconf(_SC_PAGESIZE);
+        if(pages > 0 && size > 0){
+                return (double) pages * (double) size / 2097152.0;
+        }
+#endif
+        return 0.0;
+}
+
+/* FNV-1a  */
+uint64_t variant_hash(const uint8_t* s, int len)
+{
+        uint64_t h = 0xcbf29ce484222325ul;
+        int i;
+        for(i = 0; i < len;i++){
+                h ^= s[i];
+                h *= 0x100000001b3ul;
+        }
+        h ^= (uint64_t) len;
+        h *= 0x100000001b3ul;
+        return h;
+}
+
+int seq_index_remove(struct seq_index* si, int i)
+{
+        ASSERT(si != NULL, "No index");
+        ASSERT(i >= 0 && i < si->numseq, "Sequence %d out of range.", i);
+
+        if(si->pos[i] == -1){
+                return OK;
+        }
+        /* the length buckets and q-gram lists drop the sequence the
+           next time they are read */
+        si->pos[i] = -1;
+        si->live--;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int seq_index_candidates(struct seq_index* si, const uint8_t* s, int len, int k, int* out, int* num_out)
+{
+        int n;
+
+        ASSERT(si != NULL, "No index");
+
+        /* the seed buffers of the deletion index hold sequences up to max_len */
+        if(si->type == SEQNET_INDEX_DELETION && k <= si->k && len <= si->max_len){
+                RUN(deletion_candidates(si, s, len, k, out, &n));
+                /* hits come in lookup order */
+                qsort(out, n, sizeof(int), compare_int);
+        }else if(si->type == SEQNET_INDEX_QGRAM && len >= si->q * (k + 1)){
+                RUN(qgram_candidates(si, s, len, k, out, &n));
+                qsort(out, n, sizeof(int), compare_int);
+        }else{
+                RUN(length_candidates(si, len, k, out, &n));
+        }
+        *num_out = n;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Purges the buckets within k of len and merges them; each bucket is
+   in index order, so the result is too. */
+int length_candidates(struct seq_index* si, int len, int k, int* out, int* num_out)
+{
+        int* head = NULL;
+        int* active = NULL;
+        int num_active;
+        int lo,hi;
+        int best;
+        int l,a;
+        int i,j;
+        int c;
+        int n;
+
+        lo = MACRO_MAX(0, len - k);
+        hi = MACRO_MIN(si->max_len, len + k);
+        n = 0;
+        if(lo > hi){
+                *num_out = 0;
+                return OK;
+        }
+        MMALLOC(head, sizeof(int) * (hi - lo + 1));
+        MMALLOC(active, sizeof(int) * (hi - lo + 1));
+        num_active = 0;
+        for(l = lo; l <= hi;l++){
+                c = 0;
+                for(j = 0; j < si->num[l];j++){
+                        i = si->bucket[l][j];
+                        if(si->pos[i] != -1){
+                                si->bucket[l][c] = i;
+                                c++;
+                        }
+                }
+                si->num[l] = c;
+                head[l - lo] = 0;
+                if(c){
+                        active[num_active] = l;
+                        num_active++;
+                }
+        }
+        /* merge until one bucket is left, then copy the rest of it */
+        while(num_active > 1){
+                best = 0;
+                for(a = 1; a < num_active;a++){
+                        if(si->bucket[active[a]][head[active[a] - lo]] < si->bucket[active[best]][head[active[best] - lo]]){
+                                best = a;
+                        }
+                }
+                l = active[best];
+                out[n] = si->bucket[l][head[l - lo]];
+                n++;
+                head[l - lo]++;
+                if(head[l - lo] == si->num[l]){
+                        num_active--;
+                        active[best] = active[num_active];
+                }
+        }
+        if(num_active){
+                l = active[0];
+                for(j = head[l - lo]; j < si->num[l];j++){
+                        out[n] = si->bucket[l][j];
+                        n++;
+                }
+        }
+        MFREE(head);
+        MFREE(active);
+        *num_out = n;
+        return OK;
+ERROR:
+        if(head){
+                MFREE(head);
+        }
+        if(active){
+                MFREE(active);
+        }
+        return FAIL;
+}
+
+int qgram_candidates(struct seq_index* si, const uint8_t* s, int len, int k, int* out, int* num_out)
+{
+        int* list;
+        int seg_len;
+        int start;
+        int end;
+        int best;
+        int code;
+        int seg;
+        int i,j;
+        int c;
+        int n;
+
+        si->stamp++;
+        seg_len = len / (k + 1);
+        n = 0;
+        for(seg = 0; seg <= k;seg++){
+                start = seg * seg_len;
+                end = (seg == k) ? len : start + seg_len;
+                /* pick the rarest q-gram of the segment */
+                best = -1;
+                for(j = start; j + si->q <= end;j++){
+                        code = qgram_code(s + j, si->q);
+                        if(best == -1 || si->q_num[code] < si->q_num[best]){
+                                best = code;
+                        }
+                }
+                list = si->q_list + si->q_offset[best];
+                c = 0;
+                for(j = 0; j < si->q_num[best];j++){
+                        i = list[j];
+                        if(si->pos[i] == -1){
+                                continue;
+                        }
+                        list[c] = i;
+                        c++;
+                        if(si->mark[i] != si->stamp && abs(si->len[i] - len) <= k){
+                                si->mark[i] = si->stamp;
+                                out[n] = i;
+                                n++;
+                        }
+                }
+                si->q_num[best] = c;
+        }
+        *num_out = n;
+        return OK;
+}
+
+void free_seq_index(struct seq_index* si)
+{
+        int l;
+        if(si){
+                if(si->bucket){
+                        for(l = 0; l <= si->max_len;l++){
+                                if(si->bucket[l]){
+                                        MFREE(si->bucket[l]);
+                                }
+                        }
+                        MFREE(si->bucket);
+                }
+                if(si->num){
+                        MFREE(si->num);
+                }
+                if(si->pos){
+                        MFREE(si->pos);
+                }
+                if(si->len){
+                        MFREE(si->len);
+                }
+                if(si->s){
+                        MFREE(si->s);
+                }
+                if(si->q_offset){
+                        MFREE(si->q_offset);
+                }
+                if(si->q_num){
+                        MFREE(si->q_num);
+                }
+                if(si->q_list){
+                        MFREE(si->q_list);
+                }
+                if(si->del){
+                        MFREE(si->del);
+                }
+                if(si->del_buf){
+                        MFREE(si->del_buf);
+                }
+                if(si->del_var){
+                        MFREE(si->del_var);
+                }
+                if(si->mark){
+                        MFREE(si->mark);
+                }
+                MFREE(si);
+        }
+}
+
+int qgram_code(const uint8_t* s, int q)
+{
+        int code = 0;
+        int i;
+        for(i = 0; i < q;i++){
+                code = (code << 5) | (s[i] & 0x1F);
+        }
+        return code;
+}
+
+int compare_int(const void *a, const void *b)
+{
+        return *(const int*)a - *(const int*)b;
+}
+
+int compare_key(const void *a, const void *b)
+{
+        const struct seq_index_key* ka = (const struct seq_index_key*) a;
+        const struct seq_index_key* kb = (const struct seq_index_key*) b;
+        if(ka->key != kb->key){
+                return ka->key < kb->key ? -1 : 1;
+        }
+        return ka->id - kb->id;
+}
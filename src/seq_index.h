@@ -0,0 +1,93 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SEQ_INDEX_H
+#define SEQ_INDEX_H
+
+#include "global.h"
+#include "msa.h"
+#include "parameters.h"
+
+/* largest q-gram used by the inverted index; residues are packed in 5
+   bits so the table has 1 << (5 * q) lists */
+#define SEQ_INDEX_MAX_Q 4
+
+/* Candidate index for the greedy clustering.
+
+   Sequences are bucketed by length; since the edit distance is at least
+   the length difference a seed only has to look at the buckets within
+   +/- threshold of its own length. The buckets are kept in index order:
+   clustered sequences are only flagged and dropped from a bucket the
+   next time it is read, and the buckets of a seed are merged.
+
+   On top of that an inverted q-gram index: if the seed is cut into k+1
+   non-overlapping segments any sequence within k edits contains one of
+   them verbatim, and hence every q-gram of that segment (pigeonhole).
+   For each segment the shortest posting list among its q-grams is read.
+   Posting lists are purged of clustered sequences while they are read,
+   so they shrink as clustering proceeds. Seeds shorter than q * (k+1)
+   fall back to the length buckets.
+
+   Alternatively a deletion neighbourhood index (SymSpell): every
+   sequence is hashed under all variants with up to k deletions. Two
+   sequences within k edits share at least one variant, so one lookup
+   per variant of the seed finds all hits. The number of variants grows
+   with len^k; only meant for small thresholds. If the keys would need
+   more than half the physical memory the q-gram index is built
+   instead. */
+struct seq_index_key{
+        uint64_t key;
+        int id;
+};
+
+struct seq_index{
+        int** bucket;           /* sequence indices per length */
+        int* num;               /* entries per bucket, removed ones included until the next read */
+        int* pos;               /* position of sequence i in its bucket at build time; -1 if removed */
+        int* len;
+        uint8_t** s;
+        int* q_offset;          /* start of each posting list in q_list */
+        int* q_num;             /* live entries per posting list */
+        int* q_list;
+        struct seq_index_key* del;      /* sorted (variant hash, sequence) pairs */
+        uint64_t* del_buf;      /* variants of the current seed */
+        uint8_t* del_var;       /* deletion levels of the current seed */
+        long int num_del;
+        int* mark;              /* last query that reported a sequence */
+        int stamp;
+        int q;
+        int type;
+        int k;
+        int max_len;
+        int numseq;
+        int live;
+};
+
+/* type is one of the SEQNET_INDEX_* constants in parameters.h  */
+extern struct seq_index* build_seq_index(struct msa* msa, int k, int type);
+extern int seq_index_remove(struct seq_index* si, int i);
+/* writes the live sequences that can be within k edits of s to out (at
+   least si->live entries) in increasing index order */
+extern int seq_index_candidates(struct seq_index* si, const uint8_t* s, int len, int k, int* out, int* num_out);
+extern void free_seq_index(struct seq_index* si);
+
+#endif
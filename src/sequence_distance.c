@@ -21,36 +21,22 @@
 
 */
 
-#include <xmmintrin.h>
 #include "sequence_distance.h"
 
 #include "alphabet.h"
 #include "bpm.h"
 
-#define NODESIZE 16
-
-
-/* small hash implementation */
-struct bignode{
-        struct bignode *next;
-        unsigned int pos[NODESIZE];
-        unsigned int num;
-};
-
-struct bignode* big_insert_hash(struct bignode *n,const unsigned int pos);
-void big_remove_nodes(struct bignode *n);
-void big_print_nodes(struct bignode *n);
-
-
-float calc_distance(uint8_t* seq_a, uint8_t* seq_b, int len_a,int len_b, int L);
-float dna_distance_calculation(struct bignode* hash[],const uint8_t * p,const int seqlen,int diagonals,float mode);
-float protein_wu_distance_calculation(struct bignode* hash[],const uint8_t* seq,const int seqlen,const int diagonals,const float mode);
+static struct bpm_soa* msa_to_soa(struct msa* msa);
 
+/* The seed of each row is compared against all samples in one batched
+   call; the longer sequence of each pair is used as the text. */
 float** d_estimation(struct msa* msa, int* samples, int num_samples,int pair)
 {
+        struct bpm_soa* soa = NULL;
+        uint8_t* d_sc = NULL;
+        uint8_t* d_cs = NULL;
         float** dm = NULL;
         uint8_t* seq_a;
-        uint8_t* seq_b;
 
         float dist;
 
@@ -58,9 +44,10 @@ float** d_estimation(struct msa* msa, int* samples, int num_samples,int pair)
         int len_b;
 
         int i,j;
-#if HAVE_AVX2
-        set_broadcast_mask();
-#endif
+
+        RUNP(soa = msa_to_soa(msa));
+        MMALLOC(d_sc, sizeof(uint8_t) * num_samples);
+        MMALLOC(d_cs, sizeof(uint8_t) * num_samples);
 
         if(pair){
 
@@ -69,27 +56,18 @@ float** d_estimation(struct msa* msa, int* samples, int num_samples,int pair)
 
                         seq_a = msa->sequences[samples[i]]->s;// aln->s[samples[i]];
                         len_a = msa->sequences[samples[i]]->len;//aln->sl[samples[i]];
+                        RUN(bpm_batch(seq_a, len_a, soa, samples, num_samples, -1, d_sc, d_cs));
                         for(j = 0;j < num_samples;j++){
-                                //fprintf(stdout, "Working on %d %d\n", i,j);
-
-                                seq_b = msa->sequences[samples[j]]->s; //aln->s[ samples[j]];
                                 len_b = msa->sequences[samples[j]]->len;//aln->sl[selection[j]];
-                                /*dm[i][j] = MACRO_MIN(len_a, len_b) - MACRO_MIN(
-                                  bpm_256(seq_a, seq_b, len_a, len_b),
-                                  bpm_256(seq_b, seq_a, len_b, len_a)
-                                  );*/
-                                dist = calc_distance(seq_a, seq_b, len_a, len_b,msa->L);
-
+                                dist = (float) (len_a > len_b ? d_sc[j] : d_cs[j]);
                                 dm[i][j] = dist;//*dist;
                                 dm[j][i] = dm[i][j];
                         }
-                        //fprintf(stdout,"\n");
                 }
         }else{
                 int a;
                 int numseq = msa->numseq;
                 MMALLOC(dm, sizeof(float*)* numseq);
-                //fprintf(stdout,"MASK: %lx\n", mask);
                 a = num_samples / 8;
                 if( num_samples%8){
                         a++;
@@ -98,7 +76,10 @@ float** d_estimation(struct msa* msa, int* samples, int num_samples,int pair)
 
                 for(i = 0; i < numseq;i++){
                         dm[i] = NULL;
-                        dm[i] = _mm_malloc(sizeof(float) * a,32);
+                        /* 32 byte aligned rows for the edist kernels */
+                        if(posix_memalign((void**) &dm[i], 32, sizeof(float) * a)){
+                                ERROR_MSG("posix_memalign failed.");
+                        }
                         for(j = 0; j < a;j++){
                                 dm[i][j] = 0.0f;
                         }
@@ -108,297 +89,41 @@ float** d_estimation(struct msa* msa, int* samples, int num_samples,int pair)
                 for(i = 0; i < numseq;i++){
                         seq_a = msa->sequences[i]->s;// aln->s[i];
                         len_a = msa->sequences[i]->len;//  aln->sl[i];
+                        RUN(bpm_batch(seq_a, len_a, soa, samples, num_samples, -1, d_sc, d_cs));
                         for(j = 0;j < num_samples;j++){
-                                seq_b = msa->sequences[samples[j]]->s;// aln->s[ seeds[j]];
                                 len_b = msa->sequences[samples[j]]->len;// aln->sl[seeds[j]];
-
-                                dist = calc_distance(seq_a, seq_b, len_a, len_b,msa->L);
+                                dist = (float) (len_a > len_b ? d_sc[j] : d_cs[j]);
                                 dm[i][j] = dist;
                         }
                 }
         }
+        free_bpm_soa(soa);
+        MFREE(d_sc);
+        MFREE(d_cs);
         return dm;
 ERROR:
+        free_bpm_soa(soa);
+        MFREE(d_sc);
+        MFREE(d_cs);
         return NULL;
 }
 
-float calc_distance(uint8_t* seq_a, uint8_t* seq_b, int len_a,int len_b, int L)
+static struct bpm_soa* msa_to_soa(struct msa* msa)
 {
-#ifdef HAVE_AVX2
-        uint8_t dist;
-        if(len_a > len_b){
-                dist = bpm_256(seq_a, seq_b, len_a, len_b);
-        }else{
-                dist = bpm_256(seq_b, seq_a, len_b, len_a);
-        }
-        return (float)dist;
-#else
-        struct bignode* hash[1024];
+        struct bpm_soa* soa = NULL;
+        int max_len;
         int i;
-        float dist;
-        unsigned int hv;
-        for (i = 0;i < 1024;i++){
-                hash[i] = 0;
-        }
-        /* Protein sequence  */
-        if( L > defDNA){
-
-                for (i = len_a-2;i--;){
-                        hv = (seq_a[i] << 5) + seq_a[i+1];
-                        hash[hv] = big_insert_hash(hash[hv],i);
-                        hv = (seq_a[i] << 5) + seq_a[i+2];
-                        hash[hv] = big_insert_hash(hash[hv],i);
-                }
-
-                dist = protein_wu_distance_calculation(hash,seq_b,len_b,len_a+len_b,58.9);
-        }else{
-
-                for (i = len_a-5;i--;){
-                        hv = ((seq_a[i]&3)<<8) + ((seq_a[i+1]&3)<<6) + ((seq_a[i+2]&3)<<4)  + ((seq_a[i+3]&3)<<2) + (seq_a[i+4]&3);//ABCDE
-                        hash[hv] = big_insert_hash(hash[hv],i);
-                        hv = ((seq_a[i]&3)<<8) + ((seq_a[i+1]&3)<<6) + ((seq_a[i+2]&3)<<4)  + ((seq_a[i+3]&3)<<2) + (seq_a[i+5]&3);//ABCDF
-                        hash[hv] = big_insert_hash(hash[hv],i);
-                        hv = ((seq_a[i]&3)<<8) + ((seq_a[i+1]&3)<<6) + ((seq_a[i+2]&3)<<4)  + ((seq_a[i+4]&3)<<2) + (seq_a[i+5]&3);//ABCEF
-                        hash[hv] = big_insert_hash(hash[hv],i);
-                        hv = ((seq_a[i]&3)<<8) + ((seq_a[i+1]&3)<<6) + ((seq_a[i+3]&3)<<4)  + ((seq_a[i+4]&3)<<2) + (seq_a[i+5]&3);//ABDEF
-                        hash[hv] = big_insert_hash(hash[hv],i);
-                        hv = ((seq_a[i]&3)<<8) + ((seq_a[i+2]&3)<<6) + ((seq_a[i+3]&3)<<4) + ((seq_a[i+4]&3)<<2) + (seq_a[i+5]&3);//ACDEF
-                        hash[hv] = big_insert_hash(hash[hv],i);
-                }
-                dist = dna_distance_calculation(hash,seq_b,len_b,len_a+len_b, 61.08);
-        }
-
-
-        for (i = 1024;i--;){
-                if (hash[i]){
-                        big_remove_nodes(hash[i]);
-                        hash[i] = 0;
-                }
-        }
-        return dist;
-#endif
-
-}
-
-
-
-float protein_wu_distance_calculation(struct bignode* hash[],const uint8_t* seq,const int seqlen,const int diagonals,const float mode)
-{
-
-        struct bignode* node_p;
-        unsigned int* d = NULL;
-        unsigned int* tmp = NULL;
-        float out = 0.0;
-        register int i,j;
-        register int c;
-        register int num;
-        register unsigned int hv;
-
-        d = malloc(sizeof(unsigned int)*diagonals);
-        //for (i = diagonals;i--;){
-        for (i = 0;i < diagonals;i++){
-                d[i] = 0;
-        }
-        for (i = seqlen-2;i--;){
-                //for(i = 0; i < seqlen-2;i++){
-                /*hv = (seq[i+1] << 5) + seq[i+2];
-
-                node_p = hash[hv];
-                while(node_p){
-                        tmp = node_p->pos;
-                        for(j = 0;j < node_p->num;j++){
-                                d[tmp[j]]++;
-                        }
-                        node_p = node_p->next;
-                        }*/
-                hv = (seq[i] << 5) + seq[i+1];
-                //printf("3:%d\n",hv);
-                node_p = hash[hv];
-                while(node_p){
-                        tmp = node_p->pos;
-                        num = node_p->num;
-                        for(j = 0;j < num;j++){
-                                c = tmp[j];
-                                d[c]++;
-                                c++;
-                                d[c]++;
-                        }
-                        node_p = node_p->next;
-                }
-                hv = (seq[i] << 5) + seq[i+2];
-
-                node_p = hash[hv];
-
-                while(node_p){
-                        tmp = node_p->pos;
-                        num = node_p->num;
-                        for(j = 0;j < num;j++){
-                                c = tmp[j];
-                                d[c]++;
-                        }
-                        node_p = node_p->next;
-                        }
-                d++;
-
-
-
-        }
-        //exit(0);
-        d -= (seqlen-2);
-        //unsigned int max = 0.0;
-        for (i = diagonals;i--;){
-                //      if(d[i] > max){
-                //      max = d[i];
-                //}
-                //d[i] /= minlen;
-
-                //fprintf(stderr,"%d ",d[i]);
-                if(d[i] > mode){
-                        out += d[i];
-                        //	printf("%f	%d\n",d[i]/ minlen,d[i]);
-                }
-        }
-        free(d);
-        //return out;
-        return  out;
-}
-
 
-float dna_distance_calculation(struct bignode* hash[],const uint8_t * p,const int seqlen,int diagonals,float mode)
-{
-        struct bignode* node_p;
-        float out = 0.0;
-        unsigned int* tmp = NULL;
-        unsigned int* d = NULL;
-        int i,j;
-        unsigned int hv;
-
-        d = malloc(sizeof(int)*diagonals);
-        for (i = 0;i < diagonals;i++){
-                d[i] = 0;
+        max_len = 0;
+        for(i = 0; i < msa->numseq;i++){
+                max_len = MACRO_MAX(max_len, msa->sequences[i]->len);
         }
-        for (i = seqlen-5;i--;){
-
-                hv = ((p[i]&3)<<8) + ((p[i+1]&3)<<6) + ((p[i+2]&3)<<4)  + ((p[i+3]&3)<<2) + (p[i+4]&3);//ABCDE
-                if (hash[hv]){
-                        node_p = hash[hv];
-                        while(node_p){
-                                tmp = node_p->pos;
-                                for(j = 0;j < node_p->num;j++){
-                                        d[tmp[j]]++;
-                                }
-                                node_p = node_p->next;
-                        }
-                }
-
-
-                hv = ((p[i]&3)<<8) + ((p[i+1]&3)<<6) + ((p[i+2]&3)<<4)  + ((p[i+3]&3)<<2) + (p[i+5]&3);//ABCDF
-                if (hash[hv]){
-                        node_p = hash[hv];
-                        while(node_p){
-                                tmp = node_p->pos;
-                                for(j = 0;j < node_p->num;j++){
-                                        d[tmp[j]]++;
-                                }
-                                node_p = node_p->next;
-                        }
-                }
-                hv = ((p[i]&3)<<8) + ((p[i+1]&3)<<6) + ((p[i+2]&3)<<4)  + ((p[i+4]&3)<<2) + (p[i+5]&3);//ABCEF
-                if (hash[hv]){
-                        node_p = hash[hv];
-                        while(node_p){
-                                tmp = node_p->pos;
-                                for(j = 0;j < node_p->num;j++){
-                                        d[tmp[j]]++;
-                                }
-                                node_p = node_p->next;
-                        }
-                }
-                hv = ((p[i]&3)<<8) + ((p[i+1]&3)<<6) + ((p[i+3]&3)<<4)  + ((p[i+4]&3)<<2) + (p[i+5]&3);//ABDEF
-                if (hash[hv]){
-                        node_p = hash[hv];
-                        while(node_p){
-                                tmp = node_p->pos;
-                                for(j = 0;j < node_p->num;j++){
-                                        d[tmp[j]]++;
-                                }
-                                node_p = node_p->next;
-                        }
-                }
-                hv = ((p[i]&3)<<8) + ((p[i+2]&3)<<6) + ((p[i+3]&3)<<4) + ((p[i+4]&3)<<2) + (p[i+5]&3);//ACDEF
-                if (hash[hv]){
-                        node_p = hash[hv];
-                        while(node_p){
-                                tmp = node_p->pos;
-                                for(j = 0;j < node_p->num;j++){
-                                        d[tmp[j]]++;
-                                }
-                                node_p = node_p->next;
-                        }
-                }
-
-                d++;
+        RUNP(soa = alloc_bpm_soa(msa->numseq, max_len));
+        for(i = 0; i < msa->numseq;i++){
+                RUN(set_bpm_soa_seq(soa, i, msa->sequences[i]->s, msa->sequences[i]->len));
         }
-        //exit(0);
-        d -= (seqlen-5);
-
-        for (i = diagonals;i--;){
-                //d[i] /= minlen;
-
-                //printf("%d ",d[i]);
-
-                if(d[i] > mode){
-                        //fprintf(stderr,"%f	%d\n",d[i]/ minlen,d[i]);
-                        out += d[i];
-                }
-        }
-        free(d);
-        return out;
-}
-
-
-struct bignode* big_insert_hash(struct bignode *n,const unsigned int pos)
-{
-        struct bignode* p = NULL;
-        if(n){
-                if(n->num < NODESIZE){
-                        n->pos[n->num] = pos;
-                        n->num++;
-                        return n;
-                }else{
-                        MMALLOC(p, sizeof(struct bignode));
-                        p->pos[0] = pos;
-                        p->num = 1;
-                        p->next = n;
-                }
-        }else{
-                MMALLOC(p, sizeof(struct bignode));
-                p->pos[0] = pos;
-                p->num = 1;
-                p->next = n;
-        }
-        return p;
+        return soa;
 ERROR:
+        free_bpm_soa(soa);
         return NULL;
 }
-
-void big_remove_nodes(struct bignode *n)
-{
-        struct bignode* p = NULL;
-        while(n){
-                p = n;
-                n = n->next;
-                MFREE(p);
-        }
-}
-
-void big_print_nodes(struct bignode *n)
-{
-        int i;
-        while(n){
-                for (i = 0; i < n->num;i++){
-                        fprintf(stderr,"%d ",n->pos[i]);
-                }
-                n = n->next;
-        }
-}
@@ -0,0 +1,88 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "tldevel.h"
+
+#include "simd.h"
+
+static int simd_selected = SIMD_SCALAR;
+
+int init_simd(void)
+{
+        int level;
+
+        level = simd_cpu_level();
+        RUN(bpm_set_simd(level));
+        RUN(edist_set_simd(level));
+        RUN(alphabet_set_simd(level));
+        simd_selected = level;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int simd_cpu_level(void)
+{
+        int level = SIMD_SCALAR;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+#ifdef HAVE_SSE41
+        if(__builtin_cpu_supports("sse4.1")){
+                level = SIMD_SSE41;
+        }
+#endif
+#ifdef HAVE_AVX2
+        if(level == SIMD_SSE41 && __builtin_cpu_supports("avx2")){
+                level = SIMD_AVX2;
+        }
+#endif
+#ifdef HAVE_AVX512
+        if(level == SIMD_AVX2 &&
+           __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vl")){
+                level = SIMD_AVX512;
+        }
+#endif
+#endif
+        return level;
+}
+
+int simd_level(void)
+{
+        return simd_selected;
+}
+
+const char* simd_level_name(int level)
+{
+        switch (level) {
+        case SIMD_SSE41:
+                return "generic (SSE4.1 encoding)";
+        case SIMD_AVX2:
+                return "AVX2";
+        case SIMD_AVX512:
+                return "AVX-512";
+        default:
+                break;
+        }
+        return "generic";
+}
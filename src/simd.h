@@ -0,0 +1,72 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* Instruction set levels, each including the ones below. The kernels in
+   bpm.c, euclidean_dist.c and alphabet.c are compiled once per level
+   (HAVE_SSE41 / HAVE_AVX2 / HAVE_AVX512 say the compiler can build
+   them) and init_simd() picks the best one the CPU runs. The base
+   level uses the generic vector extensions of GCC and Clang (SSE2 on
+   x86-64, NEON on arm64) where the compiler has them. SSE4.1 only adds
+   the residue encoder: edit and euclidean distances keep the base
+   kernels below AVX2. */
+#define SIMD_SCALAR 0
+#define SIMD_SSE41 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+
+/* Function attributes of the per level kernels: the rest of the program
+   is built for the baseline architecture. */
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw,avx512vl")))
+
+/* Name of a kernel in a file included once per level: SIMD_FN(bpm_wide)
+   becomes bpm_wide_avx2 when SIMD_SUFFIX is avx2. */
+#define SIMD_PASTE_(name, suffix) name##_##suffix
+#define SIMD_PASTE(name, suffix) SIMD_PASTE_(name, suffix)
+#define SIMD_FN(name) SIMD_PASTE(name, SIMD_SUFFIX)
+
+/* Detects the CPU and selects the kernels of all modules. Must be called
+   once before any threads are started; until then the scalar kernels
+   are used. */
+extern int init_simd(void);
+
+/* Best level supported by both the CPU and the build.  */
+extern int simd_cpu_level(void);
+/* Level selected by init_simd().  */
+extern int simd_level(void);
+extern const char* simd_level_name(int level);
+
+/* Per module setters called by init_simd(); level may be lower than
+   what the CPU supports (the unit tests run every level).  */
+extern int bpm_set_simd(int level);
+extern int edist_set_simd(int level);
+extern int alphabet_set_simd(int level);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "snb.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNB_MMAP 1
+#endif
+
+#define SNB_ALIGN(x) (((x) + 7) & ~((int64_t) 7))
+
+static int write_block(FILE* f_ptr, const void* p, size_t n);
+static int write_padding(FILE* f_ptr, int64_t n);
+static int map_snb(char* infile, char** map, size_t* size);
+
+int write_snb(struct msa* msa, int num_records, char* outfile)
+{
+        struct snb_header h;
+        struct snb_record* rec = NULL;
+        struct msa_seq* seq = NULL;
+        FILE* f_ptr = NULL;
+        int* pos = NULL;
+        int64_t name_off;
+        int64_t seq_off;
+        int64_t abund_off;
+        int64_t sample_off;
+        int i;
+
+        MMALLOC(rec, sizeof(struct snb_record) * num_records);
+        MMALLOC(pos, sizeof(int) * num_records);
+
+        for(i = 0; i < num_records;i++){
+                pos[msa->sequences[i] - msa->seq_store] = i;
+        }
+        name_off = 0;
+        seq_off = 0;
+        abund_off = 0;
+        for(i = 0; i < num_records;i++){
+                seq = msa->sequences[i];
+                rec[i].name_off = name_off;
+                rec[i].seq_off = seq_off;
+                rec[i].name_len = seq->name_len;
+                rec[i].len = seq->len;
+                rec[i].count = seq->count;
+                rec[i].dup = -1;
+                if(seq->dup){
+                        rec[i].dup = pos[seq->dup - msa->seq_store];
+                }
+                rec[i].abund_off = abund_off;
+                rec[i].num_abund = seq->num_abund;
+                rec[i].pad = 0;
+                name_off += seq->name_len;
+                seq_off += seq->len + 1;
+                abund_off += seq->num_abund;
+        }
+        sample_off = 0;
+        if(msa->sample_names){
+                for(i = 0; i < msa->num_samples;i++){
+                        sample_off += strlen(msa->sample_names[i]) + 1;
+                }
+        }
+
+        memset(&h, 0, sizeof(struct snb_header));
+        memcpy(h.magic, SNB_MAGIC, 8);
+        h.version = SNB_VERSION;
+        h.byte_order = SNB_BYTE_ORDER;
+        h.L = msa->L;
+        h.alphabet = msa->encoded;
+        h.num_records = num_records;
+        h.num_unique = msa->numseq;
+        h.names_size = name_off;
+        h.residues_size = seq_off;
+        h.num_samples = msa->sample_names ? msa->num_samples : 0;
+        h.sample_names_size = sample_off;
+        h.num_abund = abund_off;
+
+        if((f_ptr = fopen(outfile, "wb")) == NULL){
+                ERROR_MSG("Could not open %s for writing.", outfile);
+        }
+        RUN(write_block(f_ptr, &h, sizeof(struct snb_header)));
+        RUN(write_block(f_ptr, rec, sizeof(struct snb_record) * num_records));
+        for(i = 0; i < num_records;i++){
+                RUN(write_block(f_ptr, msa->sequences[i]->name, msa->sequences[i]->name_len));
+        }
+        RUN(write_padding(f_ptr, SNB_ALIGN(name_off) - name_off));
+        for(i = 0; i < num_records;i++){
+                RUN(write_block(f_ptr, msa->sequences[i]->seq, msa->sequences[i]->len + 1));
+        }
+        RUN(write_padding(f_ptr, SNB_ALIGN(seq_off) - seq_off));
+        for(i = 0; i < num_records;i++){
+                RUN(write_block(f_ptr, msa->sequences[i]->s, msa->sequences[i]->len));
+                RUN(write_padding(f_ptr, 1));
+        }
+        RUN(write_padding(f_ptr, SNB_ALIGN(seq_off) - seq_off));
+        for(i = 0; i < h.num_samples;i++){
+                RUN(write_block(f_ptr, msa->sample_names[i], strlen(msa->sample_names[i]) + 1));
+        }
+        RUN(write_padding(f_ptr, SNB_ALIGN(sample_off) - sample_off));
+        for(i = 0; i < num_records;i++){
+                RUN(write_block(f_ptr, msa->sequences[i]->abund, sizeof(struct sample_count) * msa->sequences[i]->num_abund));
+        }
+        if(fclose(f_ptr)){
+                f_ptr = NULL;
+                ERROR_MSG("Could not write %s.", outfile);
+        }
+        f_ptr = NULL;
+        LOG_MSG("Wrote %d records to %s.", num_records, outfile);
+        MFREE(rec);
+        MFREE(pos);
+        return OK;
+ERROR:
+        if(f_ptr){
+                fclose(f_ptr);
+        }
+        if(rec){
+                MFREE(rec);
+        }
+        if(pos){
+                MFREE(pos);
+        }
+        return FAIL;
+}
+
+/* Maps a .snb file and sets up the records as views into it; the file
+   is checked only as far as needed to keep every view inside it. */
+struct msa* read_snb(char* infile, struct msa* msa)
+{
+        struct snb_header* h = NULL;
+        struct snb_record* rec = NULL;
+        struct msa_seq* seq = NULL;
+        char* map = NULL;
+        char* names = NULL;
+        char* residues = NULL;
+        char* internal = NULL;
+        char* samples = NULL;
+        struct sample_count* abund = NULL;
+        size_t size = 0;
+        int64_t need;
+        int64_t off;
+        int64_t j;
+        int i;
+
+        if(msa){
+                ASSERT(msa->numseq == 0, "A .snb file can not be combined with other input.");
+                free_msa(msa);
+                msa = NULL;
+        }
+        RUN(map_snb(infile, &map, &size));
+        RUNP(msa = alloc_msa());
+        msa->map = map;
+        msa->map_size = size;
+
+        if(size < sizeof(struct snb_header)){
+                ERROR_MSG("%s is truncated.", infile);
+        }
+        h = (struct snb_header*) map;
+        if(memcmp(h->magic, SNB_MAGIC, 8)){
+                ERROR_MSG("%s is not a .snb file.", infile);
+        }
+        if(h->version != SNB_VERSION || h->byte_order != SNB_BYTE_ORDER){
+                ERROR_MSG("%s was written by an incompatible version (%u).", infile, h->version);
+        }
+        if(h->num_records < 0 || h->num_unique < 0 || h->num_unique > h->num_records || h->names_size < 0 || h->residues_size < 0 ||
+           h->num_samples < 0 || h->sample_names_size < 0 || h->num_abund < 0){
+                ERROR_MSG("%s is corrupt.", infile);
+        }
+        need = sizeof(struct snb_header) + sizeof(struct snb_record) * (int64_t) h->num_records;
+        rec = (struct snb_record*) (map + sizeof(struct snb_header));
+        names = map + need;
+        need += SNB_ALIGN(h->names_size);
+        residues = map + need;
+        need += SNB_ALIGN(h->residues_size);
+        internal = map + need;
+        need += SNB_ALIGN(h->residues_size);
+        samples = map + need;
+        need += SNB_ALIGN(h->sample_names_size);
+        abund = (struct sample_count*) (map + need);
+        if(h->num_abund > (int64_t) (size / sizeof(struct sample_count))){
+                ERROR_MSG("%s is truncated.", infile);
+        }
+        need += sizeof(struct sample_count) * h->num_abund;
+        if((int64_t) size < need){
+                ERROR_MSG("%s is truncated.", infile);
+        }
+        if(h->num_samples){
+                MMALLOC(msa->sample_names, sizeof(char*) * h->num_samples);
+                for(i = 0; i < h->num_samples;i++){
+                        msa->sample_names[i] = NULL;
+                }
+                msa->num_samples = h->num_samples;
+                off = 0;
+                for(i = 0; i < h->num_samples;i++){
+                        need = off;
+                        while(off < h->sample_names_size && samples[off]){
+                                off++;
+                        }
+                        if(off == h->sample_names_size){
+                                ERROR_MSG("%s is corrupt (sample %d).", infile, i);
+                        }
+                        off++;
+                        MMALLOC(msa->sample_names[i], sizeof(char) * (off - need));
+                        memcpy(msa->sample_names[i], samples + need, off - need);
+                }
+                for(j = 0; j < h->num_abund;j++){
+                        if(abund[j].sample < 0 || abund[j].sample >= h->num_samples){
+                                ERROR_MSG("%s is corrupt (sample count %ld).", infile, (long int) j);
+                        }
+                }
+        }else if(h->num_abund){
+                ERROR_MSG("%s is corrupt.", infile);
+        }
+
+        while(msa->alloc_numseq < h->num_records){
+                RUN(resize_msa(msa));
+        }
+        for(i = 0; i < h->num_records;i++){
+                if(rec[i].name_len < 1 || rec[i].len < 0 ||
+                   rec[i].name_off < 0 || rec[i].name_off + rec[i].name_len > h->names_size ||
+                   rec[i].seq_off < 0 || rec[i].seq_off + rec[i].len + 1 > h->residues_size ||
+                   rec[i].dup < -1 || rec[i].dup >= h->num_records ||
+                   rec[i].num_abund < 0 || rec[i].abund_off < 0 || rec[i].abund_off + rec[i].num_abund > h->num_abund ||
+                   names[rec[i].name_off + rec[i].name_len - 1] != 0 ||
+                   residues[rec[i].seq_off + rec[i].len] != 0){
+                        ERROR_MSG("%s is corrupt (record %d).", infile, i);
+                }
+                seq = msa->seq_store + i;
+                seq->name = names + rec[i].name_off;
+                seq->seq = residues + rec[i].seq_off;
+                seq->s = (uint8_t*) internal + rec[i].seq_off;
+                seq->gaps = NULL;
+                seq->dup = NULL;
+                seq->abund = NULL;
+                seq->num_abund = rec[i].num_abund;
+                seq->sample = 0;
+                if(seq->num_abund){
+                        seq->abund = abund + rec[i].abund_off;
+                }
+                if(rec[i].dup != -1){
+                        seq->dup = msa->seq_store + rec[i].dup;
+                }
+                seq->len = rec[i].len;
+                seq->name_len = rec[i].name_len;
+                seq->count = rec[i].count;
+                seq->cluster = 0;
+                msa->sequences[i] = seq;
+        }
+        msa->numseq = h->num_records;
+        msa->num_unique = h->num_unique;
+        msa->L = h->L;
+        msa->encoded = h->alphabet;
+        msa->aligned = 0;
+        return msa;
+ERROR:
+        free_msa(msa);
+        return NULL;
+}
+
+void free_snb_map(struct msa* msa)
+{
+        if(msa->map){
+#ifdef SNB_MMAP
+                munmap(msa->map, msa->map_size);
+#else
+                MFREE(msa->map);
+#endif
+        }
+        msa->map = NULL;
+        msa->map_size = 0;
+}
+
+/* The mapping is private and writable so the records behave like ones
+   read from a sequence file. */
+int map_snb(char* infile, char** map, size_t* size)
+{
+#ifdef SNB_MMAP
+        struct stat st;
+        char* m = NULL;
+        int fd;
+
+        if((fd = open(infile, O_RDONLY)) == -1){
+                ERROR_MSG("Could not open %s.", infile);
+        }
+        if(fstat(fd, &st) || st.st_size == 0){
+                close(fd);
+                ERROR_MSG("Could not stat %s.", infile);
+        }
+        m = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(m == MAP_FAILED){
+                ERROR_MSG("Could not map %s.", infile);
+        }
+        *map = m;
+        *size = st.st_size;
+        return OK;
+#else
+        FILE* f_ptr = NULL;
+        char* m = NULL;
+        long int n;
+
+        RUNP(f_ptr = fopen(infile, "rb"));
+        fseek(f_ptr, 0, SEEK_END);
+        n = ftell(f_ptr);
+        rewind(f_ptr);
+        MMALLOC(m, n);
+        if(fread(m, 1, n, f_ptr) != (size_t) n){
+                ERROR_MSG("Could not read %s.", infile);
+        }
+        fclose(f_ptr);
+        *map = m;
+        *size = n;
+        return OK;
+#endif
+ERROR:
+#ifndef SNB_MMAP
+        if(f_ptr){
+                fclose(f_ptr);
+        }
+        if(m){
+                MFREE(m);
+        }
+#endif
+        return FAIL;
+}
+
+int write_block(FILE* f_ptr, const void* p, size_t n)
+{
+        if(n && fwrite(p, 1, n, f_ptr) != n){
+                ERROR_MSG("Write failed.");
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+int write_padding(FILE* f_ptr, int64_t n)
+{
+        char zero[8] = {0,0,0,0,0,0,0,0};
+
+        ASSERT(n >= 0 && n <= 8, "Bad padding.");
+        RUN(write_block(f_ptr, zero, n));
+        return OK;
+ERROR:
+        return FAIL;
+}
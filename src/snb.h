@@ -0,0 +1,80 @@
+/*
+    Kalign - a multiple sequence alignment program
+
+    Copyright 2006, 2019 Timo Lassmann
+
+    This file is part of kalign.
+
+    Kalign is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SNB_H
+#define SNB_H
+
+#include "global.h"
+#include "msa.h"
+
+#define SNB_MAGIC "SEQNETB"     /* with its 0 the first 8 bytes of a file */
+#define SNB_VERSION 2
+#define SNB_BYTE_ORDER 0x01020304
+
+/* Binary cache of a prepared input (.snb).
+
+   Holds the records after counts were taken from the headers, identical
+   sequences were merged and the unique sequences were sorted by count,
+   i.e. msa->sequences as the clustering sees it. Layout:
+
+   header | records | names | raw residues | encoded residues |
+   sample names | sample counts
+
+   each block starting on an 8 byte boundary. Records refer to the blocks
+   by offset; residues are 0 terminated in both blocks. The sample blocks
+   are empty unless the input was pooled: then they hold the 0 terminated
+   sample names and the per-sample counts of the unique sequences. On
+   reading the file is mapped and the records point straight into the
+   mapping. */
+struct snb_header{
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        int32_t L;
+        int32_t alphabet;
+        int32_t num_records;
+        int32_t num_unique;
+        int64_t names_size;
+        int64_t residues_size;
+        int32_t num_samples;
+        int32_t pad;
+        int64_t sample_names_size;
+        int64_t num_abund;
+};
+
+struct snb_record{
+        int64_t name_off;
+        int64_t seq_off;
+        int32_t name_len;
+        int32_t len;
+        int32_t count;
+        int32_t dup;            /* next record with the same sequence; -1 if none */
+        int64_t abund_off;      /* first sample count, in entries */
+        int32_t num_abund;
+        int32_t pad;
+};
+
+extern int write_snb(struct msa* msa, int num_records, char* outfile);
+extern struct msa* read_snb(char* infile, struct msa* msa);
+extern void free_snb_map(struct msa* msa);
+
+#endif